@@ -0,0 +1,164 @@
+//
+//  Measure decodeEvents() (tprcolumns.hh) on generated 929kHz traffic:
+//  the time to turn a second of frames into columns, in batches as a
+//  Reader returns them, with and without AVX2.  Checks both decoders agree.
+//  A whole second of frames does not fit in cache, so memory bandwidth
+//  bounds the default run; a small -n (and more -p) shows the cost on
+//  frames just copied out by a Reader.
+//
+#include <stdio.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "tprcolumns.hh"
+
+using namespace Tpr;
+
+extern int optind;
+
+static void usage(const char* p) {
+    printf("Usage: %s [options]\n",p);
+    printf("          -n <frames>  : frames to decode (929000 is a second at the full rate)\n");
+    printf("          -b <frames>  : frames per decodeEvents() call\n");
+    printf("          -p <passes>  : passes over the frames\n");
+}
+
+static double now()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return double(ts.tv_sec)+1.e-9*double(ts.tv_nsec);
+}
+
+//  Events of a 929kHz channel, with the fixed rate markers of each pulse
+static void generate(Frame* f, unsigned n)
+{
+    static const unsigned period[] = { 1, 13, 91, 910, 9100, 91000, 910000 };
+    uint64_t sec = 1000000000ULL;
+    for(unsigned i=0; i<n; i++) {
+        uint64_t pid = 0x1234500000ULL + i;
+        uint64_t ns  = (pid*1077) % sec;
+        uint64_t ts  = ((pid*1077/sec)<<32) | ns;
+        uint32_t rates = 0;
+        for(unsigned r=0; r<7; r++)
+            if (pid % period[r] == 0)
+                rates |= 1<<r;
+        memset(&f[i], 0, sizeof(f[i]));
+        f[i].word[0] = (Frame::Event<<16) | ((i%97)==0 ? (0x808<<20) : 0) | (1 + (i&0xfff));
+        f[i].word[1] = (92-8)>>2;
+        f[i].word[2] = uint32_t(pid);
+        f[i].word[3] = uint32_t(pid>>32);
+        f[i].word[4] = uint32_t(ts);
+        f[i].word[5] = uint32_t(ts>>32);
+        f[i].word[6] = rates | ((pid%360 ? 0 : 0x3f)<<10) | ((1+pid%6)<<16) | ((pid%4096)<<19);
+        f[i].word[7] = uint32_t(pid*2654435761U);
+        f[i].seq     = i;
+    }
+}
+
+static bool same(const EventColumns& a, const EventColumns& b)
+{
+    if (a.size != b.size)
+        return false;
+    for(size_t i=0; i<a.size; i++)
+        if (a.pulseId[i]       != b.pulseId[i] ||
+            a.timeStamp[i]     != b.timeStamp[i] ||
+            a.fixedRates[i]    != b.fixedRates[i] ||
+            a.acRates[i]       != b.acRates[i] ||
+            a.timeSlot[i]      != b.timeSlot[i] ||
+            a.timeSlotPhase[i] != b.timeSlotPhase[i] ||
+            a.beamRequest[i]   != b.beamRequest[i] ||
+            a.channels[i]      != b.channels[i] ||
+            a.drop[i]          != b.drop[i]) {
+            printf("  differ at %zu\n", i);
+            return false;
+        }
+    return true;
+}
+
+//  Seconds per pass
+static double run(const Frame* f, unsigned n, unsigned batch, unsigned npasses,
+                  EventColumns& c, bool simd)
+{
+    double t0 = now();
+    for(unsigned ipass=0; ipass<npasses; ipass++) {
+        c.clear();
+        for(unsigned i=0; i<n; i+=batch)
+            decodeEvents(std::span<const Frame>(f+i, i+batch<n ? batch : n-i), c, simd);
+    }
+    return (now()-t0)/double(npasses);
+}
+
+int main(int argc, char** argv) {
+
+    extern char* optarg;
+    unsigned nframes = 929000;
+    unsigned batch   = 64;
+    unsigned npasses = 20;
+
+    int c;
+    bool lUsage = false;
+
+    while ( (c=getopt( argc, argv, "n:b:p:h?")) != EOF ) {
+        switch(c) {
+        case 'n':
+            nframes = strtoul(optarg,NULL,0);
+            if (!nframes)
+                lUsage = true;
+            break;
+        case 'b':
+            batch = strtoul(optarg,NULL,0);
+            if (!batch)
+                lUsage = true;
+            break;
+        case 'p':
+            npasses = strtoul(optarg,NULL,0);
+            if (!npasses)
+                lUsage = true;
+            break;
+        case 'h':
+            usage(argv[0]);
+            exit(0);
+        case '?':
+        default:
+            lUsage = true;
+            break;
+        }
+    }
+
+    if (optind < argc) {
+        printf("%s: invalid argument -- %s\n",argv[0], argv[optind]);
+        lUsage = true;
+    }
+
+    if (lUsage) {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    Frame* f = new Frame[nframes];
+    generate(f, nframes);
+
+    EventColumns scalar(nframes), simd(nframes);
+    double ts = run(f, nframes, batch, npasses, scalar, false);
+    double tv = simdDecode() ? run(f, nframes, batch, npasses, simd, true) : 0;
+
+    double sec = double(nframes)/929000.;
+    printf("%u frames (%.3f s at 929kHz) in batches of %u, %u passes\n",
+           nframes, sec, batch, npasses);
+    printf("  scalar  : %8.3f ms per second of traffic  %6.2f ns/frame\n",
+           ts*1.e3/sec, ts*1.e9/double(nframes));
+    if (simdDecode()) {
+        printf("  avx2    : %8.3f ms per second of traffic  %6.2f ns/frame\n",
+               tv*1.e3/sec, tv*1.e9/double(nframes));
+        printf("  agree   : %s\n", same(scalar, simd) ? "yes" : "NO");
+    }
+    else
+        printf("  avx2    : not available\n");
+
+    delete[] f;
+    return 0;
+}
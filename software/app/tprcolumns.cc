@@ -0,0 +1,205 @@
+#include "tprcolumns.hh"
+
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TPR_AVX2 1
+#endif
+
+using namespace Tpr;
+
+void EventColumns::reserve(size_t capacity)
+{
+  pulseId      .resize(capacity);
+  timeStamp    .resize(capacity);
+  fixedRates   .resize(capacity);
+  acRates      .resize(capacity);
+  timeSlot     .resize(capacity);
+  timeSlotPhase.resize(capacity);
+  beamRequest  .resize(capacity);
+  channels     .resize(capacity);
+  drop         .resize(capacity);
+  if (size > capacity)
+    size = capacity;
+}
+
+void BsaColumns::reserve(size_t capacity)
+{
+  pulseId  .resize(capacity);
+  timeStamp.resize(capacity);
+  init     .resize(capacity);
+  minor    .resize(capacity);
+  major    .resize(capacity);
+  active   .resize(capacity);
+  avgDone  .resize(capacity);
+  update   .resize(capacity);
+  if (size > capacity)
+    size = capacity;
+}
+
+static inline void decode_one(const Frame& f, EventColumns& out, size_t j)
+{
+  const uint32_t* w = f.word;
+  out.pulseId      [j] = uint64_t(w[2]) | (uint64_t(w[3])<<32);
+  out.timeStamp    [j] = uint64_t(w[4]) | (uint64_t(w[5])<<32);
+  out.fixedRates   [j] = (w[6]>> 0)&0x3ff;
+  out.acRates      [j] = (w[6]>>10)&0x3f;
+  out.timeSlot     [j] = (w[6]>>16)&0x7;
+  out.timeSlotPhase[j] = (w[6]>>19)&0xfff;
+  out.beamRequest  [j] = w[7];
+  out.channels     [j] = w[0]&((1<<MOD_SHARED)-1);
+  out.drop         [j] = (w[0]&(0x808<<20)) != 0;
+}
+
+#ifdef TPR_AVX2
+__attribute__((target("avx2")))
+static inline void store16(uint16_t* p, __m256i v)
+{
+  __m256i w = _mm256_permute4x64_epi64(_mm256_packus_epi32(v, v), 0x08);
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(p), _mm256_castsi256_si128(w));
+}
+
+__attribute__((target("avx2")))
+static inline void store8(uint8_t* p, __m256i v)
+{
+  __m256i h = _mm256_packus_epi32(v, v);
+  __m256i w = _mm256_packus_epi16(h, h);
+  uint32_t lo = _mm256_extract_epi32(w, 0), hi = _mm256_extract_epi32(w, 4);
+  memcpy(p  , &lo, 4);
+  memcpy(p+4, &hi, 4);
+}
+
+//  Words lo,hi of eight frames (as columns) to their eight 64-bit values
+__attribute__((target("avx2")))
+static inline void store64(uint64_t* p, __m256i lo, __m256i hi)
+{
+  __m256i a = _mm256_unpacklo_epi32(lo, hi);   // 0 1 | 4 5
+  __m256i b = _mm256_unpackhi_epi32(lo, hi);   // 2 3 | 6 7
+  _mm256_storeu_si256(reinterpret_cast<__m256i*>(p  ), _mm256_permute2x128_si256(a, b, 0x20));
+  _mm256_storeu_si256(reinterpret_cast<__m256i*>(p+4), _mm256_permute2x128_si256(a, b, 0x31));
+}
+
+__attribute__((target("avx2")))
+static size_t decode_avx2(const Frame* f, size_t n, EventColumns& out, size_t j)
+{
+  const __m256i chmask = _mm256_set1_epi32((1<<MOD_SHARED)-1);
+  const __m256i dropm  = _mm256_set1_epi32(0x808<<20);
+  const __m256i one    = _mm256_set1_epi32(1);
+  size_t i;
+  for(i=0; i+8<=n; i+=8, j+=8) {
+    __m256i r[8];
+    for(unsigned k=0; k<8; k++)
+      r[k] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(f[i+k].word));
+
+    //  8x8 transpose: c[w] holds word w of the eight frames
+    __m256i t0 = _mm256_unpacklo_epi32(r[0], r[1]);
+    __m256i t1 = _mm256_unpackhi_epi32(r[0], r[1]);
+    __m256i t2 = _mm256_unpacklo_epi32(r[2], r[3]);
+    __m256i t3 = _mm256_unpackhi_epi32(r[2], r[3]);
+    __m256i t4 = _mm256_unpacklo_epi32(r[4], r[5]);
+    __m256i t5 = _mm256_unpackhi_epi32(r[4], r[5]);
+    __m256i t6 = _mm256_unpacklo_epi32(r[6], r[7]);
+    __m256i t7 = _mm256_unpackhi_epi32(r[6], r[7]);
+    __m256i u0 = _mm256_unpacklo_epi64(t0, t2);    // words 0 | 4
+    __m256i u1 = _mm256_unpackhi_epi64(t0, t2);    // words 1 | 5
+    __m256i u2 = _mm256_unpacklo_epi64(t1, t3);    // words 2 | 6
+    __m256i u3 = _mm256_unpackhi_epi64(t1, t3);    // words 3 | 7
+    __m256i u4 = _mm256_unpacklo_epi64(t4, t6);
+    __m256i u5 = _mm256_unpackhi_epi64(t4, t6);
+    __m256i u6 = _mm256_unpacklo_epi64(t5, t7);
+    __m256i u7 = _mm256_unpackhi_epi64(t5, t7);
+    __m256i c0 = _mm256_permute2x128_si256(u0, u4, 0x20);
+    __m256i c2 = _mm256_permute2x128_si256(u2, u6, 0x20);
+    __m256i c3 = _mm256_permute2x128_si256(u3, u7, 0x20);
+    __m256i c4 = _mm256_permute2x128_si256(u0, u4, 0x31);
+    __m256i c5 = _mm256_permute2x128_si256(u1, u5, 0x31);
+    __m256i c6 = _mm256_permute2x128_si256(u2, u6, 0x31);
+    __m256i c7 = _mm256_permute2x128_si256(u3, u7, 0x31);
+
+    store64(&out.pulseId  [j], c2, c3);
+    store64(&out.timeStamp[j], c4, c5);
+    store16(&out.fixedRates   [j], _mm256_and_si256(c6, _mm256_set1_epi32(0x3ff)));
+    store8 (&out.acRates      [j], _mm256_and_si256(_mm256_srli_epi32(c6, 10), _mm256_set1_epi32(0x3f)));
+    store8 (&out.timeSlot     [j], _mm256_and_si256(_mm256_srli_epi32(c6, 16), _mm256_set1_epi32(0x7)));
+    store16(&out.timeSlotPhase[j], _mm256_and_si256(_mm256_srli_epi32(c6, 19), _mm256_set1_epi32(0xfff)));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(&out.beamRequest[j]), c7);
+    store16(&out.channels     [j], _mm256_and_si256(c0, chmask));
+    __m256i d = _mm256_cmpeq_epi32(_mm256_and_si256(c0, dropm), _mm256_setzero_si256());
+    store8 (&out.drop         [j], _mm256_andnot_si256(d, one));
+  }
+  return i;
+}
+#endif
+
+bool Tpr::simdDecode()
+{
+#ifdef TPR_AVX2
+  static const bool avx2 = __builtin_cpu_supports("avx2");
+  return avx2;
+#else
+  return false;
+#endif
+}
+
+size_t Tpr::decodeEvents(std::span<const Frame> in, EventColumns& out, bool simd)
+{
+  size_t n = in.size();
+  if (n > out.pulseId.size() - out.size)
+    n = out.pulseId.size() - out.size;
+
+  size_t i = 0;
+#ifdef TPR_AVX2
+  if (simd && simdDecode())
+    i = decode_avx2(in.data(), n, out, out.size);
+#endif
+  for(; i<n; i++)
+    decode_one(in[i], out, out.size+i);
+  out.size += n;
+  return n;
+}
+
+size_t Tpr::decodeBsa(std::span<const Frame> in, BsaColumns& out)
+{
+  size_t i;
+  for(i=0; i<in.size(); i++) {
+    const Frame& f = in[i];
+    uint64_t pid;
+    if (f.isBsaControl())
+      pid = f.bsaControl().pulseId();
+    else if (f.isBsaEvent())
+      pid = f.bsaEvent().pulseId();
+    else
+      continue;
+
+    //  The pulse's other message may have started the row, even in an
+    //  earlier batch
+    size_t j = out.size;
+    if (j && out.pulseId[j-1] == pid)
+      j--;
+    else {
+      if (j == out.pulseId.size())
+        break;
+      out.pulseId  [j] = pid;
+      out.timeStamp[j] = 0;
+      out.init     [j] = out.minor  [j] = out.major [j] = 0;
+      out.active   [j] = out.avgDone[j] = out.update[j] = 0;
+      out.size++;
+    }
+
+    if (f.isBsaControl()) {
+      BsaControlMsg m = f.bsaControl();
+      out.timeStamp[j] = m.timeStamp();
+      out.init     [j] = m.init();
+      out.minor    [j] = m.minor();
+      out.major    [j] = m.major();
+    }
+    else {
+      BsaEventMsg m = f.bsaEvent();
+      out.timeStamp[j] = m.timeStamp();
+      out.active   [j] = m.active();
+      out.avgDone  [j] = m.avgDone();
+      out.update   [j] = m.update();
+    }
+  }
+  return i;
+}
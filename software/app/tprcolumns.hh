@@ -0,0 +1,81 @@
+#ifndef TPRCOLUMNS_HH
+#define TPRCOLUMNS_HH
+
+//
+//  Batch decoding of Reader frames into columns (structure of arrays) for
+//  analysis.  The event message is the card's timing message without its
+//  BSA fields (toSlvNoBsa in the firmware), after the tag and size words:
+//
+//    word 2-3  pulseId
+//    word 4-5  timeStamp (seconds << 32 | ns)
+//    word 6    fixedRates[9:0] acRates[15:10] acTimeSlot[18:16]
+//              acTimeSlotPhase[30:19] resync[31]
+//    word 7    beamRequest
+//
+//  Events carry no BSA masks; they come in the BSA control and event
+//  messages of the BSA queue, which decodeBsa() joins by pulse ID.
+//
+//  decodeEvents() uses AVX2 when the CPU has it, eight frames per step
+//  through an 8x8 transpose of their first eight words; otherwise, and
+//  for the remainder, it decodes one frame at a time.
+//
+#include <stdint.h>
+#include <span>
+#include <vector>
+
+#include "tprreader.hh"
+
+namespace Tpr {
+
+  class EventColumns {
+  public:
+    EventColumns(size_t capacity=0) : size(0) { reserve(capacity); }
+  public:
+    void reserve(size_t capacity);
+    void clear  () { size = 0; }
+  public:
+    size_t                size;
+    std::vector<uint64_t> pulseId;
+    std::vector<uint64_t> timeStamp;
+    std::vector<uint16_t> fixedRates;     // bit i: FixedRate i marker
+    std::vector<uint8_t>  acRates;        // bit i: ACRate i marker
+    std::vector<uint8_t>  timeSlot;       // 1..6
+    std::vector<uint16_t> timeSlotPhase;
+    std::vector<uint32_t> beamRequest;
+    std::vector<uint16_t> channels;       // channel mask the card set
+    std::vector<uint8_t>  drop;           // a hardware drop preceded it
+  };
+
+  //  One row per pulse with BSA activity
+  class BsaColumns {
+  public:
+    BsaColumns(size_t capacity=0) : size(0) { reserve(capacity); }
+  public:
+    void reserve(size_t capacity);
+    void clear  () { size = 0; }
+  public:
+    size_t                size;
+    std::vector<uint64_t> pulseId;
+    std::vector<uint64_t> timeStamp;
+    std::vector<uint64_t> init;           // masks of EDEFs, from BSA control
+    std::vector<uint64_t> minor;
+    std::vector<uint64_t> major;
+    std::vector<uint64_t> active;         //   from BSA event
+    std::vector<uint64_t> avgDone;
+    std::vector<uint64_t> update;
+  };
+
+  //
+  //  Append the events of a channel's frames to out, up to its capacity;
+  //  how many were appended.  The frames must all be events (as a channel
+  //  Reader returns).  simd=false forces the one-at-a-time decoder.
+  //
+  size_t decodeEvents(std::span<const Frame> in, EventColumns& out, bool simd=true);
+  //  Append the BSA queue's frames to out, a BSA control message and the
+  //  BSA event of the same pulse making one row; how many frames were used.
+  size_t decodeBsa   (std::span<const Frame> in, BsaColumns& out);
+  //  decodeEvents() can use AVX2 here
+  bool   simdDecode  ();
+};
+
+#endif
@@ -0,0 +1,351 @@
+//
+//  Run the driver's DMA decode path (kernel/tpr_decode.h) in user space on
+//  generated DMA buffers, to measure decode changes without a card.  The
+//  buffers mix EVENT and BSA messages with the chosen channel masks and
+//  drop bits; each is decoded as the tasklet would, into a queue window of
+//  the chosen layout.  In the zero-copy layout the buffers also go through
+//  the driver's hold and recycle cycle, with readers that keep up; a
+//  buffer that is never given back stalls the card and fails the run.
+//
+#include <stdio.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <atomic>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+//  What the decode path takes from the kernel
+#define smp_wmb()          std::atomic_thread_fence(std::memory_order_release)
+#define WRITE_ONCE(x, v)   (*(volatile __typeof__(x)*)&(x) = (v))
+#define tpr_publish(p, v)  __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define TPR_DECODE_TSC()   cycles()
+#define TPR_DECODE_HOLD(d, gwp)  zc_hold((d)->buffer, gwp)
+
+static inline uint64_t cycles()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec)*1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+//
+//  The card's buffers in the zero-copy layout, as tpr_decode_hold and
+//  tpr_zc_recycle keep them: decoded buffers are held, oldest first,
+//  until the readers pass the gwp after their last event.
+//
+struct ZcRing {
+    std::vector<long long> lastgwp;
+    unsigned nfree;     // the card may fill these
+    unsigned first;     // oldest held
+    unsigned held;
+    uint64_t holds;
+    uint64_t recycled;
+};
+
+static ZcRing zc;
+
+static void zc_hold(unsigned buffer, long long gwp)
+{
+    zc.lastgwp[buffer] = gwp;
+    zc.held++;
+    zc.holds++;
+}
+
+#include "../kernel/tpr_decode.h"
+
+//  Return the buffers the readers, at zcmin, are done with
+static void zc_recycle(TprZcQueues* zcq, long long zcmin)
+{
+    unsigned n = 0;
+    long long lastgwp = 0;
+    while (n < zc.held && zc.lastgwp[zc.first] <= zcmin) {
+        lastgwp = zc.lastgwp[zc.first];
+        if (++zc.first == zc.lastgwp.size())
+            zc.first = 0;
+        n++;
+    }
+    if (!n)
+        return;
+    __atomic_store_n(&zcq->freewp, lastgwp, __ATOMIC_RELEASE);
+    zc.held     -= n;
+    zc.nfree    += n;
+    zc.recycled += n;
+}
+
+extern int optind;
+
+static void usage(const char* p) {
+    printf("Usage: %s [options]\n",p);
+    printf("          -l <layout>  : 0 index, 1 per-channel rings, 2 zero-copy\n");
+    printf("          -c <mask>    : channels of each event\n");
+    printf("          -R           : each event takes a random subset of -c\n");
+    printf("          -b <n>       : a BSA control and event every n events, 0 for none\n");
+    printf("          -D <n>       : flag a drop on every nth message, 0 for none\n");
+    printf("          -s <bytes>   : DMA buffer size\n");
+    printf("          -n <buffers> : distinct buffers to generate\n");
+    printf("          -p <passes>  : passes over the buffers\n");
+    printf("          -a <depth>   : allq depth (power of 2)\n");
+    printf("          -q <depth>   : per-channel ring depth (power of 2)\n");
+}
+
+static size_t page_align(size_t sz)
+{
+    size_t pgsz = sysconf(_SC_PAGESIZE);
+    return (sz+pgsz-1) & ~(pgsz-1);
+}
+
+//  A queue window laid out as the driver's tpr_qgeometry does
+static TprQueues* window(int layout, unsigned allqdepth, unsigned bsaqdepth, unsigned chnqdepth)
+{
+    TprQueues h;
+    memset(&h, 0, sizeof(h));
+    h.magic     = TPR_QMAGIC;
+    h.version   = TPR_QVERSION;
+    h.hdrsize   = sizeof(h);
+    h.layout    = layout;
+    h.nchan     = MOD_SHARED;
+    h.entrysize = sizeof(TprEntry);
+    h.allqdepth = allqdepth;
+    h.bsaqdepth = bsaqdepth;
+    h.chnqdepth = chnqdepth;
+
+    size_t off = page_align(sizeof(h));
+    h.bsaqoff = off;
+    off += page_align(bsaqdepth*sizeof(TprEntry));
+    if (layout == TPR_QLAYOUT_INDEX) {
+        h.allqoff = off;
+        off += page_align(allqdepth*sizeof(TprEntry));
+    }
+    if (layout != TPR_QLAYOUT_CHANNEL) {
+        h.allrpoff = off;
+        off += page_align(size_t(MOD_SHARED)*allqdepth*sizeof(long long));
+    }
+    if (layout == TPR_QLAYOUT_CHANNEL) {
+        h.chnqoff = off;
+        off += page_align(size_t(MOD_SHARED)*chnqdepth*sizeof(TprEntry));
+    }
+    if (layout == TPR_QLAYOUT_ZCOPY) {
+        h.zcqoff = off;
+        off += page_align(sizeof(TprZcQueues) + allqdepth*sizeof(TprDesc));
+    }
+    h.size = off;
+
+    void* p = aligned_alloc(sysconf(_SC_PAGESIZE), off);
+    if (p) {
+        memset(p, 0, off);
+        memcpy(p, &h, sizeof(h));
+    }
+    return reinterpret_cast<TprQueues*>(p);
+}
+
+template<class T> static T* at(TprQueues* q, uint64_t off)
+{
+    return off ? reinterpret_cast<T*>(reinterpret_cast<char*>(q)+off) : 0;
+}
+
+struct Traffic {
+    uint32_t chmask;
+    bool     random;
+    unsigned bsa;
+    unsigned drop;
+    uint64_t pulseId;
+    uint64_t nmsg;
+};
+
+//  Fill one DMA buffer with messages, END terminated
+static void generate(uint32_t* buf, size_t bufsize, Traffic& t)
+{
+    uint32_t* p   = buf;
+    uint32_t* end = buf + bufsize/4 - 1;   // room for END_TAG
+    while (p + EVENT_MSGSZ/4 <= end) {
+        uint32_t drop = (t.drop && (t.nmsg % t.drop)==t.drop-1) ? (0x808<<20) : 0;
+        if (t.bsa && (t.pulseId % t.bsa)==0 && p + EVENT_MSGSZ/4 + 2*BSACNTL_MSGSZ/4 <= end) {
+            //  pulseId, timeStamp, init, minor, major
+            uint64_t c[5] = { t.pulseId, t.pulseId*1077, 1ULL<<(t.pulseId%64), 0, 0 };
+            p[0] = (BSACNTL_TAG<<16) | drop;
+            memcpy(p+1, c, sizeof(c));
+            p += BSACNTL_MSGSZ/4;
+            //  pulseId, active, avgdone, timeStamp, update
+            uint64_t e[5] = { t.pulseId, ~0ULL, 0, t.pulseId*1077, 0 };
+            p[0] = (BSAEVNT_TAG<<16);
+            memcpy(p+1, e, sizeof(e));
+            p += BSAEVNT_MSGSZ/4;
+            t.nmsg += 2;
+        }
+        uint32_t mch = t.random ? (uint32_t(rand()) & t.chmask) : t.chmask;
+        memset(p, 0, EVENT_MSGSZ);
+        p[0] = (EVENT_TAG<<16) | drop | (mch & ((1<<MOD_SHARED)-1));
+        p[1] = (EVENT_MSGSZ-8)>>2;
+        uint64_t ts = t.pulseId*1077;
+        memcpy(p+2, &t.pulseId, sizeof(t.pulseId));
+        memcpy(p+4, &ts, sizeof(ts));
+        p += EVENT_MSGSZ/4;
+        t.pulseId++;
+        t.nmsg++;
+    }
+    p[0] = END_TAG<<16;
+}
+
+static double now()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return double(ts.tv_sec)+1.e-9*double(ts.tv_nsec);
+}
+
+int main(int argc, char** argv) {
+
+    extern char* optarg;
+    int      layout = TPR_QLAYOUT_INDEX;
+    size_t   bufsize = 4096;
+    unsigned nbuffers = 256;
+    unsigned npasses = 1000;
+    uint32_t allqdepth = 32*1024;
+    uint32_t chnqdepth = 4096;
+    Traffic  t;
+    memset(&t, 0, sizeof(t));
+    t.chmask = 0x7;
+
+    int c;
+    bool lUsage = false;
+
+    while ( (c=getopt( argc, argv, "l:c:Rb:D:s:n:p:a:q:h?")) != EOF ) {
+        switch(c) {
+        case 'l':
+            layout = strtoul(optarg,NULL,0);
+            if (layout > TPR_QLAYOUT_ZCOPY)
+                lUsage = true;
+            break;
+        case 'c':
+            t.chmask = strtoul(optarg,NULL,0);
+            break;
+        case 'R':
+            t.random = true;
+            break;
+        case 'b':
+            t.bsa = strtoul(optarg,NULL,0);
+            break;
+        case 'D':
+            t.drop = strtoul(optarg,NULL,0);
+            break;
+        case 's':
+            bufsize = strtoul(optarg,NULL,0);
+            if (bufsize < 512)
+                lUsage = true;
+            break;
+        case 'n':
+            nbuffers = strtoul(optarg,NULL,0);
+            if (!nbuffers)
+                lUsage = true;
+            break;
+        case 'p':
+            npasses = strtoul(optarg,NULL,0);
+            break;
+        case 'a':
+            allqdepth = strtoul(optarg,NULL,0);
+            if (!allqdepth || (allqdepth & (allqdepth-1)))
+                lUsage = true;
+            break;
+        case 'q':
+            chnqdepth = strtoul(optarg,NULL,0);
+            if (!chnqdepth || (chnqdepth & (chnqdepth-1)))
+                lUsage = true;
+            break;
+        case 'h':
+            usage(argv[0]);
+            exit(0);
+        case '?':
+        default:
+            lUsage = true;
+            break;
+        }
+    }
+
+    if (optind < argc) {
+        printf("%s: invalid argument -- %s\n",argv[0], argv[optind]);
+        lUsage = true;
+    }
+
+    if (lUsage) {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    TprQueues* q = window(layout, allqdepth, 1024, chnqdepth);
+    uint32_t*  bufs = new uint32_t[nbuffers*bufsize/4];
+    if (!q) {
+        perror("Failed to allocate queues");
+        return -1;
+    }
+    for(unsigned i=0; i<nbuffers; i++)
+        generate(&bufs[i*bufsize/4], bufsize, t);
+
+    tpr_decode d;
+    memset(&d, 0, sizeof(d));
+    d.tprq     = q;
+    d.allq     = at<TprEntry>   (q, q->allqoff);
+    d.bsaq     = at<TprEntry>   (q, q->bsaqoff);
+    d.allrp    = at<long long>  (q, q->allrpoff);
+    d.chnq     = at<TprEntry>   (q, q->chnqoff);
+    d.zcq      = at<TprZcQueues>(q, q->zcqoff);
+    d.allqmask = q->allqdepth-1;
+    d.bsaqmask = q->bsaqdepth-1;
+    d.chnqmask = q->chnqdepth-1;
+
+    zc.lastgwp.resize(nbuffers);
+    zc.nfree = nbuffers;
+
+    double t0 = now();
+    for(unsigned ipass=0; ipass<npasses; ipass++) {
+        for(unsigned i=0; i<nbuffers; i++) {
+            if (d.zcq) {
+                if (!zc.nfree) {
+                    printf("DMA stalled: no buffer returned to the card after %llu\n",
+                           (unsigned long long)zc.holds);
+                    return 1;
+                }
+                zc.nfree--;
+            }
+            d.buffer = i;
+            d.base   = reinterpret_cast<const unsigned char*>(&bufs[i*bufsize/4]);
+            tpr_decode_buffer(&d, &bufs[i*bufsize/4]);
+            if (d.zcq)
+                zc_recycle(d.zcq, q->gwp);
+        }
+    }
+    double dt = now()-t0;
+
+    printf("layout %d  chmask %#x%s  %u buffers of %zu bytes x %u passes\n",
+           layout, t.chmask, t.random ? " (random)":"", nbuffers, bufsize, npasses);
+    printf("  messages        : %u  (%lld events, %lld BSA)\n", d.nmsg,
+           q->gwp, q->bsawp);
+    printf("  rate            : %10.3f Mmsg/s\n", double(d.nmsg)*1.e-6/dt);
+    printf("  cost            : %10.2f ns/msg\n", dt*1.e9/double(d.nmsg));
+    printf("  channel entries :");
+    for(unsigned i=0; i<MOD_SHARED; i++)
+        printf(" %lld", q->allwp[i]);
+    printf("\n");
+    if (t.drop)
+        printf("  drops           : %lld BSA, %lld channel 0\n", q->bsadrops, q->drops[0]);
+    bool ok = true;
+    if (d.zcq) {
+        printf("  recycled        : %llu of %llu buffers held, freewp %lld\n",
+               (unsigned long long)zc.recycled, (unsigned long long)zc.holds, d.zcq->freewp);
+        ok = zc.holds == uint64_t(nbuffers)*npasses && d.zcq->freewp == q->gwp;
+        if (!ok)
+            printf("  FAIL: buffers not held and recycled as decoded\n");
+    }
+
+    delete[] bufs;
+    free(q);
+    return ok ? 0 : 1;
+}
@@ -10,6 +10,7 @@
 
 #include "tpr.hh"
 #include "tprsh.hh"
+#include "tprreader.hh"
 
 #include <string>
 
@@ -20,13 +21,14 @@ extern int optind;
 static void usage(const char* p) {
   printf("Usage: %s [options]\n",p);
   printf("          -d <dev>  : <tpr a/b> [-c <channel>] [-v]\n");
+  printf("          -N <n>    : wake only on every nth event\n");
+  printf("          -P <m,r>  : wake only on pulse IDs = r modulo m\n");
 }
 
 static void frame_capture(char,unsigned);
-static void dump_frame         (volatile const uint32_t*);
-static bool parse_frame        (volatile const uint32_t*, uint64_t&, uint64_t&);
 
 static bool verbose = false;
+static TprFilter filter;
 
 
 int main(int argc, char** argv) {
@@ -40,7 +42,10 @@ int main(int argc, char** argv) {
 
   char* endptr;
 
-  while ( (c=getopt( argc, argv, "c:d:vh?")) != EOF ) {
+  memset(&filter, 0, sizeof(filter));
+  filter.version = TPR_FILTER_VERSION;
+
+  while ( (c=getopt( argc, argv, "c:d:N:P:vh?")) != EOF ) {
     switch(c) {
     case 'c':
       idx = strtoul(optarg,0,NULL);
@@ -55,6 +60,14 @@ int main(int argc, char** argv) {
     case 'v':
         verbose = true;
         break;
+    case 'N':
+      filter.decimate = strtoul(optarg,NULL,0);
+      break;
+    case 'P':
+      filter.pidmod = strtoul(optarg,&endptr,0);
+      if (*endptr==',')
+        filter.pidrem = strtoul(endptr+1,NULL,0);
+      break;
     case 'h':
       usage(argv[0]);
       exit(0);
@@ -125,96 +138,79 @@ int main(int argc, char** argv) {
 
 void frame_capture(char tprid, unsigned idx)
 {
-    char dev[16];
-    sprintf(dev,"/dev/tpr%c%x",tprid,idx);
-
-    int fd = open(dev, O_RDONLY);
-    if (fd<0) {
-        printf("Open failure for dev %s [FAIL]\n",dev);
+    Reader rdr;
+    if (rdr.open(tprid, idx) < 0) {
+        printf("Open failure for dev /dev/tpr%c%x [FAIL]\n",tprid,idx);
         perror("Could not open");
         return;
     }
-
-    void* ptr = mmap(0, sizeof(TprQueues), PROT_READ, MAP_SHARED, fd, 0);
-    if (ptr == MAP_FAILED) {
-        perror("Failed to map - FAIL");
-        return;
-    }
+    if (rdr.node() >= 0)
+        printf("Running on NUMA node %d\n", rdr.node());
 
     //  read the captured frames
 
     printf("   %16.16s %8.8s %8.8s\n",
            "PulseId","Seconds","Nanosec");
 
-    TprQueues& q = *(TprQueues*)ptr;
+    printf("allrp %#llx  q.allwp[%d] %#llx\n", rdr.position(), idx, qload(rdr.queues().allwp[idx]));
 
-    char* buff = new char[32];
+    Frame frame[16];
 
-    int64_t allrp = q.allwp[idx];
-    int64_t bsarp = q.bsawp;
-    printf("allrp %#lx  q.allwp[%d] %#lx\n", (uint64_t) allrp, idx, (uint64_t) q.allwp[idx]);
+    if (filter.decimate > 1 || filter.pidmod) {
+        //  The driver wakes us only for the events we want
+        if (rdr.filter(filter) < 0) {
+            perror("TPR_IOC_SETFILTER - FAIL");
+            return;
+        }
+        for(unsigned nframes=0; nframes<10; ) {
+            if (!rdr.next(frame[0]))
+                continue;
+            if (frame[0].isEvent()) {
+                EventMsg e = frame[0].event();
+                printf(" 0x%016llx %9u.%09u  allrp %#llx\n",
+                       (unsigned long long)e.pulseId(),
+                       e.seconds(), e.nanoseconds(), frame[0].seq);
+                nframes++;
+            }
+        }
+        return;
+    }
 
-    read(fd, buff, 32);
-    //    read(fdbsa, buff, 32);
+    rdr.await();
     usleep(1000);
 
     uint64_t pulseIdP=0;
-    uint64_t pulseId, timeStamp;
     unsigned nframes=0;
+    long long lost=0;
 
-    do {
-        //        printf("allrp %#lx  q.allwp[%d] %#lx\n", (uint64_t) allrp, idx, (uint64_t) q.allwp[idx]);
-        while(allrp < q.allwp[idx] && nframes<10) {
-            volatile const uint32_t* p = reinterpret_cast<volatile const uint32_t*>
-                (&q.allq[q.allrp[idx].idx[allrp &(MAX_TPR_ALLQ-1)] &(MAX_TPR_ALLQ-1) ].word[0]);
+    while (nframes<10) {
+        size_t n = rdr.next(frame);
+        if (rdr.lost() != lost) {
+            printf("%lld overwritten\n", rdr.lost()-lost);
+            lost = rdr.lost();
+        }
+        for(size_t i=0; i<n && nframes<10; i++) {
             if (verbose)
-                dump_frame(p);
-            else if (parse_frame(p, pulseId, timeStamp)) {
+                frame[i].dump();
+            else if (frame[i].isEvent()) {
+                EventMsg e = frame[i].event();
+                uint64_t pulseId = e.pulseId();
                 if (pulseIdP) {
                     uint64_t pulseIdN = pulseIdP+1;
-                    //                    if (tmode==LCLS1) pulseIdN = (pulseId&~0x1ffffULL) | (pulseIdN&0x1ffffULL);
                     printf(" 0x%016llx %9u.%09u %s\n",
                            (unsigned long long)pulseId,
-                           unsigned(timeStamp>>32),
-                           unsigned(timeStamp&0xffffffff),
+                           e.seconds(), e.nanoseconds(),
                            (pulseId==pulseIdN) ? "PASS":"FAIL");
                     nframes++;
                 }
                 pulseIdP  =pulseId;
             }
-            allrp++;
         }
-        if (nframes>=10)
-            break;
-        read(fd, buff, 32);
-    } while(1);
-
-}
-
-void dump_frame(volatile const uint32_t* p)
-{
-    char m = p[0]&(0x808<<20) ? 'D':' ';
-    if (((p[0]>>16)&0xf)==0) {
-        volatile const uint64_t* pl = reinterpret_cast<volatile const uint64_t*>(p+2);
-        printf("EVENT LCLS%c chmask [x%x] [x%x] %c: %16lx %16lx",
-               (p[0]&(1<<22)) ? '1':'2',
-               (p[0]>>0)&0xffff,p[1],m,pl[0],pl[1]);
-        for(unsigned i=6; i<20; i++)
-            printf(" %08x",p[i]);
-        printf("\n");
     }
-}
 
-bool parse_frame(volatile const uint32_t* p,
-                 uint64_t& pulseId, uint64_t& timeStamp)
-{
-    //  char m = p[0]&(0x808<<20) ? 'D':' ';
-    if (((p[0]>>16)&0xf)==0) { // EVENT_TAG
-        volatile const uint64_t* pl = reinterpret_cast<volatile const uint64_t*>(p+2);
-        pulseId = pl[0];
-        timeStamp = pl[1];
-        return true;
-    }
-    return false;
+    ClockModel clk;
+    if (rdr.clock(clk))
+        printf("clock %.6f ns/cycle  latency +%llu ns mean +%llu ns max  (%llu fits)\n",
+               double(clk.mult)/4294967296., (unsigned long long)clk.latmean,
+               (unsigned long long)clk.latmax, (unsigned long long)clk.updates);
 }
-
@@ -0,0 +1,74 @@
+#ifndef TPRNUMA_HH
+#define TPRNUMA_HH
+
+//
+//  Run the calling thread on the card's NUMA node.  Reads the node from
+//  TPR_IOC_INFO and its CPUs from sysfs; no libnuma needed.
+//
+#include <stdio.h>
+#include <sched.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#include "tprsh.hh"
+
+namespace Tpr {
+
+  //  NUMA node of the card behind fd, -1 if unknown
+  inline int numaNode(int fd) {
+    TprInfo info;
+    if (ioctl(fd, TPR_IOC_INFO, &info) < 0)
+      return -1;
+    return info.node;
+  }
+
+  //  Parse a sysfs cpulist ("0-7,16-23") into set; false if unreadable
+  inline bool nodeCpus(int node, cpu_set_t& set) {
+    char path[64];
+    sprintf(path,"/sys/devices/system/node/node%d/cpulist",node);
+    FILE* f = fopen(path,"r");
+    if (!f)
+      return false;
+    CPU_ZERO(&set);
+    unsigned lo, hi;
+    int n;
+    while ((n = fscanf(f,"%u",&lo)) == 1) {
+      hi = lo;
+      int c = fgetc(f);
+      if (c == '-') {
+        if (fscanf(f,"%u",&hi) != 1)
+          break;
+        c = fgetc(f);
+      }
+      for(unsigned i=lo; i<=hi && i<CPU_SETSIZE; i++)
+        CPU_SET(i, &set);
+      if (c != ',')
+        break;
+    }
+    fclose(f);
+    return CPU_COUNT(&set) > 0;
+  }
+
+  //
+  //  Pin the calling thread to the CPUs of the card's node and prefer
+  //  that node for its memory.  Returns the node, or -1 if nothing was done.
+  //
+  inline int pinToCard(int fd) {
+    int node = numaNode(fd);
+    if (node < 0)
+      return -1;
+    cpu_set_t set;
+    if (!nodeCpus(node, set))
+      return -1;
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+      return -1;
+    unsigned long nodemask = 1UL<<node;
+    if (node < int(8*sizeof(nodemask)))
+      syscall(SYS_set_mempolicy, MPOL_PREFERRED, &nodemask, 8*sizeof(nodemask));
+    return node;
+  }
+};
+
+#endif
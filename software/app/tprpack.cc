@@ -0,0 +1,364 @@
+#include "tprpack.hh"
+
+#include <string.h>
+
+using namespace Tpr;
+
+//  Words of each message kind
+static inline unsigned msgwords(const Frame& f) { return f.isEvent() ? 92>>2 : 44>>2; }
+
+static inline uint64_t zigzag  (uint64_t v) { return (v<<1) ^ uint64_t(int64_t(v)>>63); }
+static inline uint64_t unzigzag(uint64_t v) { return (v>>1) ^ -(v&1); }
+
+static inline void put_varint(std::vector<uint8_t>& o, uint64_t v)
+{
+  while (v >= 0x80) {
+    o.push_back(uint8_t(v) | 0x80);
+    v >>= 7;
+  }
+  o.push_back(uint8_t(v));
+}
+
+static inline bool get_varint(const uint8_t*& p, const uint8_t* e, uint64_t& v)
+{
+  v = 0;
+  for(unsigned s=0; p<e && s<64; s+=7) {
+    uint8_t b = *p++;
+    v |= uint64_t(b&0x7f) << s;
+    if (!(b&0x80))
+      return true;
+  }
+  return false;
+}
+
+static inline void put_raw(std::vector<uint8_t>& o, uint64_t v)
+{
+  for(unsigned i=0; i<8; i++)
+    o.push_back(uint8_t(v>>(8*i)));
+}
+
+static inline bool get_raw(const uint8_t*& p, const uint8_t* e, uint64_t& v)
+{
+  if (e - p < 8)
+    return false;
+  v = 0;
+  for(unsigned i=0; i<8; i++)
+    v |= uint64_t(p[i]) << (8*i);
+  p += 8;
+  return true;
+}
+
+//
+//  Delta of delta.  The first value is raw; then each dd is a zigzag
+//  varint, except that a run of zeros is the token 0 and its length.
+//
+template<class Get> static void enc_dd(std::span<const Frame> in, std::vector<uint8_t>& o, Get get)
+{
+  uint64_t prev = get(in[0]), pd = 0, zeros = 0;
+  put_raw(o, prev);
+  for(size_t i=1; i<in.size(); i++) {
+    uint64_t x = get(in[i]);
+    uint64_t d = x - prev, dd = d - pd;
+    prev = x;
+    pd   = d;
+    if (!dd) {
+      zeros++;
+      continue;
+    }
+    if (zeros) {
+      put_varint(o, 0);
+      put_varint(o, zeros);
+      zeros = 0;
+    }
+    put_varint(o, zigzag(dd));
+  }
+  if (zeros) {
+    put_varint(o, 0);
+    put_varint(o, zeros);
+  }
+}
+
+template<class Set> static bool dec_dd(const uint8_t* p, const uint8_t* e, std::vector<Frame>& out, Set set)
+{
+  uint64_t prev, pd = 0, t, r;
+  if (!get_raw(p, e, prev))
+    return false;
+  set(out[0], prev);
+  for(size_t i=1; i<out.size(); ) {
+    if (!get_varint(p, e, t))
+      return false;
+    if (!t) {
+      if (!get_varint(p, e, r) || r > out.size()-i)
+        return false;
+      for(; r; r--, i++) {
+        prev += pd;
+        set(out[i], prev);
+      }
+    }
+    else {
+      pd   += unzigzag(t);
+      prev += pd;
+      set(out[i++], prev);
+    }
+  }
+  return p == e;
+}
+
+//  Delta: the first value raw, then zigzag varints
+template<class Get> static void enc_delta(std::span<const Frame> in, std::vector<uint8_t>& o, Get get)
+{
+  uint64_t prev = get(in[0]);
+  put_raw(o, prev);
+  for(size_t i=1; i<in.size(); i++) {
+    uint64_t x = get(in[i]);
+    put_varint(o, zigzag(x - prev));
+    prev = x;
+  }
+}
+
+template<class Set> static bool dec_delta(const uint8_t* p, const uint8_t* e, std::vector<Frame>& out, Set set)
+{
+  uint64_t prev, d;
+  if (!get_raw(p, e, prev))
+    return false;
+  set(out[0], prev);
+  for(size_t i=1; i<out.size(); i++) {
+    if (!get_varint(p, e, d))
+      return false;
+    prev += unzigzag(d);
+    set(out[i], prev);
+  }
+  return p == e;
+}
+
+//
+//  XOR with the previous value (0 before the first) as a varint; a run of
+//  unchanged values is the token 0 and its length.  A constant word costs
+//  a few bytes a chunk; a bit field that toggles costs about its width.
+//
+template<class Get> static void enc_xor(std::span<const Frame> in, std::vector<uint8_t>& o, Get get)
+{
+  uint64_t prev = 0, same = 0;
+  for(size_t i=0; i<in.size(); i++) {
+    uint64_t x = get(in[i]);
+    if (x == prev) {
+      same++;
+      continue;
+    }
+    if (same) {
+      put_varint(o, 0);
+      put_varint(o, same);
+      same = 0;
+    }
+    put_varint(o, x ^ prev);
+    prev = x;
+  }
+  if (same) {
+    put_varint(o, 0);
+    put_varint(o, same);
+  }
+}
+
+template<class Set> static bool dec_xor(const uint8_t* p, const uint8_t* e, std::vector<Frame>& out, Set set)
+{
+  uint64_t prev = 0, t, r;
+  for(size_t i=0; i<out.size(); ) {
+    if (!get_varint(p, e, t))
+      return false;
+    if (!t) {
+      if (!get_varint(p, e, r) || !r || r > out.size()-i)
+        return false;
+      for(; r; r--)
+        set(out[i++], prev);
+    }
+    else {
+      prev ^= t;
+      set(out[i++], prev);
+    }
+  }
+  return p == e;
+}
+
+static inline uint64_t word64(const Frame& f, unsigned w)
+{
+  return w+1 < msgwords(f) ? uint64_t(f.word[w]) | (uint64_t(f.word[w+1])<<32) : 0;
+}
+
+static inline void setword64(Frame& f, unsigned w, uint64_t v)
+{
+  f.word[w]   = uint32_t(v);
+  f.word[w+1] = uint32_t(v>>32);
+}
+
+//  Bytes of a chunk, header included; 0 if the header cannot be right
+static size_t chunkBytes(const PackChunk& h)
+{
+  if (h.magic != TPR_PACK_CHMAGIC || h.nframes > TPR_PACK_CHUNK)
+    return 0;
+  size_t total = sizeof(h);
+  for(unsigned c=0; c<TPR_PACK_COLUMNS; c++) {
+    if (h.colbytes[c] > TPR_PACK_COLMAX)
+      return 0;
+    total += h.colbytes[c];
+  }
+  return total;
+}
+
+void Tpr::packChunk(std::span<const Frame> in, std::vector<uint8_t>& out)
+{
+  PackChunk h;
+  memset(&h, 0, sizeof(h));
+  h.magic   = TPR_PACK_CHMAGIC;
+  h.nframes = in.size();
+
+  size_t hpos = out.size();
+  out.resize(hpos + sizeof(h));
+  if (!in.empty()) {
+    for(unsigned c=0; c<TPR_PACK_COLUMNS; c++) {
+      size_t pos = out.size();
+      switch(c) {
+      case 0: enc_dd   (in, out, [](const Frame& f) { return uint64_t(f.seq); }); break;
+      case 1: enc_delta(in, out, [](const Frame& f) { return f.fifo_tsc; }); break;
+      case 4: enc_dd   (in, out, [](const Frame& f) { return word64(f, 2); }); break;
+      case 5: enc_dd   (in, out, [](const Frame& f) { return word64(f, 4); }); break;
+      default: {
+        //  Columns 2,3 are words 0,1; 6.. are words 6..
+        unsigned w = c < 4 ? c-2 : c;
+        enc_xor(in, out, [w](const Frame& f) { return uint64_t(w < msgwords(f) ? f.word[w] : 0); });
+      } break;
+      }
+      h.colbytes[c] = out.size() - pos;
+    }
+  }
+  memcpy(&out[hpos], &h, sizeof(h));
+}
+
+size_t Tpr::unpackChunk(const uint8_t* p, size_t len, std::vector<Frame>& out)
+{
+  PackChunk h;
+  if (len < sizeof(h))
+    return 0;
+  memcpy(&h, p, sizeof(h));
+  size_t total = chunkBytes(h);
+  if (!total || total > len)
+    return 0;
+
+  out.resize(h.nframes);
+  if (!h.nframes)
+    return total;
+  memset(out.data(), 0, out.size()*sizeof(Frame));
+
+  const uint8_t* q = p + sizeof(h);
+  for(unsigned c=0; c<TPR_PACK_COLUMNS; c++) {
+    const uint8_t* e = q + h.colbytes[c];
+    bool ok;
+    switch(c) {
+    case 0: ok = dec_dd   (q, e, out, [](Frame& f, uint64_t v) { f.seq = v; }); break;
+    case 1: ok = dec_delta(q, e, out, [](Frame& f, uint64_t v) { f.fifo_tsc = v; }); break;
+    case 4: ok = dec_dd   (q, e, out, [](Frame& f, uint64_t v) { setword64(f, 2, v); }); break;
+    case 5: ok = dec_dd   (q, e, out, [](Frame& f, uint64_t v) { setword64(f, 4, v); }); break;
+    default: {
+      unsigned w = c < 4 ? c-2 : c;
+      ok = dec_xor(q, e, out, [w](Frame& f, uint64_t v) { f.word[w] = v; });
+    } break;
+    }
+    if (!ok)
+      return 0;
+    q = e;
+  }
+  return total;
+}
+
+PackWriter::PackWriter(FILE* f) :
+  _f      (f),
+  _nframes(0),
+  _nbytes (0),
+  _ok     (true)
+{
+  _frames.reserve(TPR_PACK_CHUNK);
+  PackFile h;
+  memset(&h, 0, sizeof(h));
+  h.magic   = TPR_PACK_MAGIC;
+  h.version = TPR_PACK_VERSION;
+  h.hdrsize = sizeof(h);
+  _ok     = fwrite(&h, sizeof(h), 1, _f) == 1;
+  _nbytes = sizeof(h);
+}
+
+PackWriter::~PackWriter()
+{
+  flush();
+}
+
+bool PackWriter::add(const Frame& f)
+{
+  _frames.push_back(f);
+  if (_frames.size() == TPR_PACK_CHUNK)
+    return flush();
+  return _ok;
+}
+
+bool PackWriter::add(std::span<const Frame> f)
+{
+  for(const Frame& e : f)
+    add(e);
+  return _ok;
+}
+
+bool PackWriter::flush()
+{
+  if (_frames.empty())
+    return _ok;
+  _buf.clear();
+  packChunk(_frames, _buf);
+  if (fwrite(_buf.data(), 1, _buf.size(), _f) != _buf.size())
+    _ok = false;
+  _nframes += _frames.size();
+  _nbytes  += _buf.size();
+  _frames.clear();
+  return _ok;
+}
+
+PackReader::PackReader(FILE* f) :
+  _f   (f),
+  _next(0),
+  _ok  (false)
+{
+  PackFile h;
+  if (fread(&h, sizeof(h), 1, _f) == 1 && h.magic == TPR_PACK_MAGIC &&
+      h.version == TPR_PACK_VERSION && h.hdrsize >= sizeof(h)) {
+    _ok = fseek(_f, h.hdrsize - sizeof(h), SEEK_CUR) == 0;
+  }
+}
+
+bool PackReader::load()
+{
+  PackChunk h;
+  if (fread(&h, sizeof(h), 1, _f) != 1)
+    return false;
+  //  Check the header before trusting its sizes
+  size_t total = chunkBytes(h);
+  if (!total)
+    return false;
+  _buf.resize(total);
+  memcpy(_buf.data(), &h, sizeof(h));
+  if (fread(_buf.data()+sizeof(h), 1, total-sizeof(h), _f) != total-sizeof(h))
+    return false;
+  _next = 0;
+  return unpackChunk(_buf.data(), total, _frames) == total;
+}
+
+size_t PackReader::next(std::span<Frame> out)
+{
+  size_t n = 0;
+  while (_ok && n < out.size()) {
+    if (_next == _frames.size() && !load()) {
+      _frames.clear();
+      _next = 0;
+      break;
+    }
+    while (n < out.size() && _next < _frames.size())
+      out[n++] = _frames[_next++];
+  }
+  return n;
+}
@@ -0,0 +1,103 @@
+#ifndef TPRPACK_HH
+#define TPRPACK_HH
+
+//
+//  Compressed capture format: frames of one queue stored as columns, in
+//  chunks of up to TPR_PACK_CHUNK frames.  Each column has its own code:
+//
+//    seq, pulseId (words 2-3), timeStamp (words 4-5)
+//                      delta of delta: regular streams cost next to nothing
+//    fifo_tsc          delta
+//    words 0-1, 6-22   XOR with the previous value: markers change seldom,
+//                      and then only in a few bits
+//
+//  Deltas are zigzag varints, XORs plain varints; both delta of delta and
+//  XOR have a token for runs of zeros.  Words past the end of a BSA
+//  message (11 words) are stored, and restored, as 0.  Lossless otherwise.
+//  Mixed with events, BSA messages spoil the pulseId and timeStamp deltas,
+//  so pack each queue on its own.
+//
+//  A stream is a PackFile header, then chunks: a PackChunk header with the
+//  size of each column, then the columns.
+//
+#include <stdint.h>
+#include <stdio.h>
+#include <span>
+#include <vector>
+
+#include "tprreader.hh"
+
+namespace Tpr {
+
+#define TPR_PACK_MAGIC    0x31304b4350525054ULL   // "TPRPCK01"
+#define TPR_PACK_CHMAGIC  0x4b484354U             // "TCHK"
+#define TPR_PACK_VERSION  1
+#define TPR_PACK_CHUNK    4096
+#define TPR_PACK_COLUMNS  23
+//  Most bytes a column of a full chunk can take: the raw first value, then
+//  a 10-byte varint and a run token for each frame
+#define TPR_PACK_COLMAX   (8 + 2*10*TPR_PACK_CHUNK)
+
+  class PackFile {
+  public:
+    uint64_t magic;
+    uint32_t version;
+    uint32_t hdrsize;
+  };
+
+  class PackChunk {
+  public:
+    uint32_t magic;
+    uint32_t nframes;
+    uint32_t colbytes[TPR_PACK_COLUMNS];
+    uint32_t reserved;
+  };
+
+  //  Append the chunk for in (at most TPR_PACK_CHUNK frames) to out
+  void   packChunk  (std::span<const Frame> in, std::vector<uint8_t>& out);
+  //  Decode the chunk at p, of at most len bytes, replacing out's contents;
+  //  the bytes it took, 0 if it is malformed or incomplete
+  size_t unpackChunk(const uint8_t* p, size_t len, std::vector<Frame>& out);
+
+  //  Streaming encoder: add() frames, a chunk is written as each fills
+  class PackWriter {
+  public:
+    PackWriter(FILE* f);
+    ~PackWriter();
+  public:
+    bool     add  (const Frame& f);
+    bool     add  (std::span<const Frame> f);
+    //  Write out the partial chunk
+    bool     flush();
+    uint64_t frames() const { return _nframes; }
+    uint64_t bytes () const { return _nbytes; }
+  private:
+    FILE*                _f;
+    std::vector<Frame>   _frames;
+    std::vector<uint8_t> _buf;
+    uint64_t             _nframes;
+    uint64_t             _nbytes;
+    bool                 _ok;
+  };
+
+  //  Streaming decoder, as Reader::next() over a packed stream
+  class PackReader {
+  public:
+    PackReader(FILE* f);
+  public:
+    //  false if f does not hold a packed stream
+    bool   valid() const { return _ok; }
+    //  Copy up to out.size() frames; 0 at the end of the stream
+    size_t next (std::span<Frame> out);
+  private:
+    bool   load ();
+  private:
+    FILE*                _f;
+    std::vector<uint8_t> _buf;
+    std::vector<Frame>   _frames;
+    size_t               _next;
+    bool                 _ok;
+  };
+};
+
+#endif
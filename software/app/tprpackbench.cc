@@ -0,0 +1,204 @@
+//
+//  Measure the packed capture format (tprpack.hh): encode and decode rates,
+//  compression, and what a day of 929kHz history takes on disk.  Frames are
+//  generated, or read from a tprrecord file (-f).  Checks the round trip
+//  is lossless.
+//
+#include <stdio.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+
+#include "tprpack.hh"
+#include "tprrec.hh"
+
+using namespace Tpr;
+
+extern int optind;
+
+static void usage(const char* p) {
+    printf("Usage: %s [options]\n",p);
+    printf("          -n <frames>  : frames to generate (929000 is a second at the full rate)\n");
+    printf("          -p <passes>  : passes over the frames\n");
+    printf("          -f <file>    : pack the events of a tprrecord .tpr file instead\n");
+    printf("          -B           : with -f, pack its BSA messages instead of its events\n");
+}
+
+static double now()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return double(ts.tv_sec)+1.e-9*double(ts.tv_nsec);
+}
+
+//  Events of a 929kHz channel, as tprcolbench, with some jitter in fifo_tsc
+static void generate(std::vector<Frame>& f, unsigned n)
+{
+    static const unsigned period[] = { 1, 13, 91, 910, 9100, 91000, 910000 };
+    uint64_t sec = 1000000000ULL;
+    uint64_t tsc = 0x100000000ULL;
+    f.resize(n);
+    for(unsigned i=0; i<n; i++) {
+        uint64_t pid = 0x1234500000ULL + i;
+        uint64_t ns  = (pid*1077) % sec;
+        uint64_t ts  = ((pid*1077/sec)<<32) | ns;
+        uint32_t rates = 0;
+        for(unsigned r=0; r<7; r++)
+            if (pid % period[r] == 0)
+                rates |= 1<<r;
+        tsc += 2585 + (pid*2654435761U)%64;
+        memset(&f[i], 0, sizeof(f[i]));
+        f[i].word[0]  = (Frame::Event<<16) | 1;
+        f[i].word[1]  = (92-8)>>2;
+        f[i].word[2]  = uint32_t(pid);
+        f[i].word[3]  = uint32_t(pid>>32);
+        f[i].word[4]  = uint32_t(ts);
+        f[i].word[5]  = uint32_t(ts>>32);
+        f[i].word[6]  = rates | ((pid%360 ? 0 : 0x3f)<<10) | ((1+pid%6)<<16) | ((pid%4096)<<19);
+        f[i].seq      = i;
+        f[i].fifo_tsc = tsc;
+    }
+}
+
+//  The records of a tprrecord file of one kind
+static bool load(const char* fname, bool bsa, std::vector<Frame>& f)
+{
+    FILE* fp = fopen(fname, "r");
+    if (!fp) {
+        perror("Could not open file");
+        return false;
+    }
+    RecReader rec(fp);
+    if (!rec.valid()) {
+        printf("%s is not a tprrecord file\n", fname);
+        fclose(fp);
+        return false;
+    }
+    Frame e;
+    while (rec.next(e))
+        if (e.isEvent() != bsa)
+            f.push_back(e);
+    fclose(fp);
+    return true;
+}
+
+int main(int argc, char** argv) {
+
+    extern char* optarg;
+    unsigned nframes = 929000;
+    unsigned npasses = 10;
+    const char* fname = 0;
+    bool lBsa = false;
+
+    int c;
+    bool lUsage = false;
+
+    while ( (c=getopt( argc, argv, "n:p:f:Bh?")) != EOF ) {
+        switch(c) {
+        case 'n':
+            nframes = strtoul(optarg,NULL,0);
+            if (!nframes)
+                lUsage = true;
+            break;
+        case 'p':
+            npasses = strtoul(optarg,NULL,0);
+            if (!npasses)
+                lUsage = true;
+            break;
+        case 'f':
+            fname = optarg;
+            break;
+        case 'B':
+            lBsa = true;
+            break;
+        case 'h':
+            usage(argv[0]);
+            exit(0);
+        case '?':
+        default:
+            lUsage = true;
+            break;
+        }
+    }
+
+    if (optind < argc) {
+        printf("%s: invalid argument -- %s\n",argv[0], argv[optind]);
+        lUsage = true;
+    }
+
+    if (lUsage) {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    std::vector<Frame> f;
+    if (fname) {
+        if (!load(fname, lBsa, f))
+            exit(1);
+        if (f.empty()) {
+            printf("No %s records in %s\n", lBsa ? "BSA" : "event", fname);
+            exit(1);
+        }
+    }
+    else
+        generate(f, nframes);
+    size_t n = f.size();
+
+    //  Encode and decode a chunk at a time, as PackWriter and PackReader do
+    std::vector<uint8_t> packed;
+    std::vector<Frame>   chunk, out(n);
+    double tenc = 0, tdec = 0;
+    for(unsigned ipass=0; ipass<npasses; ipass++) {
+        double t0 = now();
+        packed.clear();
+        for(size_t i=0; i<n; i+=TPR_PACK_CHUNK)
+            packChunk(std::span<const Frame>(&f[i], i+TPR_PACK_CHUNK<n ? TPR_PACK_CHUNK : n-i), packed);
+        double t1 = now();
+        size_t pos = 0, k = 0;
+        while (pos < packed.size()) {
+            size_t len = unpackChunk(&packed[pos], packed.size()-pos, chunk);
+            if (!len) {
+                printf("Malformed chunk at %zu\n", pos);
+                exit(1);
+            }
+            memcpy(&out[k], chunk.data(), chunk.size()*sizeof(Frame));
+            k   += chunk.size();
+            pos += len;
+        }
+        double t2 = now();
+        tenc += t1-t0;
+        tdec += t2-t1;
+    }
+    tenc /= double(npasses);
+    tdec /= double(npasses);
+
+    //  Words past a BSA message are not kept
+    bool lossless = true;
+    for(size_t i=0; i<n && lossless; i++) {
+        Frame e = f[i];
+        if (!e.isEvent())
+            memset(&e.word[44>>2], 0, sizeof(e.word)-44);
+        if (memcmp(&e, &out[i], sizeof(e))) {
+            printf("  differ at %zu\n", i);
+            lossless = false;
+        }
+    }
+
+    double raw   = double(n*sizeof(Frame));
+    double bpf   = double(packed.size())/double(n);
+    printf("%zu frames (%zu B each raw), %u passes\n", n, sizeof(Frame), npasses);
+    printf("  packed   : %zu B  %.2f B/frame  ratio %.1f\n",
+           packed.size(), bpf, raw/double(packed.size()));
+    printf("  encode   : %8.1f MB/s raw  %6.2f ns/frame\n",
+           raw*1.e-6/tenc, tenc*1.e9/double(n));
+    printf("  decode   : %8.1f MB/s raw  %6.2f ns/frame\n",
+           raw*1.e-6/tdec, tdec*1.e9/double(n));
+    printf("  day      : %8.2f GB at 929kHz (raw %.1f GB)\n",
+           929000.*86400.*bpf*1.e-9, 929000.*86400.*double(sizeof(Frame))*1.e-9);
+    printf("  lossless : %s\n", lossless ? "yes" : "NO");
+
+    return lossless ? 0 : 1;
+}
@@ -0,0 +1,232 @@
+//
+//  Compare consumer cost of the two TprQueues layouts (index vs per-channel rings).
+//  The queues are filled in process memory with a synthetic LCLS-II fixed rate
+//  pattern, the caches are flushed, and a consumer of one channel walks the
+//  newest entries reading pulseId and timeStamp.
+//
+#include <stdio.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "tprsh.hh"
+
+using namespace Tpr;
+
+extern int optind;
+
+static const unsigned EVENT_WORDS = 92>>2;
+
+//  Frames between entries for each channel (929kHz, 71kHz, 10kHz, 1kHz, 100Hz, ...)
+static const unsigned ch_period[] = { 1, 13, 91, 910, 9100, 91000, 910000 };
+
+//  Most frames to generate (4.5 s of beam); the index layout only reaches
+//  the last allqdepth of them anyway
+static const uint64_t MAX_FRAMES = 1<<22;
+
+static void usage(const char* p) {
+    printf("Usage: %s [options]\n",p);
+    printf("          -c <channel> : channel to consume [0..%d]\n",MOD_SHARED-1);
+    printf("          -n <passes>  : number of timed passes\n");
+    printf("          -a <depth>   : allq depth (power of 2)\n");
+    printf("          -q <depth>   : per-channel ring depth (power of 2)\n");
+}
+
+//  A queue window with both layouts filled, as the driver would lay it out
+static TprQueues* window(uint32_t allqdepth, uint32_t chnqdepth)
+{
+    size_t pgsz = sysconf(_SC_PAGESIZE);
+    size_t off  = (sizeof(TprQueues)+pgsz-1) & ~(pgsz-1);
+    TprQueues h;
+    memset(&h, 0, sizeof(h));
+    h.magic     = TPR_QMAGIC;
+    h.version   = TPR_QVERSION;
+    h.hdrsize   = sizeof(h);
+    h.nchan     = MOD_SHARED;
+    h.entrysize = sizeof(TprEntry);
+    h.allqdepth = allqdepth;
+    h.bsaqdepth = 1;
+    h.chnqdepth = chnqdepth;
+    h.allqoff   = off;
+    off += (allqdepth*sizeof(TprEntry)+pgsz-1) & ~(pgsz-1);
+    h.allrpoff  = off;
+    off += (MOD_SHARED*allqdepth*sizeof(long long)+pgsz-1) & ~(pgsz-1);
+    h.chnqoff   = off;
+    off += (MOD_SHARED*chnqdepth*sizeof(TprEntry)+pgsz-1) & ~(pgsz-1);
+    h.size      = off;
+    TprQueues* q = reinterpret_cast<TprQueues*>(calloc(1,off));
+    if (q)
+        memcpy(q, &h, sizeof(h));
+    return q;
+}
+
+static double now()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return double(ts.tv_sec)+1.e-9*double(ts.tv_nsec);
+}
+
+static uint64_t ch_mask(uint64_t frame)
+{
+    uint64_t m = 0;
+    for(unsigned i=0; i<MOD_SHARED; i++)
+        if ((frame % ch_period[i%7])==0)
+            m |= (1<<i);
+    return m;
+}
+
+static void fill(TprQueues& q, uint64_t nframes)
+{
+    for(uint64_t gwp=0; gwp<nframes; gwp++) {
+        uint32_t word[EVENT_WORDS];
+        memset(word, 0, sizeof(word));
+        uint64_t mch = ch_mask(gwp);
+        word[0] = mch;
+        word[1] = EVENT_WORDS-2;
+        word[2] = uint32_t(gwp);
+        word[3] = uint32_t(gwp>>32);
+        word[4] = uint32_t(gwp*1077);
+        word[5] = uint32_t((gwp*1077)>>32);
+
+        TprEntry& e = q.allq(gwp);
+        for(unsigned i=0; i<EVENT_WORDS; i++)
+            e.word[i] = word[i];
+        e.seq      = gwp;
+        e.fifo_tsc = gwp;
+        for(unsigned ich=0; ich<MOD_SHARED; ich++) {
+            if (mch & (1<<ich)) {
+                q.allrp(ich, q.allwp[ich]) = gwp;
+                TprEntry& c = q.chnq(ich, q.allwp[ich]);
+                for(unsigned i=0; i<EVENT_WORDS; i++)
+                    c.word[i] = word[i];
+                c.seq      = q.allwp[ich];
+                c.fifo_tsc = gwp;
+                q.allwp[ich] = q.allwp[ich]+1;
+            }
+        }
+        q.gwp = gwp+1;
+    }
+}
+
+//  Evict the queues from the caches, as if written by another core long ago
+static void flush(char* buff, size_t sz)
+{
+    for(size_t i=0; i<sz; i+=64)
+        buff[i]++;
+}
+
+int main(int argc, char** argv) {
+
+    extern char* optarg;
+    unsigned idx = 0;
+    unsigned npasses = 10;
+    uint32_t allqdepth = 32*1024;
+    uint32_t chnqdepth = 4096;
+
+    int c;
+    bool lUsage = false;
+
+    while ( (c=getopt( argc, argv, "c:n:a:q:h?")) != EOF ) {
+        switch(c) {
+        case 'c':
+            idx = strtoul(optarg,NULL,0);
+            if (idx >= MOD_SHARED)
+                lUsage = true;
+            break;
+        case 'n':
+            npasses = strtoul(optarg,NULL,0);
+            break;
+        case 'a':
+            allqdepth = strtoul(optarg,NULL,0);
+            if (!allqdepth || (allqdepth & (allqdepth-1)))
+                lUsage = true;
+            break;
+        case 'q':
+            chnqdepth = strtoul(optarg,NULL,0);
+            if (!chnqdepth || (chnqdepth & (chnqdepth-1)))
+                lUsage = true;
+            break;
+        case 'h':
+            usage(argv[0]);
+            exit(0);
+        case '?':
+        default:
+            lUsage = true;
+            break;
+        }
+    }
+
+    if (optind < argc) {
+        printf("%s: invalid argument -- %s\n",argv[0], argv[optind]);
+        lUsage = true;
+    }
+
+    if (lUsage) {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    TprQueues* q = window(allqdepth, chnqdepth);
+    size_t fsz = 256<<20;
+    char*  fbuff = new char[fsz]();
+    if (!q) {
+        perror("Failed to allocate queues");
+        return -1;
+    }
+
+    //  Enough frames that the channel has a full ring, within reason
+    uint64_t nframes = uint64_t(ch_period[idx%7])*chnqdepth;
+    if (nframes > MAX_FRAMES)
+        nframes = MAX_FRAMES;
+    if (nframes < 2*allqdepth)
+        nframes = 2*allqdepth;
+    fill(*q, nframes);
+
+    //  Both layouts must deliver the same frames; for slow channels the
+    //  oldest indices already point at overwritten allq entries
+    int64_t wp = q->allwp[idx];
+    int64_t n  = 0;
+    while (n < wp && n < chnqdepth &&
+           q->allrp(idx, wp-1-n) >= q->gwp - allqdepth)
+        n++;
+
+    if (n == 0) {
+        printf("channel %u: no frames left in allq; raise -a\n", idx);
+        return 0;
+    }
+
+    double   tidx=0, tchn=0;
+    uint64_t sum[2] = {0,0};
+
+    for(unsigned ipass=0; ipass<npasses; ipass++) {
+        flush(fbuff, fsz);
+        double t0 = now();
+        for(int64_t rp=wp-n; rp<wp; rp++) {
+            const TprEntry& e = q->allq(q->allrp(idx, rp));
+            sum[0] += e.word[2] + e.word[4];
+        }
+        tidx += now()-t0;
+
+        flush(fbuff, fsz);
+        t0 = now();
+        for(int64_t rp=wp-n; rp<wp; rp++) {
+            const TprEntry& e = q->chnq(idx, rp);
+            sum[1] += e.word[2] + e.word[4];
+        }
+        tchn += now()-t0;
+    }
+
+    printf("channel %u: %lld frames x %u passes\n", idx, (long long)n, npasses);
+    printf("  index   layout: %7.2f ns/frame\n", tidx*1.e9/double(n*npasses));
+    printf("  channel layout: %7.2f ns/frame\n", tchn*1.e9/double(n*npasses));
+    if (sum[0] != sum[1])
+        printf("  checksum mismatch %llx %llx [FAIL]\n",
+               (unsigned long long)sum[0], (unsigned long long)sum[1]);
+
+    delete[] fbuff;
+    free(q);
+    return 0;
+}
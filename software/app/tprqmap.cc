@@ -0,0 +1,243 @@
+//
+//  Measure the cost of mapping the shared queues: time to first frame for a
+//  new client, minor faults to touch the whole window, and dTLB misses per
+//  frame while following a channel.  Compare the driver's qprefault=0 and
+//  qprefault=1 settings, and the wake-ups per frame with -b.
+//
+#include <stdio.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include "tprsh.hh"
+#include "tprqueue.hh"
+#include "tprnuma.hh"
+
+using namespace Tpr;
+
+extern int optind;
+
+static void usage(const char* p) {
+    printf("Usage: %s [options]\n",p);
+    printf("          -d <dev>     : <tpr a/b>\n");
+    printf("          -c <channel> : channel to follow [0..%d]\n",MOD_SHARED-1);
+    printf("          -n <frames>  : frames to consume for the dTLB measurement\n");
+    printf("          -b <n,us>    : batch wake-ups, every n frames or us after the first\n");
+}
+
+static double now()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return double(ts.tv_sec)+1.e-9*double(ts.tv_nsec);
+}
+
+static long minflt()
+{
+    rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_minflt;
+}
+
+//  User-space dTLB load misses of this thread, -1 if unavailable
+static int dtlb_open()
+{
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type           = PERF_TYPE_HW_CACHE;
+    attr.size           = sizeof(attr);
+    attr.config         = PERF_COUNT_HW_CACHE_DTLB |
+        (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+        (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled       = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv     = 1;
+    return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+int main(int argc, char** argv) {
+
+    extern char* optarg;
+    char tprid='a';
+    unsigned idx = 0;
+    unsigned nframes = 100000;
+    TprBatch batch;
+    memset(&batch, 0, sizeof(batch));
+    batch.version = TPR_BATCH_VERSION;
+    char* endptr;
+
+    int c;
+    bool lUsage = false;
+
+    while ( (c=getopt( argc, argv, "d:c:n:b:h?")) != EOF ) {
+        switch(c) {
+        case 'd':
+            tprid  = optarg[0];
+            if (strlen(optarg) != 1) {
+                printf("%s: option `-d' parsing error\n", argv[0]);
+                lUsage = true;
+            }
+            break;
+        case 'c':
+            idx = strtoul(optarg,NULL,0);
+            if (idx >= MOD_SHARED)
+                lUsage = true;
+            break;
+        case 'n':
+            nframes = strtoul(optarg,NULL,0);
+            break;
+        case 'b':
+            batch.count = strtoul(optarg,&endptr,0);
+            if (*endptr==',')
+                batch.usec = strtoul(endptr+1,NULL,0);
+            break;
+        case 'h':
+            usage(argv[0]);
+            exit(0);
+        case '?':
+        default:
+            lUsage = true;
+            break;
+        }
+    }
+
+    if (optind < argc) {
+        printf("%s: invalid argument -- %s\n",argv[0], argv[optind]);
+        lUsage = true;
+    }
+
+    if (lUsage) {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    //  Time to first frame, as a new client sees it
+    long   f0 = minflt();
+    double t0 = now();
+
+    char dev[16];
+    sprintf(dev,"/dev/tpr%c%x",tprid,idx);
+    int fd = open(dev, O_RDONLY);
+    if (fd<0) {
+        printf("Open failure for dev %s\n",dev);
+        perror("Could not open");
+        return -1;
+    }
+
+    //  Consume on the card's node
+    int node = pinToCard(fd);
+    if (node >= 0)
+        printf("Running on NUMA node %d\n", node);
+
+    TprQueues* ptr = mapQueues(fd);
+    if (!ptr) {
+        perror("Failed to map");
+        return -2;
+    }
+    double t1 = now();
+
+    TprQueues& q = *ptr;
+
+    const char* zbufs = 0;
+    if (q.layout == QZeroCopy && !(zbufs = mapBuffers(fd, q))) {
+        perror("Failed to map zero-copy buffers");
+        return -2;
+    }
+
+    uint32_t buff;
+    uint32_t frame[MSG_SIZE];
+    uint64_t sum = 0;
+    QueueReader rdr(q, idx, zbufs);
+
+    //  Consume one frame
+    auto consume = [&]() -> QueueReader::Result {
+        QueueReader::Result res = rdr.next(frame, 92>>2);
+        if (res == QueueReader::Ok)
+            sum += frame[2] + frame[4];
+        return res;
+    };
+
+    while (consume() == QueueReader::Empty)
+        read(fd, &buff, sizeof(buff));
+    double t2 = now();
+    long   f1 = minflt();
+
+    //  Fault in the rest of the window
+    size_t pgsz = sysconf(_SC_PAGESIZE);
+    const volatile char* b = (const volatile char*)ptr;
+    for(size_t i=0; i<q.size; i+=pgsz)
+        sum += b[i];
+    double t3 = now();
+    long   f2 = minflt();
+
+    printf("layout %d  channel %u  window %llu bytes\n", int(q.layout), idx,
+           (unsigned long long)q.size);
+    printf("  open+mmap       : %10.1f us\n", (t1-t0)*1.e6);
+    printf("  first frame     : %10.1f us  %6ld minor faults\n", (t2-t0)*1.e6, f1-f0);
+    printf("  touch window    : %10.1f us  %6ld minor faults\n", (t3-t2)*1.e6, f2-f1);
+
+    //  Steady state
+    int pfd = dtlb_open();
+    if (pfd < 0)
+        perror("  dTLB counter unavailable");
+    else
+        ioctl(pfd, PERF_EVENT_IOC_ENABLE, 0);
+
+    if ((batch.count || batch.usec) && ioctl(fd, TPR_IOC_SETBATCH, &batch) < 0)
+        perror("  TPR_IOC_SETBATCH");
+
+    rdr.seek(qload(q.allwp[idx]));
+    unsigned n = 0, nlost = 0, nwake = 0;
+    double t4 = now();
+    while (n < nframes) {
+        QueueReader::Result res = consume();
+        if (res != QueueReader::Empty) {
+            if (res == QueueReader::Lost)
+                nlost++;
+            if ((++n % 64) && n < nframes)
+                continue;
+        }
+        //  Lets the driver hold zero-copy buffers and track our lag
+        long long allrp = rdr.position();
+        ioctl(fd, TPR_IOC_SETRP, &allrp);
+        if (res == QueueReader::Empty) {
+            read(fd, &buff, sizeof(buff));
+            nwake++;
+        }
+    }
+    double t5 = now();
+
+    uint64_t misses = 0;
+    if (pfd >= 0) {
+        ioctl(pfd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(pfd, &misses, sizeof(misses)) != sizeof(misses))
+            misses = 0;
+        close(pfd);
+    }
+
+    printf("  steady state    : %u frames in %.3f s, %u overwritten\n", n, t5-t4, nlost);
+    printf("  wake-ups        : %u  (%.3f/frame)\n", nwake, double(nwake)/double(n));
+    if (pfd >= 0)
+        printf("  dTLB misses     : %llu  (%.3f/frame)\n",
+               (unsigned long long)misses, double(misses)/double(n));
+    printf("  checksum        : %llx\n", (unsigned long long)sum);
+
+    TprClient cl;
+    memset(&cl, 0, sizeof(cl));
+    if (ioctl(fd, TPR_IOC_CLIENT, &cl) == 0)
+        printf("  driver's view   : lag %lld/%u  max %lld  lost %lld  hw drops %lld\n",
+               cl.lag, cl.depth, cl.maxlag, cl.lost, cl.drops);
+
+    if (zbufs)
+        unmapBuffers(zbufs, q);
+    unmapQueues(ptr);
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,244 @@
+#ifndef TPRQUEUE_HH
+#define TPRQUEUE_HH
+
+//
+//  Lock-free consumer of the shared queue window.  Follows the publication
+//  protocol described above tpr_handle_dma in the driver: load-acquire the
+//  write pointer, copy the slot, acquire fence, then reload the write
+//  pointer to check the copy was not overwritten meanwhile.  Correct on
+//  weakly-ordered CPUs (arm64) as well as x86.
+//
+//  Each QueueReader keeps its own read pointer and never writes the
+//  window, so any number of them, in any number of processes, may follow
+//  the same channel.  Requires C++20 (std::atomic_ref).
+//
+#include <atomic>
+#include <stdint.h>
+
+#include "tprsh.hh"
+
+namespace Tpr {
+
+  static_assert(std::atomic_ref<long long>::is_always_lock_free,
+                "queue write pointers need lock-free 64-bit loads");
+
+  //  Load a pointer the driver publishes with smp_store_release
+  inline long long qload(const volatile long long& v,
+                         std::memory_order o = std::memory_order_acquire) {
+    return std::atomic_ref<long long>(const_cast<long long&>(v)).load(o);
+  }
+
+  class QueueReader {
+  public:
+    enum Result { Empty=0, Ok=1, Lost=2 };
+    static const unsigned BSA = MOD_SHARED;
+    static const unsigned ALL = MOD_SHARED+1;
+  public:
+    //
+    //  Follow channel ch, or the BSA queue if ch==BSA, starting at the
+    //  newest entry.  bufs is the mapBuffers() window; it is only needed
+    //  for channels when the driver runs the zero-copy layout.  ch==ALL
+    //  follows allq itself by gwp, every event of every channel once;
+    //  only the index layout has one.
+    //
+    QueueReader(TprQueues& q, unsigned ch, const char* bufs=0) :
+      _q     (q),
+      _ch    (ch),
+      _layout(ch==BSA ? QChannel : QLayout(q.layout)),
+      _depth (ch==BSA ? q.bsaqdepth : ch==ALL ? q.allqdepth : q.depth()),
+      _wp    (ch==BSA ? q.bsawp : ch==ALL ? q.gwp : q.allwp[ch]),
+      _bufs  (bufs),
+      _rp    (qload(_wp)),
+      _lost  (0) {}
+  public:
+    long long position () const { return _rp; }
+    void      seek     (long long rp) { _rp = rp; }
+    //  Entries published but not yet read
+    long long available() const { return qload(_wp) - _rp; }
+    //  Entries overwritten before they could be read
+    long long lost     () const { return _lost; }
+    //
+    //  Copy up to MSG_SIZE-2 words of the next entry to dst.  Lost means the
+    //  entry was overwritten before or during the copy; it is skipped and
+    //  counted, and the next call carries on from the oldest entry left.
+    //
+    Result next(uint32_t* dst, unsigned nwords, uint64_t* tsc=0) {
+      long long wp = qload(_wp);
+      if (_rp >= wp)
+        return Empty;
+      if (wp - _rp >= _depth) {
+        _lost += wp - _depth + 1 - _rp;
+        _rp    = wp - _depth + 1;
+      }
+      if (nwords > MSG_SIZE-2)
+        nwords = MSG_SIZE-2;
+
+      long long g = 0;
+      uint64_t  t = 0;
+      bool      ok = true;
+      if (_layout == QChannel) {
+        const TprEntry& e = _ch==BSA ? _q.bsaq(_rp) : _q.chnq(_ch, _rp);
+        //  Lapped already: don't bother copying
+        if (e.seq != _rp)
+          ok = false;
+        else
+          copy(e.word, dst, nwords);
+        t = e.fifo_tsc;
+      }
+      else {
+        g = _ch==ALL ? _rp : _q.allrp(_ch, _rp);
+        if (_layout == QZeroCopy) {
+          const TprDesc& d = _q.desc(g);
+          uint32_t b = d.buffer, o = d.offset;
+          t = d.fifo_tsc;
+          //  A torn descriptor must not send us outside the buffers
+          ok = _bufs && b < _q.nbuffers && o + 4*nwords <= _q.bufsize;
+          if (ok)
+            copy(reinterpret_cast<const volatile uint32_t*>
+                 (_bufs + size_t(b)*_q.bufsize + o), dst, nwords);
+        }
+        else {
+          const TprEntry& e = _q.allq(g);
+          if (e.seq != g)
+            ok = false;
+          else
+            copy(e.word, dst, nwords);
+          t = e.fifo_tsc;
+        }
+      }
+
+      std::atomic_thread_fence(std::memory_order_acquire);
+      ok = ok && qload(_wp, std::memory_order_relaxed) - _rp < _depth;
+      if (ok && _layout != QChannel)
+        ok = qload(_q.gwp, std::memory_order_relaxed) - g < _q.allqdepth;
+      if (ok && _layout == QZeroCopy)
+        ok = g >= qload(_q.zcq().freewp, std::memory_order_relaxed);
+
+      _rp++;
+      if (!ok) {
+        _lost++;
+        return Lost;
+      }
+      if (tsc)
+        *tsc = t;
+      return Ok;
+    }
+  private:
+    static void copy(const volatile uint32_t* src, uint32_t* dst, unsigned n) {
+      for(unsigned i=0; i<n; i++)
+        dst[i] = src[i];
+    }
+  private:
+    TprQueues&                _q;
+    unsigned                  _ch;
+    QLayout                   _layout;
+    long long                 _depth;
+    const volatile long long& _wp;
+    const char*               _bufs;
+    long long                 _rp;
+    long long                 _lost;
+  };
+
+  //
+  //  The same protocol over the pulse records of one BSA EDEF.
+  //
+  class EdefReader {
+  public:
+    typedef QueueReader::Result Result;
+  public:
+    EdefReader(TprQueues& q, unsigned edef) :
+      _q    (q),
+      _edef (edef),
+      _depth(q.edefqdepth),
+      _wp   (q.edefwp[edef]),
+      _rp   (qload(_wp)),
+      _lost (0) {}
+  public:
+    long long position () const { return _rp; }
+    void      seek     (long long rp) { _rp = rp; }
+    long long available() const { return qload(_wp) - _rp; }
+    long long lost     () const { return _lost; }
+    Result next(uint64_t& pulseId, uint64_t& timeStamp, uint32_t& status) {
+      long long wp = qload(_wp);
+      if (_rp >= wp)
+        return QueueReader::Empty;
+      if (wp - _rp >= _depth) {
+        _lost += wp - _depth + 1 - _rp;
+        _rp    = wp - _depth + 1;
+      }
+      const TprEdefRec& r = _q.edefq(_edef, _rp);
+      bool ok   = r.seq == _rp;
+      pulseId   = r.pulseId;
+      timeStamp = r.timeStamp;
+      status    = r.status;
+      std::atomic_thread_fence(std::memory_order_acquire);
+      ok = ok && qload(_wp, std::memory_order_relaxed) - _rp < _depth;
+      _rp++;
+      if (!ok) {
+        _lost++;
+        return QueueReader::Lost;
+      }
+      return QueueReader::Ok;
+    }
+  private:
+    TprQueues&                _q;
+    unsigned                  _edef;
+    long long                 _depth;
+    const volatile long long& _wp;
+    long long                 _rp;
+    long long                 _lost;
+  };
+
+  //
+  //  A consistent copy of the driver's TSC to timing clock model.  time()
+  //  converts a cycle count (fifo_tsc, or __rdtsc() here on the same host)
+  //  to timing-system ns without a syscall.
+  //
+  class ClockModel {
+  public:
+    ClockModel() : tsc0(0), ts0(0), mult(0), latmean(0), latmax(0), updates(0) {}
+  public:
+    //  false until the driver has fitted a rate
+    bool read(const TprQueues& q) {
+      const TprClock& c = q.clock;
+      uint32_t s;
+      bool     valid;
+      do {
+        while ((s = qload32(c.seq)) & 1)
+          ;
+        valid   = c.valid;
+        tsc0    = c.tsc0;
+        ts0     = c.ts0;
+        mult    = c.mult;
+        latmean = c.latmean;
+        latmax  = c.latmax;
+        updates = c.updates;
+        std::atomic_thread_fence(std::memory_order_acquire);
+      } while (qload32(c.seq, std::memory_order_relaxed) != s);
+      return valid;
+    }
+    uint64_t time(uint64_t tsc) const {
+      int64_t dt = int64_t(tsc - tsc0);
+      uint64_t ns = mulshr32(dt < 0 ? -uint64_t(dt) : uint64_t(dt), mult);
+      return dt < 0 ? ts0 - ns : ts0 + ns;
+    }
+  private:
+    static uint32_t qload32(const volatile uint32_t& v,
+                            std::memory_order o = std::memory_order_acquire) {
+      return std::atomic_ref<uint32_t>(const_cast<uint32_t&>(v)).load(o);
+    }
+    //  (a*b)>>32 in 32-bit halves, as the driver's mul_u64_u64_shr; no
+    //  128-bit type on 32-bit targets
+    static uint64_t mulshr32(uint64_t a, uint64_t b) {
+      uint64_t ah = a>>32, al = a&0xffffffff;
+      uint64_t bh = b>>32, bl = b&0xffffffff;
+      return ((ah*bh)<<32) + ah*bl + al*bh + ((al*bl)>>32);
+    }
+  public:
+    uint64_t tsc0, ts0, mult;
+    uint64_t latmean, latmax;   // ns past the fastest delivery
+    uint64_t updates;
+  };
+};
+
+#endif
@@ -0,0 +1,268 @@
+#include "tprreader.hh"
+#include "tprnuma.hh"
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace Tpr;
+
+static inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  asm volatile("yield");
+#endif
+}
+
+void Frame::dump() const
+{
+  char m = word[0]&(0x808<<20) ? 'D':' ';
+  if (isEvent()) {
+    EventMsg e = event();
+    printf("EVENT LCLS%c chmask [x%x] [x%x] %c: %16llx %16llx",
+           e.lcls1() ? '1':'2',
+           word[0]&0xffff, word[1], m,
+           (unsigned long long)e.pulseId(), (unsigned long long)e.timeStamp());
+    for(unsigned i=6; i<20; i++)
+      printf(" %08x",word[i]);
+    printf("\n");
+  }
+  else if (isBsaControl()) {
+    BsaControlMsg c = bsaControl();
+    printf("BSACNTL %c: %16llx %16llx I%016llx m%016llx M%016llx\n", m,
+           (unsigned long long)c.pulseId(), (unsigned long long)c.timeStamp(),
+           (unsigned long long)c.init(), (unsigned long long)c.minor(),
+           (unsigned long long)c.major());
+  }
+  else if (isBsaEvent()) {
+    BsaEventMsg e = bsaEvent();
+    printf("BSAEVNT %c: %16llx %16llx A%016llx D%016llx U%016llx\n", m,
+           (unsigned long long)e.pulseId(), (unsigned long long)e.timeStamp(),
+           (unsigned long long)e.active(), (unsigned long long)e.avgDone(),
+           (unsigned long long)e.update());
+  }
+}
+
+Reader::Reader() :
+  _fd      (-1),
+  _ch      (0),
+  _node    (-1),
+  _wait    (Block),
+  _filtered(false),
+  _dev     (false),
+  _q       (0),
+  _bufs    (0),
+  _rdr     (0)
+{
+}
+
+Reader::~Reader()
+{
+  close();
+}
+
+int Reader::open(char tprid, unsigned ch, Wait wait, bool pin)
+{
+  close();
+
+  if (ch > BSA) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  char dev[16];
+  if (ch == BSA)
+    sprintf(dev,"/dev/tpr%cBSA",tprid);
+  else
+    sprintf(dev,"/dev/tpr%c%x",tprid,ch);
+
+  _fd = ::open(dev, O_RDONLY);
+  if (_fd < 0)
+    return -1;
+  _ch  = ch;
+  _dev = true;
+  this->wait(wait);
+
+  //  Consume on the card's node
+  _node = pin ? pinToCard(_fd) : -1;
+
+  errno = 0;
+  if (!(_q = mapQueues(_fd))) {
+    if (!errno)
+      errno = EPROTO;
+    close();
+    return -1;
+  }
+  if (ch != BSA && _q->layout == QZeroCopy && !(_bufs = mapBuffers(_fd, *_q))) {
+    close();
+    return -1;
+  }
+  _rdr = new QueueReader(*_q, ch, _bufs);
+  return 0;
+}
+
+int Reader::open(const char* path, unsigned ch, Wait wait)
+{
+  close();
+
+  if (ch > BSA) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  _fd = ::open(path, O_RDONLY);
+  if (_fd < 0)
+    return -1;
+  _ch   = ch;
+  _wait = wait;
+  _node = -1;
+
+  errno = 0;
+  if (!(_q = mapQueues(_fd))) {
+    if (!errno)
+      errno = EPROTO;
+    close();
+    return -1;
+  }
+  //  Nothing behind it to hold DMA buffers
+  if (ch != BSA && _q->layout == QZeroCopy) {
+    errno = EPROTO;
+    close();
+    return -1;
+  }
+  _rdr = new QueueReader(*_q, ch);
+  return 0;
+}
+
+void Reader::close()
+{
+  delete _rdr;
+  _rdr = 0;
+  if (_bufs)
+    unmapBuffers(_bufs, *_q);
+  _bufs = 0;
+  if (_q)
+    unmapQueues(_q);
+  _q = 0;
+  if (_fd >= 0)
+    ::close(_fd);
+  _fd = -1;
+  _filtered = false;
+  _dev      = false;
+}
+
+void Reader::wait(Wait w)
+{
+  _wait = w;
+  //  Only Block sleeps in read()
+  if (_fd >= 0 && _dev) {
+    int flags = fcntl(_fd, F_GETFL);
+    if (w == Block)
+      flags &= ~O_NONBLOCK;
+    else
+      flags |= O_NONBLOCK;
+    fcntl(_fd, F_SETFL, flags);
+  }
+}
+
+int Reader::filter(const TprFilter& f)
+{
+  if (ioctl(_fd, TPR_IOC_SETFILTER, &f) < 0)
+    return -1;
+  _filtered = f.decimate > 1 || f.pidmod || f.nmatch;
+  return 0;
+}
+
+int Reader::batch(unsigned count, unsigned usec)
+{
+  TprBatch b;
+  b.version  = TPR_BATCH_VERSION;
+  b.count    = count;
+  b.usec     = usec;
+  b.reserved = 0;
+  return ioctl(_fd, TPR_IOC_SETBATCH, &b);
+}
+
+long long Reader::drops() const
+{
+  return qload(_ch == BSA ? _q->bsadrops : _q->drops[_ch], std::memory_order_relaxed);
+}
+
+void Reader::report()
+{
+  long long rp = _rdr->position();
+  ioctl(_fd, TPR_IOC_SETRP, &rp);
+}
+
+bool Reader::await()
+{
+  if (_wait == BusyPoll) {
+    while (_rdr->available() <= 0)
+      cpu_relax();
+    return true;
+  }
+  if (!_dev) {
+    if (_wait == NonBlock)
+      return false;
+    while (_rdr->available() <= 0)
+      usleep(5);
+    return true;
+  }
+  uint32_t pending;
+  return ::read(_fd, &pending, sizeof(pending)) == ssize_t(sizeof(pending));
+}
+
+size_t Reader::next(std::span<Frame> out)
+{
+  //  Events hold 23 words, BSA messages 11
+  const unsigned nwords = (_ch == BSA ? 44 : 92)>>2;
+  size_t n = 0;
+
+  if (out.empty())
+    return 0;
+
+  if (_filtered) {
+    //  The driver tells us which entry passed
+    while (!n) {
+      TprWake w;
+      ssize_t r = ::read(_fd, &w, sizeof(w));
+      if (r != ssize_t(sizeof(w))) {
+        if (r < 0 && errno == EAGAIN && _wait == BusyPoll) {
+          cpu_relax();
+          continue;
+        }
+        return 0;
+      }
+      _rdr->seek(w.rp);
+      Frame& f = out[0];
+      if (_rdr->next(f.word, nwords, &f.fifo_tsc) == QueueReader::Ok) {
+        f.seq = w.rp;
+        n = 1;
+      }
+    }
+  }
+  else {
+    while (1) {
+      while (n < out.size()) {
+        Frame& f = out[n];
+        QueueReader::Result res = _rdr->next(f.word, nwords, &f.fifo_tsc);
+        if (res == QueueReader::Empty)
+          break;
+        if (res == QueueReader::Ok) {
+          f.seq = _rdr->position()-1;
+          n++;
+        }
+      }
+      if (n || !await())
+        break;
+    }
+  }
+
+  //  Lets the driver hold the zero-copy buffers and track our lag
+  if (_bufs)
+    report();
+  return n;
+}
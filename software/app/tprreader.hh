@@ -0,0 +1,175 @@
+#ifndef TPRREADER_HH
+#define TPRREADER_HH
+
+//
+//  Consumer of one channel (or the BSA queue) of a card: opens the device,
+//  maps the queue window (and the zero-copy buffers), follows it with a
+//  QueueReader and waits for the driver when it runs dry.  Tools and IOCs
+//  share this one path rather than each walking allrp/allwp themselves.
+//
+//    Reader rdr;
+//    if (rdr.open('a', 0) < 0) ...
+//    Frame f[64];
+//    while (run)
+//      for(Frame& e : std::span(f, rdr.next(f)))
+//        if (e.isEvent()) use(e.event().pulseId());
+//
+//  A Reader is not thread-safe; give each thread its own.
+//
+#include <stdint.h>
+#include <span>
+
+#include "tprsh.hh"
+#include "tprqueue.hh"
+
+namespace Tpr {
+
+  //  Typed views of the messages, as copied into a Frame
+  class EventMsg {
+  public:
+    EventMsg(const uint32_t* p) : _p(p) {}
+  public:
+    uint32_t channels   () const { return _p[0] & ((1<<MOD_SHARED)-1); }
+    bool     drop       () const { return _p[0] & (0x808<<20); }
+    bool     lcls1      () const { return _p[0] & (1<<22); }
+    uint64_t pulseId    () const { return u64(2); }
+    uint64_t timeStamp  () const { return u64(4); }
+    uint32_t seconds    () const { return _p[5]; }
+    uint32_t nanoseconds() const { return _p[4]; }
+    //  The message words, for the fields beyond the time stamp
+    const uint32_t* words() const { return _p; }
+  private:
+    uint64_t u64(unsigned i) const { return uint64_t(_p[i]) | (uint64_t(_p[i+1])<<32); }
+  private:
+    const uint32_t* _p;
+  };
+
+  class BsaControlMsg {
+  public:
+    BsaControlMsg(const uint32_t* p) : _p(p) {}
+  public:
+    bool     drop     () const { return _p[0] & (0x808<<20); }
+    uint64_t pulseId  () const { return u64(0); }
+    uint64_t timeStamp() const { return u64(1); }
+    uint64_t init     () const { return u64(2); }
+    uint64_t minor    () const { return u64(3); }
+    uint64_t major    () const { return u64(4); }
+  private:
+    uint64_t u64(unsigned i) const { return uint64_t(_p[1+2*i]) | (uint64_t(_p[2+2*i])<<32); }
+  private:
+    const uint32_t* _p;
+  };
+
+  class BsaEventMsg {
+  public:
+    BsaEventMsg(const uint32_t* p) : _p(p) {}
+  public:
+    bool     drop     () const { return _p[0] & (0x808<<20); }
+    uint64_t pulseId  () const { return u64(0); }
+    uint64_t active   () const { return u64(1); }
+    uint64_t avgDone  () const { return u64(2); }
+    uint64_t timeStamp() const { return u64(3); }
+    uint64_t update   () const { return u64(4); }
+  private:
+    uint64_t u64(unsigned i) const { return uint64_t(_p[1+2*i]) | (uint64_t(_p[2+2*i])<<32); }
+  private:
+    const uint32_t* _p;
+  };
+
+  //  One entry of a channel or the BSA queue
+  class Frame {
+  public:
+    enum { Event=0, BsaControl=1, BsaEvent=2 };
+  public:
+    unsigned      tag         () const { return (word[0]>>16)&0xf; }
+    bool          isEvent     () const { return tag()==Event; }
+    bool          isBsaControl() const { return tag()==BsaControl; }
+    bool          isBsaEvent  () const { return tag()==BsaEvent; }
+    EventMsg      event       () const { return EventMsg(word); }
+    BsaControlMsg bsaControl  () const { return BsaControlMsg(word); }
+    BsaEventMsg   bsaEvent    () const { return BsaEventMsg(word); }
+    void          dump        () const;
+  public:
+    uint32_t  word[MSG_SIZE-2];
+    long long seq;        // position in the channel (allwp) or BSA queue (bsawp)
+    uint64_t  fifo_tsc;   // when the driver took it from the card (see ClockModel)
+  };
+
+  class Reader {
+  public:
+    //
+    //  What next() does when nothing is published:
+    //    Block    - sleep in read() until the driver wakes us
+    //    NonBlock - return 0
+    //    BusyPoll - spin on the write pointer; lowest latency, costs a CPU
+    //
+    enum Wait { Block, NonBlock, BusyPoll };
+    static const unsigned BSA = QueueReader::BSA;
+  public:
+    Reader();
+    ~Reader();
+  public:
+    //
+    //  Follow channel ch [0..MOD_SHARED-1], or BSA, of /dev/tpr<tprid>,
+    //  from the newest entry.  pin runs the calling thread on the card's
+    //  NUMA node.  0, or -1 with errno set.
+    //
+    int  open (char tprid, unsigned ch, Wait wait=Block, bool pin=true);
+    //
+    //  Follow a queue window published by something other than the
+    //  driver, such as tprreplay's shared memory (/dev/shm/<name>).  There
+    //  is no driver to wake us, so Block polls the write pointer every
+    //  few microseconds, and filter(), batch() and report() fail.
+    //
+    int  open (const char* path, unsigned ch, Wait wait=BusyPoll);
+    void close();
+  public:
+    //  Copy up to out.size() entries, in order; their number.  Entries
+    //  overwritten before they could be copied are skipped (see lost()).
+    size_t next(std::span<Frame> out);
+    //  A single entry; false as for await()
+    bool   next(Frame& f) { return next(std::span<Frame>(&f, 1)) == 1; }
+    //  Wait as wait() says until something new may be published; false
+    //  if NonBlock found nothing or the wait was interrupted
+    bool   await();
+  public:
+    void      wait     (Wait w);
+    Wait      wait     () const { return _wait; }
+    //  Only wake on the events that pass f (TPR_IOC_SETFILTER).  next()
+    //  then returns just the entry each wake-up points at, skipping those
+    //  in between.
+    int       filter   (const TprFilter& f);
+    //  Batch the wake-ups (TPR_IOC_SETBATCH)
+    int       batch    (unsigned count, unsigned usec);
+    //  Entries published and not yet read
+    long long available() const { return _rdr->available(); }
+    //  Entries overwritten before they could be read (we were lapped)
+    long long lost     () const { return _rdr->lost(); }
+    //  Hardware drops flagged on this channel, or on BSA
+    long long drops    () const;
+    long long position () const { return _rdr->position(); }
+    void      seek     (long long rp) { _rdr->seek(rp); }
+    //  Report position() to the driver (TPR_IOC_SETRP); next() does so
+    //  itself when the zero-copy buffers depend on it
+    void      report   ();
+  public:
+    int         fd     () const { return _fd; }
+    unsigned    channel() const { return _ch; }
+    //  NUMA node open() ran us on, -1 if not pinned
+    int         node   () const { return _node; }
+    TprQueues&  queues () const { return *_q; }
+    bool        clock  (ClockModel& m) const { return m.read(*_q); }
+  private:
+    int          _fd;
+    unsigned     _ch;
+    int          _node;
+    Wait         _wait;
+    bool         _filtered;
+    bool         _dev;
+    TprQueues*   _q;
+    const char*  _bufs;
+    QueueReader* _rdr;
+  };
+};
+
+#endif
@@ -0,0 +1,84 @@
+#include "tprrec.hh"
+
+#include <string.h>
+
+using namespace Tpr;
+
+unsigned Tpr::recSize(const Frame& f)
+{
+  unsigned msgsz = f.isEvent() ? 92 : 44;
+  return (sizeof(RecHeader) + msgsz + 7) & ~7U;
+}
+
+bool Tpr::recFits(size_t used, unsigned size, size_t blocksize)
+{
+  size_t end = used + size;
+  return end == blocksize || (end < blocksize && blocksize - end >= sizeof(RecHeader));
+}
+
+void Tpr::recWrite(char* p, const Frame& f, uint32_t lost)
+{
+  RecHeader* h = reinterpret_cast<RecHeader*>(p);
+  h->type     = f.tag();
+  h->size     = recSize(f);
+  h->lost     = lost;
+  h->seq      = f.seq;
+  h->fifo_tsc = f.fifo_tsc;
+  memcpy(h+1, f.word, f.isEvent() ? 92 : 44);
+}
+
+size_t Tpr::recPad(char* block, size_t used)
+{
+  //  A whole RecHeader at least; recFits left room for one
+  if (!(used % TPR_REC_ALIGN))
+    return used;
+  size_t bytes = (used + sizeof(RecHeader) + TPR_REC_ALIGN-1) & ~size_t(TPR_REC_ALIGN-1);
+  RecHeader* h = reinterpret_cast<RecHeader*>(block + used);
+  memset(h, 0, bytes - used);
+  h->type = RecPad;
+  h->size = bytes - used;
+  return bytes;
+}
+
+RecReader::RecReader(FILE* f) :
+  _f  (f),
+  _pos(0),
+  _ok (false)
+{
+  if (fread(&_hdr, sizeof(_hdr), 1, _f) == 1 && _hdr.magic == TPR_REC_MAGIC &&
+      _hdr.version == TPR_REC_VERSION && _hdr.hdrsize >= sizeof(_hdr)) {
+    _pos = _hdr.hdrsize;
+    _ok  = fseek(_f, _pos, SEEK_SET) == 0;
+  }
+}
+
+bool RecReader::next(Frame& f)
+{
+  RecHeader r;
+  while (_ok && fread(&r, sizeof(r), 1, _f) == 1) {
+    if (r.type == RecPad) {
+      //  The next block starts at the boundary, whatever the size says
+      _pos = (_pos + TPR_REC_ALIGN) & ~uint64_t(TPR_REC_ALIGN-1);
+      if (fseek(_f, _pos, SEEK_SET))
+        break;
+      continue;
+    }
+    if (r.size < sizeof(r))
+      break;
+    size_t len = r.size - sizeof(r);
+    _pos += r.size;
+    if (len > sizeof(f.word)) {
+      if (fseek(_f, len, SEEK_CUR))
+        break;
+      continue;
+    }
+    memset(f.word, 0, sizeof(f.word));
+    if (fread(f.word, 1, len, _f) != len)
+      break;
+    f.seq      = r.seq;
+    f.fifo_tsc = r.fifo_tsc;
+    return true;
+  }
+  _ok = false;
+  return false;
+}
@@ -0,0 +1,114 @@
+#ifndef TPRREC_HH
+#define TPRREC_HH
+
+//
+//  Recording format written by tprrecord.
+//
+//  A recording is a series of files <prefix>-<n>.tpr, each with an index
+//  <prefix>-<n>.idx.  A .tpr file is a RecFile header padded to
+//  TPR_REC_ALIGN, then blocks of records.  Each block is one write of
+//  up to blocksize bytes, a multiple of TPR_REC_ALIGN (O_DIRECT); the
+//  space left at its end is a RecPad record.  A record is a RecHeader,
+//  then the message words as they were in the queue window, padded to
+//  8 bytes.  A RecPad runs to the next TPR_REC_ALIGN boundary, where the
+//  next block starts; it is zeroed and always holds a whole RecHeader,
+//  but readers skip to the boundary rather than trust its size.
+//
+//  The .idx file is a RecIndex header, then one RecBlock per block: where
+//  it is and the range of pulse IDs in it, so a reader can seek to a
+//  pulse without scanning the data.
+//
+#include <stdint.h>
+#include <stdio.h>
+
+#include "tprreader.hh"
+
+namespace Tpr {
+
+#define TPR_REC_MAGIC     0x3130434552525054ULL   // "TPRREC01"
+#define TPR_REC_IDXMAGIC  0x3130584449525054ULL   // "TPRIDX01"
+#define TPR_REC_VERSION   1
+#define TPR_REC_ALIGN     4096
+
+  class RecFile {
+  public:
+    uint64_t magic;
+    uint32_t version;
+    uint32_t hdrsize;
+    uint32_t blocksize;
+    uint32_t fileno;      // <n> of this file in the recording
+    uint32_t channel;     // first channel recorded, or MOD_SHARED if none
+    uint32_t bsa;         // BSA queue recorded
+    char     card;        // /dev/tpr<card>
+    char     reserved;
+    uint16_t chmask;      // channels recorded
+    uint32_t reserved2;
+    uint64_t start_ns;    // CLOCK_REALTIME when the file was opened
+    //  The driver's TSC to timing clock model when the file was opened
+    //  (see ClockModel), to interpret fifo_tsc; mult 0 if not fitted
+    uint64_t tsc0, ts0, mult;
+  };
+
+  enum RecType { RecEvent=0, RecBsaControl=1, RecBsaEvent=2, RecPad=0xf };
+
+  class RecHeader {
+  public:
+    uint16_t type;        // RecType
+    uint16_t size;        // bytes, this header included
+    uint32_t lost;        // entries of the same queue lost just before this one
+    long long seq;        // position in its queue (allwp, gwp if chmask has
+                          // several channels, or bsawp)
+    uint64_t fifo_tsc;
+    //  followed by (size - sizeof(RecHeader)) bytes of the message
+  };
+
+  class RecIndex {
+  public:
+    uint64_t magic;
+    uint32_t version;
+    uint32_t fileno;
+    uint64_t nblocks;
+  };
+
+  class RecBlock {
+  public:
+    uint64_t offset;      // in the .tpr file
+    uint32_t bytes;       // written, padding included
+    uint32_t nevents;
+    uint32_t nbsa;
+    uint32_t lost;        // entries lost in the block's span
+    uint64_t firstPulseId;  // of its events, or BSA if it has none
+    uint64_t lastPulseId;
+  };
+
+  //  Bytes of the record of f
+  unsigned recSize (const Frame& f);
+  //  Whether a record of size bytes goes after the used bytes of a block,
+  //  leaving the rest of it empty or able to hold a RecPad
+  bool     recFits (size_t used, unsigned size, size_t blocksize);
+  //  Write the record of f at p
+  void     recWrite(char* p, const Frame& f, uint32_t lost);
+  //  Fill a block of used bytes out to TPR_REC_ALIGN with a RecPad; the
+  //  bytes to write
+  size_t   recPad  (char* block, size_t used);
+
+  //  Iterates over the records of a .tpr file, as PackReader over a
+  //  packed stream
+  class RecReader {
+  public:
+    RecReader(FILE* f);
+  public:
+    //  false if f does not hold a recording
+    bool           valid () const { return _ok; }
+    const RecFile& header() const { return _hdr; }
+    //  The next event or BSA message; false at the end of the file
+    bool           next  (Frame& f);
+  private:
+    FILE*    _f;
+    RecFile  _hdr;
+    uint64_t _pos;
+    bool     _ok;
+  };
+};
+
+#endif
@@ -0,0 +1,603 @@
+//
+//  Record every event of one or more channels and every BSA message of a
+//  card, with the driver's fifo_tsc, in the format of tprrec.hh.  Several
+//  channels are read from allq by gwp, so an event in more than one of
+//  them is recorded once, as are those of channels other clients have
+//  open; that needs the driver's index layout (the default, qlayout=0).
+//  One thread copies
+//  the frames out of the queue window into large aligned blocks; another
+//  writes the blocks with O_DIRECT, rotates the files and keeps their
+//  pulse ID index.  Frames the window overwrote before we copied them,
+//  and drops the card flagged, are counted and reported every second.
+//
+#include <stdio.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "tprreader.hh"
+#include "tprrec.hh"
+
+using namespace Tpr;
+
+extern int optind;
+
+static void usage(const char* p) {
+    printf("Usage: %s [options] <prefix>\n",p);
+    printf("          -d <dev>     : <tpr a/b>\n");
+    printf("          -c <channel> : channel to record [0..%d], -1 for none; repeat for several\n",MOD_SHARED-1);
+    printf("          -B           : record the BSA queue too\n");
+    printf("          -b <KB>      : block (write) size, multiple of %u\n",TPR_REC_ALIGN/1024);
+    printf("          -n <blocks>  : blocks in flight to the writer\n");
+    printf("          -S <MB>      : rotate files at this size\n");
+    printf("          -t <sec>     : stop after this long (default: at SIGINT)\n");
+    printf("          -P           : busy-poll the queues instead of sleeping\n");
+    printf("  Writes <prefix>-<n>.tpr and its index <prefix>-<n>.idx\n");
+}
+
+static volatile sig_atomic_t stop = 0;
+
+static void sigHandler(int) { stop = 1; }
+
+static double now()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return double(ts.tv_sec)+1.e-9*double(ts.tv_nsec);
+}
+
+class Block {
+public:
+    char*    data;
+    size_t   used;
+    RecBlock index;
+};
+
+//
+//  Writes the blocks handed to it, in order, and returns them for reuse
+//
+class Writer {
+public:
+    Writer(const char* prefix, const RecFile& hdr, const TprQueues* q,
+           uint64_t filesize) :
+        _prefix  (prefix),
+        _hdr     (hdr),
+        _q       (q),
+        _filesize(filesize),
+        _fd      (-1),
+        _fileno  (0),
+        _offset  (0),
+        _direct  (true),
+        _done    (false),
+        _bytes   (0),
+        _errors  (0),
+        _thread  (&Writer::run, this) {}
+    ~Writer() { finish(); }
+public:
+    //  Write what was submitted and close the last file
+    void finish() {
+        if (!_thread.joinable())
+            return;
+        {
+            std::lock_guard<std::mutex> lk(_lock);
+            _done = true;
+        }
+        _cv.notify_all();
+        _thread.join();
+        closeFile();
+    }
+    void submit(Block* b) {
+        {
+            std::lock_guard<std::mutex> lk(_lock);
+            _queue.push_back(b);
+        }
+        _cv.notify_all();
+    }
+    //  A written block, or 0 if none is back yet
+    Block* reclaim() {
+        std::lock_guard<std::mutex> lk(_lock);
+        if (_free.empty())
+            return 0;
+        Block* b = _free.front();
+        _free.pop_front();
+        return b;
+    }
+    //  Wait for a written block
+    Block* wait() {
+        std::unique_lock<std::mutex> lk(_lock);
+        _cv.wait(lk, [this]{ return !_free.empty(); });
+        Block* b = _free.front();
+        _free.pop_front();
+        return b;
+    }
+    uint64_t bytes () const { return _bytes.load(std::memory_order_relaxed); }
+    unsigned errors() const { return _errors.load(std::memory_order_relaxed); }
+    unsigned files () const { return _fileno; }
+    bool     direct() const { return _direct; }
+private:
+    void run() {
+        while (1) {
+            Block* b;
+            {
+                std::unique_lock<std::mutex> lk(_lock);
+                _cv.wait(lk, [this]{ return _done || !_queue.empty(); });
+                if (_queue.empty())
+                    return;
+                b = _queue.front();
+                _queue.pop_front();
+            }
+            write(b);
+            {
+                std::lock_guard<std::mutex> lk(_lock);
+                _free.push_back(b);
+            }
+            _cv.notify_all();
+        }
+    }
+    void write(Block* b) {
+        //  Fill the block out to the alignment with a RecPad record
+        size_t bytes = recPad(b->data, b->used);
+        if (_fd < 0 || _offset + bytes > _filesize)
+            openFile();
+        if (_fd < 0) {
+            _errors++;
+            return;
+        }
+        ssize_t r = pwrite(_fd, b->data, bytes, _offset);
+        if (r != ssize_t(bytes)) {
+            perror("pwrite");
+            _errors++;
+            return;
+        }
+        b->index.offset = _offset;
+        b->index.bytes  = bytes;
+        _index.push_back(b->index);
+        _offset += bytes;
+        _bytes  += bytes;
+    }
+    void openFile() {
+        closeFile();
+        char name[256];
+        snprintf(name, sizeof(name), "%s-%05u.tpr", _prefix.c_str(), _fileno);
+        int flags = O_WRONLY | O_CREAT | O_TRUNC;
+        _fd = _direct ? ::open(name, flags | O_DIRECT, 0644) : -1;
+        if (_fd < 0 && _direct) {
+            //  tmpfs and some network filesystems refuse O_DIRECT
+            _fd = ::open(name, flags, 0644);
+            if (_fd >= 0) {
+                printf("%s: O_DIRECT refused; writing through the page cache\n", name);
+                _direct = false;
+            }
+        }
+        if (_fd < 0) {
+            perror(name);
+            return;
+        }
+
+        void* p;
+        if (posix_memalign(&p, TPR_REC_ALIGN, TPR_REC_ALIGN))
+            return;
+        memset(p, 0, TPR_REC_ALIGN);
+        RecFile& h = *reinterpret_cast<RecFile*>(p);
+        h          = _hdr;
+        h.fileno   = _fileno;
+        timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        h.start_ns = uint64_t(ts.tv_sec)*1000000000ULL + ts.tv_nsec;
+        ClockModel clk;
+        if (clk.read(*_q)) {
+            h.tsc0 = clk.tsc0;
+            h.ts0  = clk.ts0;
+            h.mult = clk.mult;
+        }
+        if (pwrite(_fd, p, TPR_REC_ALIGN, 0) != TPR_REC_ALIGN)
+            perror(name);
+        free(p);
+        _offset = TPR_REC_ALIGN;
+    }
+    void closeFile() {
+        if (_fd < 0)
+            return;
+        ::close(_fd);
+        _fd = -1;
+
+        char name[256];
+        snprintf(name, sizeof(name), "%s-%05u.idx", _prefix.c_str(), _fileno);
+        FILE* f = fopen(name, "w");
+        if (f) {
+            RecIndex h;
+            memset(&h, 0, sizeof(h));
+            h.magic   = TPR_REC_IDXMAGIC;
+            h.version = TPR_REC_VERSION;
+            h.fileno  = _fileno;
+            h.nblocks = _index.size();
+            fwrite(&h, sizeof(h), 1, f);
+            fwrite(_index.data(), sizeof(RecBlock), _index.size(), f);
+            fclose(f);
+        }
+        else
+            perror(name);
+        _index.clear();
+        _fileno++;
+    }
+private:
+    std::string             _prefix;
+    RecFile                 _hdr;
+    const TprQueues*        _q;
+    uint64_t                _filesize;
+    int                     _fd;
+    unsigned                _fileno;
+    uint64_t                _offset;
+    bool                    _direct;
+    std::vector<RecBlock>   _index;
+    std::mutex              _lock;
+    std::condition_variable _cv;
+    std::deque<Block*>      _queue;
+    std::deque<Block*>      _free;
+    bool                    _done;
+    std::atomic<uint64_t>   _bytes;
+    std::atomic<unsigned>   _errors;
+    std::thread             _thread;
+};
+
+//
+//  The events of the channels recorded: those of one channel through its
+//  Reader, those of several from allq, once each
+//
+class Events {
+public:
+    Events() : _mask(0), _first(0), _all(0) {}
+    ~Events() { delete _all; }
+public:
+    int open(char tprid, uint32_t mask) {
+        _mask  = mask;
+        _first = __builtin_ctz(mask);
+        for(unsigned ch=0; ch<MOD_SHARED; ch++)
+            if ((mask & (1<<ch)) && _ch[ch].open(tprid, ch, Reader::NonBlock) < 0) {
+                perror("Could not open channel");
+                return -1;
+            }
+        if (mask & (mask-1)) {
+            if (queues().layout != QIndex) {
+                printf("Several channels need the driver's index layout (qlayout=0)\n");
+                return -1;
+            }
+            _all = new QueueReader(queues(), QueueReader::ALL);
+        }
+        return 0;
+    }
+    size_t next(std::span<Frame> out) {
+        if (!_all)
+            return _ch[_first].next(out);
+        size_t n = 0;
+        while (n < out.size()) {
+            Frame& f = out[n];
+            QueueReader::Result r = _all->next(f.word, 92>>2, &f.fifo_tsc);
+            if (r == QueueReader::Empty)
+                break;
+            if (r == QueueReader::Ok) {
+                f.seq = _all->position()-1;
+                n++;
+            }
+        }
+        //  Drained; take the channels' wake-ups, or poll() would not sleep
+        if (!n)
+            for(unsigned ch=0; ch<MOD_SHARED; ch++)
+                if (_mask & (1<<ch))
+                    _ch[ch].await();
+        return n;
+    }
+    long long lost() const { return _all ? _all->lost() : _ch[_first].lost(); }
+    //  Summed over the channels; an event flagged in several counts in each
+    long long drops() const {
+        long long d = 0;
+        for(unsigned ch=0; ch<MOD_SHARED; ch++)
+            if (_mask & (1<<ch))
+                d += _ch[ch].drops();
+        return d;
+    }
+    unsigned fds(pollfd* pfd) const {
+        unsigned n = 0;
+        for(unsigned ch=0; ch<MOD_SHARED; ch++)
+            if (_mask & (1<<ch)) {
+                pfd[n].fd     = _ch[ch].fd();
+                pfd[n].events = POLLIN;
+                n++;
+            }
+        return n;
+    }
+    TprQueues& queues() const { return _ch[_first].queues(); }
+private:
+    uint32_t     _mask;
+    unsigned     _first;
+    Reader       _ch[MOD_SHARED];
+    QueueReader* _all;
+};
+
+//
+//  Copies frames into blocks, handing each full one to the Writer
+//
+
+class Recorder {
+public:
+    Recorder(Writer& w, std::vector<Block>& blocks, size_t blocksize) :
+        _w(w), _blocksize(blocksize), _b(&blocks[0]), _nstalls(0) {
+        for(size_t i=1; i<blocks.size(); i++)
+            _spare.push_back(&blocks[i]);
+        reset(_b);
+    }
+public:
+    void add(const Frame& f, uint32_t lost) {
+        unsigned size = recSize(f);
+        if (!recFits(_b->used, size, _blocksize))
+            flush();
+
+        recWrite(_b->data + _b->used, f, lost);
+        _b->used += size;
+
+        RecBlock& x = _b->index;
+        uint64_t pid = f.isEvent() ? f.event().pulseId() : f.bsaEvent().pulseId();
+        if (f.isEvent()) {
+            if (!x.nevents)
+                x.firstPulseId = pid;
+            x.lastPulseId = pid;
+            x.nevents++;
+        }
+        else {
+            if (!x.nevents) {
+                if (!x.nbsa)
+                    x.firstPulseId = pid;
+                x.lastPulseId = pid;
+            }
+            x.nbsa++;
+        }
+        x.lost += lost;
+    }
+    void flush() {
+        if (!_b->used)
+            return;
+        _w.submit(_b);
+        if (_spare.empty()) {
+            if (!(_b = _w.reclaim())) {
+                //  The disk is behind; the queue window absorbs us meanwhile
+                _nstalls++;
+                _b = _w.wait();
+            }
+        }
+        else {
+            _b = _spare.back();
+            _spare.pop_back();
+        }
+        reset(_b);
+    }
+    unsigned stalls() const { return _nstalls; }
+private:
+    static void reset(Block* b) {
+        b->used = 0;
+        memset(&b->index, 0, sizeof(b->index));
+    }
+private:
+    Writer&             _w;
+    size_t              _blocksize;
+    Block*              _b;
+    std::vector<Block*> _spare;
+    unsigned            _nstalls;
+};
+
+int main(int argc, char** argv) {
+
+    extern char* optarg;
+    char     tprid='a';
+    uint32_t chmask  = 1;
+    bool     lChan   = false;
+    bool     lBsa = false;
+    size_t   blocksize = 4<<20;
+    unsigned nblocks = 16;
+    uint64_t filesize = 1ULL<<30;
+    double   duration = 0;
+    bool     lPoll = false;
+
+    int c;
+    bool lUsage = false;
+
+    while ( (c=getopt( argc, argv, "d:c:Bb:n:S:t:Ph?")) != EOF ) {
+        switch(c) {
+        case 'd':
+            tprid  = optarg[0];
+            if (strlen(optarg) != 1) {
+                printf("%s: option `-d' parsing error\n", argv[0]);
+                lUsage = true;
+            }
+            break;
+        case 'c': {
+            int channel = strtol(optarg,NULL,0);
+            if (!lChan)
+                chmask = 0;
+            lChan = true;
+            if (channel >= MOD_SHARED)
+                lUsage = true;
+            else if (channel >= 0)
+                chmask |= 1<<channel;
+            break; }
+        case 'B':
+            lBsa = true;
+            break;
+        case 'b':
+            blocksize = strtoul(optarg,NULL,0)<<10;
+            if (!blocksize || (blocksize % TPR_REC_ALIGN) || blocksize > (64<<20))
+                lUsage = true;
+            break;
+        case 'n':
+            nblocks = strtoul(optarg,NULL,0);
+            if (nblocks < 2)
+                lUsage = true;
+            break;
+        case 'S':
+            filesize = strtoull(optarg,NULL,0)<<20;
+            break;
+        case 't':
+            duration = strtod(optarg,NULL);
+            break;
+        case 'P':
+            lPoll = true;
+            break;
+        case 'h':
+            usage(argv[0]);
+            exit(0);
+        case '?':
+        default:
+            lUsage = true;
+            break;
+        }
+    }
+
+    if (optind != argc-1) {
+        printf("%s: expected one output prefix\n",argv[0]);
+        lUsage = true;
+    }
+    if (!chmask && !lBsa)
+        lUsage = true;
+    if (filesize < TPR_REC_ALIGN + blocksize)
+        lUsage = true;
+
+    if (lUsage) {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    //  Neither queue may starve the other, so never wait in a Reader;
+    //  poll() both instead, unless busy-polling
+    Events ev;
+    Reader bsa;
+    if (chmask && ev.open(tprid, chmask) < 0)
+        return -1;
+    if (lBsa && bsa.open(tprid, Reader::BSA, Reader::NonBlock, !chmask) < 0) {
+        perror("Could not open BSA");
+        return -1;
+    }
+    const TprQueues& q = chmask ? ev.queues() : bsa.queues();
+
+    RecFile hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic     = TPR_REC_MAGIC;
+    hdr.version   = TPR_REC_VERSION;
+    hdr.hdrsize   = sizeof(hdr);
+    hdr.blocksize = blocksize;
+    hdr.channel   = chmask ? __builtin_ctz(chmask) : MOD_SHARED;
+    hdr.chmask    = chmask;
+    hdr.bsa       = lBsa;
+    hdr.card      = tprid;
+
+    std::vector<Block> blocks(nblocks);
+    for(Block& b : blocks) {
+        void* p;
+        if (posix_memalign(&p, TPR_REC_ALIGN, blocksize)) {
+            perror("Block allocation");
+            return -1;
+        }
+        b.data = reinterpret_cast<char*>(p);
+    }
+
+    ::signal(SIGINT , sigHandler);
+    ::signal(SIGTERM, sigHandler);
+
+    long long nevents = 0, nbsa = 0, lost = 0;
+    long long drops0 = chmask ? ev .drops() : 0;
+    long long bdrops0= lBsa         ? bsa.drops() : 0;
+    {
+        Writer   w(argv[optind], hdr, &q, filesize);
+        Recorder rec(w, blocks, blocksize);
+
+        Frame    frames[256];
+        pollfd   pfd[MOD_SHARED+1];
+        unsigned npfd = chmask ? ev.fds(pfd) : 0;
+        if (lBsa) {
+            pfd[npfd].fd     = bsa.fd();
+            pfd[npfd].events = POLLIN;
+            npfd++;
+        }
+
+        double t0 = now(), tr = t0;
+        long long nevr = 0, nbsar = 0, lostr = 0;
+        uint64_t  bytesr = 0;
+
+        printf("%10s %10s %10s %10s %10s %8s\n",
+               "events/s","bsa/s","MB/s","lost","hw drops","stalls");
+
+        //  Next position of each queue; a record's loss is the gap before it
+        long long evnext = -1, bsanext = -1;
+        auto gap = [](long long& next, const Frame& f) {
+            uint32_t l = next < 0 ? 0 : uint32_t(f.seq - next);
+            next = f.seq + 1;
+            return l;
+        };
+
+        while (!stop) {
+            size_t n = 0, m = 0;
+            if (chmask) {
+                long long l = ev.lost();
+                n = ev.next(frames);
+                for(size_t i=0; i<n; i++)
+                    rec.add(frames[i], gap(evnext, frames[i]));
+                lost    += ev.lost()-l;
+                nevents += n;
+            }
+            if (lBsa) {
+                long long l = bsa.lost();
+                m = bsa.next(frames);
+                for(size_t i=0; i<m; i++)
+                    rec.add(frames[i], gap(bsanext, frames[i]));
+                lost += bsa.lost()-l;
+                nbsa += m;
+            }
+            if (!n && !m && !lPoll)
+                poll(pfd, npfd, 100);
+
+            double t = now();
+            if (t - tr >= 1.) {
+                long long drops = (chmask ? ev.drops()-drops0 : 0) +
+                    (lBsa ? bsa.drops()-bdrops0 : 0);
+                printf("%10.0f %10.0f %10.1f %10lld %10lld %8u\n",
+                       double(nevents-nevr)/(t-tr), double(nbsa-nbsar)/(t-tr),
+                       double(w.bytes()-bytesr)*1.e-6/(t-tr),
+                       lost-lostr, drops, rec.stalls());
+                fflush(stdout);
+                tr = t; nevr = nevents; nbsar = nbsa; lostr = lost; bytesr = w.bytes();
+            }
+            if (duration > 0 && t - t0 >= duration)
+                break;
+        }
+        rec.flush();
+        w.finish();
+
+        double dt = now()-t0;
+        printf("%lld events, %lld BSA messages in %.1f s\n", nevents, nbsa, dt);
+        printf("  written       : %.1f MB in %u files, %.1f MB/s%s\n",
+               double(w.bytes())*1.e-6, w.files(), double(w.bytes())*1.e-6/dt,
+               w.direct() ? "" : " (buffered)");
+        if (w.errors())
+            printf("  write errors  : %u blocks not written\n", w.errors());
+        printf("  lost          : %lld (overwritten in the queue window)\n", lost);
+        printf("  hw drops      : %lld\n", (chmask ? ev.drops()-drops0 : 0) +
+               (lBsa ? bsa.drops()-bdrops0 : 0));
+        printf("  writer stalls : %u\n", rec.stalls());
+    }
+
+    for(Block& b : blocks)
+        free(b.data);
+    return 0;
+}
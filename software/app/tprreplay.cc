@@ -0,0 +1,645 @@
+//
+//  Replay a recording into a queue window in shared memory, laid out and
+//  published exactly as the driver does its own (tprsh.hh): the events of
+//  each channel in its mask go to that channel's ring and advance its
+//  allwp[], BSA messages go to the BSA ring and the EDEF rings, and drops
+//  flagged in the messages are counted.  Consumers map /dev/shm/<name>
+//  instead of the device (Reader::open(path, ...)) and run unmodified,
+//  with no card present.
+//
+//  The input is a tprrecord recording (<prefix>-<n>.tpr files, in order)
+//  or a tprpack stream.  Frames are released when their timeStamp falls
+//  due, at the recorded rate times -s, or as fast as possible (-s 0).
+//  fifo_tsc is stamped as frames are published, as the driver does.
+//
+//  A recording of one channel holds only the events with that channel in
+//  their mask, so the other channels' rings get just those; record
+//  several channels (tprrecord -c, repeated) to fill theirs too.  Entries the
+//  recorder lost are not reproduced; the rings carry on without a gap.
+//
+#include <stdio.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include <atomic>
+#include <vector>
+
+#include "tprreader.hh"
+#include "tprrec.hh"
+#include "tprpack.hh"
+
+using namespace Tpr;
+
+extern int optind;
+
+static void usage(const char* p) {
+    printf("Usage: %s [options] <file>...\n",p);
+    printf("          -o <name>    : shared memory to publish in (default tprreplay)\n");
+    printf("          -L <layout>  : index or channel (default index)\n");
+    printf("          -s <speed>   : multiple of the recorded rate, 0 for as fast as possible\n");
+    printf("          -l <n>       : play the files n times, 0 for ever (default 1)\n");
+    printf("          -w <sec>     : wait this long for consumers before playing\n");
+    printf("          -a <depth>   : events kept in allq (or each channel's ring)\n");
+    printf("          -b <depth>   : BSA messages kept\n");
+    printf("          -e <depth>   : records kept for each EDEF\n");
+    printf("          -T           : check the round trip of recordings through a window, and exit\n");
+    printf("  <file> is a tprrecord .tpr file or a tprpack stream.\n");
+    printf("  Consumers open /dev/shm/<name>; remove it with rm when done.\n");
+}
+
+static volatile sig_atomic_t stop = 0;
+
+static void sigHandler(int) { stop = 1; }
+
+static uint64_t nsnow()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec)*1000000000ULL + ts.tv_nsec;
+}
+
+//  What the driver stamps fifo_tsc with
+static inline uint64_t cycles()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return nsnow();
+#endif
+}
+
+static inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+//  The driver's smp_store_release
+static inline void qstore(volatile long long& v, long long x)
+{
+    std::atomic_ref<long long>(const_cast<long long&>(v)).store(x, std::memory_order_release);
+}
+
+static inline void wmb()
+{
+    std::atomic_thread_fence(std::memory_order_release);
+}
+
+static inline uint64_t depth(unsigned d)
+{
+    if (d < 16)
+        d = 16;
+    if (d > (1<<22))
+        d = 1<<22;
+    uint64_t p = 16;
+    while (p < d)
+        p <<= 1;
+    return p;
+}
+
+//
+//  The frames of the input files in order
+//
+class Source {
+public:
+    Source(char** files, unsigned nfiles) :
+        _files (files),
+        _nfiles(nfiles),
+        _ifile (0),
+        _f     (0),
+        _rec   (0),
+        _pack  (0),
+        _mult  (0) {}
+    ~Source() { close(); }
+public:
+    //  false after the last frame of the last file
+    bool next(Frame& f) {
+        while (1) {
+            if (!_f && (_ifile == _nfiles || !open(_files[_ifile++])))
+                return false;
+            if (_pack ? _pack->next(std::span<Frame>(&f, 1)) == 1 : _rec->next(f))
+                return true;
+            close();
+        }
+    }
+    //  Back to the first file
+    void rewind() { close(); _ifile = 0; }
+    //  The clock rate the recording was made with, 0 if unknown
+    uint64_t mult() const { return _mult; }
+private:
+    bool open(const char* fname) {
+        _f = fopen(fname, "r");
+        if (!_f) {
+            perror(fname);
+            return false;
+        }
+        setvbuf(_f, 0, _IOFBF, 1<<20);
+        _rec = new RecReader(_f);
+        if (_rec->valid()) {
+            if (!_mult)
+                _mult = _rec->header().mult;
+            return true;
+        }
+        delete _rec;
+        _rec = 0;
+        ::rewind(_f);
+        _pack = new PackReader(_f);
+        if (_pack->valid())
+            return true;
+        printf("%s is neither a tprrecord file nor a tprpack stream\n", fname);
+        close();
+        return false;
+    }
+    void close() {
+        delete _rec;
+        _rec  = 0;
+        delete _pack;
+        _pack = 0;
+        if (_f)
+            fclose(_f);
+        _f = 0;
+    }
+private:
+    char**      _files;
+    unsigned    _nfiles;
+    unsigned    _ifile;
+    FILE*       _f;
+    RecReader*  _rec;
+    PackReader* _pack;
+    uint64_t    _mult;
+};
+
+//
+//  A queue window in shared memory, written as tpr_decode_buffer and
+//  tpr_edef_append write the driver's
+//
+class Window {
+public:
+    Window() : _q(0) {}
+    ~Window() { if (_q) munmap(_q, _q->size); }
+public:
+    bool create(const char* name, QLayout layout,
+                unsigned allq, unsigned bsaq, unsigned edefq) {
+        size_t pgsz = sysconf(_SC_PAGESIZE);
+        auto align = [pgsz](uint64_t v) { return (v + pgsz-1) & ~uint64_t(pgsz-1); };
+
+        TprQueues h;
+        memset(&h, 0, sizeof(h));
+        h.version    = TPR_QVERSION;
+        h.hdrsize    = sizeof(h);
+        h.layout     = layout;
+        h.nchan      = MOD_SHARED;
+        h.entrysize  = sizeof(TprEntry);
+        h.allqdepth  = depth(allq);
+        h.bsaqdepth  = depth(bsaq);
+        h.chnqdepth  = depth(allq);
+        h.edefqdepth = depth(edefq);
+
+        uint64_t off = align(sizeof(h));
+        h.bsaqoff = off;
+        off += align(h.bsaqdepth * sizeof(TprEntry));
+        if (layout == QIndex) {
+            h.allqoff  = off;
+            off += align(h.allqdepth * sizeof(TprEntry));
+            h.allrpoff = off;
+            off += align(uint64_t(MOD_SHARED) * h.allqdepth * sizeof(long long));
+        }
+        else {
+            h.chnqoff  = off;
+            off += align(uint64_t(MOD_SHARED) * h.chnqdepth * sizeof(TprEntry));
+        }
+        h.edefqoff = off;
+        off += align(uint64_t(TPR_EDEFS) * h.edefqdepth * sizeof(TprEdefRec));
+        h.size = off;
+
+        char shm[64];
+        snprintf(shm, sizeof(shm), "/%s", name);
+        int fd = shm_open(shm, O_CREAT|O_RDWR, 0644);
+        if (fd < 0) {
+            perror("shm_open");
+            return false;
+        }
+        //  Start from zeros, whatever was there before
+        if (ftruncate(fd, 0) < 0 || ftruncate(fd, h.size) < 0) {
+            perror("ftruncate");
+            ::close(fd);
+            return false;
+        }
+        void* p = mmap(0, h.size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (p == MAP_FAILED) {
+            perror("mmap");
+            return false;
+        }
+        _q = reinterpret_cast<TprQueues*>(p);
+        memcpy(static_cast<void*>(_q), &h, sizeof(h));
+        //  Valid only once the rest is in place
+        wmb();
+        std::atomic_ref<uint32_t>(_q->magic).store(TPR_QMAGIC, std::memory_order_release);
+        return true;
+    }
+
+    //  Map tsc to the timing time ts (ns) at mult ns per cycle (32.32)
+    void clock(uint64_t tsc, uint64_t ts, uint64_t mult) {
+        TprClock& c = _q->clock;
+        c.seq = c.seq+1;
+        wmb();
+        c.tsc0  = tsc;
+        c.ts0   = ts;
+        c.mult  = mult;
+        c.valid = 1;
+        c.updates = c.updates+1;
+        wmb();
+        c.seq = c.seq+1;
+    }
+
+    void publish(const Frame& f, uint64_t tsc) {
+        TprQueues& q = *_q;
+        bool drop = f.word[0] & (0x808<<20);
+        if (drop)
+            q.fifofull = 1;
+
+        if (!f.isEvent()) {
+            wmb();
+            TprEntry& e = q.bsaq(q.bsawp);
+            copy(e, f, 44>>2);
+            e.seq      = q.bsawp;
+            e.fifo_tsc = tsc;
+            if (drop)
+                q.bsadrops = q.bsadrops+1;
+            qstore(q.bsawp, q.bsawp+1);
+            if (f.isBsaControl()) {
+                BsaControlMsg m = f.bsaControl();
+                edef(m.pulseId(), m.timeStamp(),
+                     m.init(), EdefInit, m.minor(), EdefMinor, m.major(), EdefMajor);
+            }
+            else if (f.isBsaEvent()) {
+                BsaEventMsg m = f.bsaEvent();
+                edef(m.pulseId(), m.timeStamp(),
+                     m.active(), EdefActive, m.avgDone(), EdefAvgDone, m.update(), EdefUpdate);
+            }
+            return;
+        }
+
+        uint32_t mch = f.word[0] & ((1<<MOD_SHARED)-1);
+        if (drop)
+            for(unsigned ich=0; ich<MOD_SHARED; ich++)
+                if (mch & (1<<ich))
+                    q.drops[ich] = q.drops[ich]+1;
+        wmb();
+        if (q.layout == QChannel) {
+            for(unsigned ich=0; mch; ich++) {
+                if (!(mch & (1<<ich)))
+                    continue;
+                mch &= ~(1<<ich);
+                TprEntry& e = q.chnq(ich, q.allwp[ich]);
+                copy(e, f, 92>>2);
+                e.seq      = q.allwp[ich];
+                e.fifo_tsc = tsc;
+                qstore(q.allwp[ich], q.allwp[ich]+1);
+            }
+        }
+        else {
+            TprEntry& e = q.allq(q.gwp);
+            copy(e, f, 92>>2);
+            e.seq      = q.gwp;
+            e.fifo_tsc = tsc;
+            for(unsigned ich=0; mch; ich++) {
+                if (!(mch & (1<<ich)))
+                    continue;
+                mch &= ~(1<<ich);
+                q.allrp(ich, q.allwp[ich]) = q.gwp;
+                qstore(q.allwp[ich], q.allwp[ich]+1);
+            }
+        }
+        qstore(q.gwp, q.gwp+1);
+    }
+private:
+    static void copy(TprEntry& e, const Frame& f, unsigned nwords) {
+        for(unsigned i=0; i<nwords; i++)
+            e.word[i] = f.word[i];
+    }
+    void edef(uint64_t pulseId, uint64_t timeStamp,
+              uint64_t m0, uint32_t s0, uint64_t m1, uint32_t s1, uint64_t m2, uint32_t s2) {
+        TprQueues& q = *_q;
+        uint64_t m = m0 | m1 | m2;
+        if (!m)
+            return;
+        wmb();
+        for(unsigned e=0; m; e++) {
+            if (!(m & (1ULL<<e)))
+                continue;
+            m &= ~(1ULL<<e);
+            TprEdefRec& r = q.edefq(e, q.edefwp[e]);
+            r.pulseId   = pulseId;
+            r.timeStamp = timeStamp;
+            r.status    = (m0 & (1ULL<<e) ? s0 : 0) |
+                          (m1 & (1ULL<<e) ? s1 : 0) |
+                          (m2 & (1ULL<<e) ? s2 : 0);
+            r.seq       = q.edefwp[e];
+            qstore(q.edefwp[e], q.edefwp[e]+1);
+        }
+    }
+private:
+    TprQueues* _q;
+};
+
+//  The timeStamp of a message in ns
+static uint64_t timeOf(const Frame& f)
+{
+    uint64_t ts = f.isEvent()      ? f.event().timeStamp() :
+                  f.isBsaControl() ? f.bsaControl().timeStamp() :
+                                     f.bsaEvent().timeStamp();
+    return (ts>>32)*1000000000ULL + (ts&0xffffffff);
+}
+
+//
+//  Write a recording of mixed events and BSA messages in blocks of
+//  blocksize, whose ends fall short of a record by less than a RecHeader,
+//  replay it and read it back with Readers as a consumer would.
+//
+static bool check(size_t blocksize, QLayout layout)
+{
+    const unsigned n = 5000;
+    std::vector<Frame> ev, bsa;
+    for(unsigned i=0; i<n; i++) {
+        Frame f;
+        memset(&f, 0, sizeof(f));
+        uint64_t pid = 0x1234500000ULL + i;
+        uint64_t ts  = (uint64_t(1000+i/1000)<<32) | (i%1000)*1000000;
+        if (i%7 == 3) {
+            f.word[0] = Frame::BsaEvent<<16;
+            f.word[1] = uint32_t(pid);
+            f.word[2] = uint32_t(pid>>32);
+            f.word[7] = uint32_t(ts);
+            f.word[8] = uint32_t(ts>>32);
+            f.word[10] = i;
+            f.seq = bsa.size();
+            bsa.push_back(f);
+        }
+        else {
+            f.word[0] = (Frame::Event<<16) | 1;
+            f.word[1] = (92-8)>>2;
+            f.word[2] = uint32_t(pid);
+            f.word[3] = uint32_t(pid>>32);
+            f.word[4] = uint32_t(ts);
+            f.word[5] = uint32_t(ts>>32);
+            for(unsigned w=6; w<92>>2; w++)
+                f.word[w] = i*31 + w;
+            f.seq = ev.size();
+            ev.push_back(f);
+        }
+    }
+
+    char fname[] = "/tmp/tprreplay-check-XXXXXX";
+    int fd = mkstemp(fname);
+    if (fd < 0) {
+        perror("mkstemp");
+        return false;
+    }
+    std::vector<char> block(blocksize);
+    RecFile& h = *reinterpret_cast<RecFile*>(block.data());
+    h.magic     = TPR_REC_MAGIC;
+    h.version   = TPR_REC_VERSION;
+    h.hdrsize   = TPR_REC_ALIGN;
+    h.blocksize = blocksize;
+    h.channel   = 0;
+    h.bsa       = 1;
+    bool ok = write(fd, block.data(), TPR_REC_ALIGN) == TPR_REC_ALIGN;
+
+    //  In the order the recorder would have met them
+    size_t   used = 0;
+    unsigned iev = 0, ibsa = 0, nblocks = 0, nshort = 0;
+    for(unsigned i=0; i<n && ok; i++) {
+        const Frame& f = i%7 == 3 ? bsa[ibsa++] : ev[iev++];
+        unsigned size = recSize(f);
+        if (!recFits(used, size, blocksize)) {
+            if (used + size < blocksize)
+                nshort++;
+            size_t bytes = recPad(block.data(), used);
+            ok = write(fd, block.data(), bytes) == ssize_t(bytes);
+            nblocks++;
+            used = 0;
+        }
+        recWrite(block.data() + used, f, 0);
+        used += size;
+    }
+    size_t bytes = recPad(block.data(), used);
+    ok = ok && write(fd, block.data(), bytes) == ssize_t(bytes);
+    nblocks++;
+    ::close(fd);
+
+    char name[64], path[80];
+    snprintf(name, sizeof(name), "tprreplay-check-%d", getpid());
+    snprintf(path, sizeof(path), "/dev/shm/%s", name);
+    unsigned nev = 0, nbsa = 0, nbad = 0;
+    {
+        Window win;
+        Reader rev, rbsa;
+        char* files[] = { fname };
+        Source src(files, 1);
+        ok = ok && win.create(name, layout, n, n, 16) &&
+             rev .open(path, 0, Reader::NonBlock) == 0 &&
+             rbsa.open(path, Reader::BSA, Reader::NonBlock) == 0;
+        Frame f;
+        while (ok && src.next(f))
+            win.publish(f, cycles());
+
+        while (ok && rev.next(f)) {
+            if (nev >= ev.size() || f.seq != ev[nev].seq ||
+                memcmp(f.word, ev[nev].word, 92))
+                nbad++;
+            nev++;
+        }
+        while (ok && rbsa.next(f)) {
+            if (nbsa >= bsa.size() || f.seq != bsa[nbsa].seq ||
+                memcmp(f.word, bsa[nbsa].word, 44))
+                nbad++;
+            nbsa++;
+        }
+        ok = ok && !nbad && nev == ev.size() && nbsa == bsa.size() &&
+             !rev.lost() && !rbsa.lost();
+    }
+    shm_unlink(name);
+    unlink(fname);
+
+    printf("block %3zu KB %-7s: %u/%zu events %u/%zu BSA in %u blocks, %u flushed early to leave room for a RecPad: %s\n",
+           blocksize>>10, layout == QIndex ? "index" : "channel",
+           nev, ev.size(), nbsa, bsa.size(), nblocks, nshort, ok ? "ok" : "FAILED");
+    return ok;
+}
+
+int main(int argc, char** argv) {
+
+    extern char* optarg;
+    const char* name = "tprreplay";
+    QLayout  layout  = QIndex;
+    double   speed   = 1;
+    unsigned nloops  = 1;
+    double   delay   = 0;
+    unsigned allq    = 32*1024;
+    unsigned bsaq    = 1024;
+    unsigned edefq   = 256;
+
+    int c;
+    bool lUsage = false;
+
+    while ( (c=getopt( argc, argv, "o:L:s:l:w:a:b:e:Th?")) != EOF ) {
+        switch(c) {
+        case 'o':
+            name = optarg;
+            if (strchr(name, '/') || strlen(name) > 60)
+                lUsage = true;
+            break;
+        case 'L':
+            if (!strcmp(optarg, "index"))
+                layout = QIndex;
+            else if (!strcmp(optarg, "channel"))
+                layout = QChannel;
+            else
+                lUsage = true;
+            break;
+        case 's':
+            speed = strtod(optarg,NULL);
+            if (speed < 0)
+                lUsage = true;
+            break;
+        case 'l':
+            nloops = strtoul(optarg,NULL,0);
+            break;
+        case 'w':
+            delay = strtod(optarg,NULL);
+            break;
+        case 'a':
+            allq = strtoul(optarg,NULL,0);
+            break;
+        case 'b':
+            bsaq = strtoul(optarg,NULL,0);
+            break;
+        case 'e':
+            edefq = strtoul(optarg,NULL,0);
+            break;
+        case 'T': {
+            bool ok = true;
+            for(size_t b : { 4, 8, 12, 64 })
+                for(QLayout l : { QIndex, QChannel })
+                    ok = check(b<<10, l) && ok;
+            exit(ok ? 0 : 1); }
+        case 'h':
+            usage(argv[0]);
+            exit(0);
+        case '?':
+        default:
+            lUsage = true;
+            break;
+        }
+    }
+
+    if (optind == argc) {
+        printf("%s: expected a recording\n",argv[0]);
+        lUsage = true;
+    }
+
+    if (lUsage) {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    Source src(argv+optind, argc-optind);
+    Window win;
+    if (!win.create(name, layout, allq, bsaq, edefq))
+        return -1;
+    printf("Publishing in /dev/shm/%s\n", name);
+
+    ::signal(SIGINT , sigHandler);
+    ::signal(SIGTERM, sigHandler);
+
+    if (delay > 0)
+        usleep(useconds_t(delay*1.e6));
+
+    printf("%10s %10s %10s %10s\n",
+           "events/s","bsa/s","speed","late(us)");
+
+    long long nevents = 0, nbsa = 0;
+    uint64_t  t0 = nsnow(), tr = t0;
+    long long nevr = 0, nbsar = 0;
+    double    vt = 0, vtr = 0;      // recording ns played
+    uint64_t  late = 0;             // worst in the second
+
+    for(unsigned iloop=0; !stop && (!nloops || iloop<nloops); iloop++) {
+        src.rewind();
+        uint64_t last  = 0;
+        bool     first = true;
+        Frame    f;
+        while (!stop && src.next(f)) {
+            if (f.tag() > Frame::BsaEvent)
+                continue;
+            //  Follow the recording's clock through small disorder between
+            //  the queues; a jump of more than a second is a gap, not time
+            uint64_t t = timeOf(f);
+            if (first) {
+                first = false;
+                last  = t;
+                if (iloop == 0 && src.mult() && speed == 1)
+                    win.clock(cycles(), t, src.mult());
+            }
+            else if (t > last) {
+                if (t - last < 1000000000ULL)
+                    vt += double(t - last);
+                last = t;
+            }
+            else if (last - t > 1000000000ULL)
+                last = t;
+
+            uint64_t tn = nsnow();
+            if (speed > 0) {
+                uint64_t due = t0 + uint64_t(vt/speed);
+                if (due > tn + 50000) {
+                    timespec ts;
+                    ts.tv_sec  = (due - 20000)/1000000000ULL;
+                    ts.tv_nsec = (due - 20000)%1000000000ULL;
+                    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, 0);
+                }
+                while ((tn = nsnow()) < due)
+                    cpu_relax();
+                if (tn - due > late)
+                    late = tn - due;
+            }
+
+            win.publish(f, cycles());
+            if (f.isEvent())
+                nevents++;
+            else
+                nbsa++;
+
+            if (tn - tr >= 1000000000ULL) {
+                double dt = double(tn - tr)*1.e-9;
+                printf("%10.0f %10.0f %10.2f %10.1f\n",
+                       double(nevents-nevr)/dt, double(nbsa-nbsar)/dt,
+                       (vt-vtr)*1.e-9/dt, double(late)*1.e-3);
+                fflush(stdout);
+                tr = tn; nevr = nevents; nbsar = nbsa; vtr = vt; late = 0;
+            }
+        }
+        if (!nevents && !nbsa)
+            break;
+    }
+
+    double dt = double(nsnow()-t0)*1.e-9;
+    printf("%lld events, %lld BSA messages in %.1f s (%.1f s recorded)\n",
+           nevents, nbsa, dt, vt*1.e-9);
+    return 0;
+}
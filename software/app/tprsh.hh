@@ -2,36 +2,386 @@
 #define TPRSH_HH
 
 #define MOD_SHARED 14
-#define MAX_TPR_ALLQ (32*1024)
-#define MAX_TPR_BSAQ  1024
 #define MSG_SIZE      32
 
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
 namespace Tpr {
-  // DMA Buffer Size, Bytes (could be as small as 512B)
-#define BUF_SIZE 4096
-#define NUMBER_OF_RX_BUFFERS 256
 
+  //
+  //  seq is the write pointer the entry was published at (gwp in allq,
+  //  allwp[] in chnq, bsawp in bsaq): a reader at rp that finds seq != rp
+  //  has been lapped.
+  //
   class TprEntry {
   public:
-    volatile uint32_t word[MSG_SIZE];
+    volatile uint32_t  word[MSG_SIZE-2];
+    volatile long long seq;
+    volatile uint64_t  fifo_tsc;
+  };
+
+  enum QLayout { QIndex=0, QChannel=1, QZeroCopy=2 };
+
+  //
+  //  Zero-copy descriptors (layout==QZeroCopy).  allrp() indexes desc(),
+  //  which locates each event in the DMA buffers mapped read-only at
+  //  TPR_ZC_MMAP_OFFSET (see mapBuffers).  Report progress with
+  //  TPR_IOC_SETRP so the driver holds the buffers until you are done.
+  //
+  class TprDesc {
+  public:
+    volatile uint32_t buffer;
+    volatile uint32_t offset;
     volatile uint64_t fifo_tsc;
   };
 
-  class TprQIndex {
+  class TprZcQueues {
+  public:
+    volatile long long freewp;   // descriptors below this may be stale
+    long long          reserved[7];
+    //  TprDesc desc[allqdepth] follows
+  };
+
+#define TPR_ZC_MMAP_OFFSET  0x40000000UL
+
+  //
+  //  BSA messages folded into one ring per EDEF.  A record names a pulse
+  //  on which the EDEF's bit was set in any of the message's masks.
+  //
+#define TPR_EDEFS  64
+
+  enum { EdefInit   =1<<0,   // control: acquisition (re)started
+         EdefMinor  =1<<1,   //   minor severity
+         EdefMajor  =1<<2,   //   major severity
+         EdefActive =1<<3,   // event: pulse is acquired
+         EdefAvgDone=1<<4,   //   average complete
+         EdefUpdate =1<<5 }; //   update the result
+
+  class TprEdefRec {
+  public:
+    volatile uint64_t  pulseId;
+    volatile uint64_t  timeStamp;
+    volatile uint32_t  status;   // Edefxxx
+    uint32_t           reserved;
+    volatile long long seq;      // edefwp[] it was published at
+  };
+
+#define TPR_QMAGIC    0x51525054   // "TPRQ"
+#define TPR_QVERSION  4
+
+  //
+  //  Host TSC to timing-system time, refitted by the driver.  Read it with
+  //  ClockModel (tprqueue.hh) rather than directly: seq is odd while the
+  //  driver changes the fields.
+  //
+  class TprClock {
   public:
-    volatile long long idx[MAX_TPR_ALLQ];
+    volatile uint32_t  seq;
+    volatile uint32_t  valid;
+    volatile uint64_t  tsc0;
+    volatile uint64_t  ts0;      // ns, timing epoch
+    volatile uint64_t  mult;     // ns per cycle, 32.32
+    volatile uint64_t  latmean;  // ns past the fastest delivery
+    volatile uint64_t  latmax;
+    volatile uint64_t  nsamples;
+    volatile uint64_t  updates;
   };
 
+  //
+  //  Header at the start of the queue window.  The driver chooses the ring
+  //  depths at load time; the accessors below find the rings from the
+  //  offsets here, so map the whole window (mapQueues) before using them.
+  //
   class TprQueues {
   public:
-    TprEntry  allq  [MAX_TPR_ALLQ];
-    TprEntry  bsaq  [MAX_TPR_BSAQ];
-    TprQIndex allrp [MOD_SHARED]; // indices into allq
-    volatile long long allwp [MOD_SHARED]; // write pointer into allrp
+    uint32_t           magic;
+    uint32_t           version;
+    uint32_t           hdrsize;
+    volatile int       layout;   // QLayout
+    uint32_t           nchan;
+    uint32_t           entrysize;
+    uint32_t           allqdepth;
+    uint32_t           bsaqdepth;
+    uint32_t           chnqdepth;
+    uint32_t           nbuffers; // DMA buffers
+    uint32_t           bufsize;
+    uint32_t           reserved0;
+    uint64_t           bsaqoff;
+    uint64_t           allqoff;
+    uint64_t           allrpoff;
+    uint64_t           chnqoff;
+    uint64_t           zcqoff;
+    uint64_t           size;     // bytes in the window
+    volatile long long allwp [MOD_SHARED]; // write pointer into allrp (or chnq)
     volatile long long bsawp;
     volatile long long gwp;
-    volatile int       fifofull;
+    volatile int       fifofull; // a hardware drop was flagged
+    int                reserved1;
+    volatile long long drops [MOD_SHARED]; // messages flagged with a hardware drop
+    volatile long long bsadrops;
+    uint32_t           edefqdepth;
+    uint32_t           reserved2;
+    uint64_t           edefqoff;
+    volatile long long edefwp [TPR_EDEFS]; // write pointer into each edefq row
+    TprClock           clock;
+  public:
+    bool valid() const {
+      return magic==TPR_QMAGIC && version==TPR_QVERSION &&
+        nchan==MOD_SHARED && entrysize==sizeof(TprEntry);
+    }
+    //  Master queue of events (QIndex)
+    TprEntry& allq(long long gwp) {
+      return at<TprEntry>(allqoff)[gwp&(allqdepth-1)];
+    }
+    //  BSA messages
+    TprEntry& bsaq(long long rp) {
+      return at<TprEntry>(bsaqoff)[rp&(bsaqdepth-1)];
+    }
+    //  gwp of entry rp of a channel (QIndex, QZeroCopy)
+    volatile long long& allrp(unsigned ch, long long rp) {
+      return at<volatile long long>(allrpoff)[size_t(ch)*allqdepth + (rp&(allqdepth-1))];
+    }
+    //  Entry rp of a channel's own ring (QChannel)
+    TprEntry& chnq(unsigned ch, long long rp) {
+      return at<TprEntry>(chnqoff)[size_t(ch)*chnqdepth + (rp&(chnqdepth-1))];
+    }
+    //  Channel entries still in the rings
+    long long depth() const {
+      return layout==QChannel ? chnqdepth : allqdepth;
+    }
+    //  Record rp of an EDEF's ring
+    TprEdefRec& edefq(unsigned edef, long long rp) {
+      return at<TprEdefRec>(edefqoff)[size_t(edef)*edefqdepth + (rp&(edefqdepth-1))];
+    }
+    TprZcQueues& zcq() {
+      return *at<TprZcQueues>(zcqoff);
+    }
+    TprDesc& desc(long long gwp) {
+      return reinterpret_cast<TprDesc*>(&zcq()+1)[gwp&(allqdepth-1)];
+    }
+  private:
+    template<class T> T* at(uint64_t off) {
+      return reinterpret_cast<T*>(reinterpret_cast<char*>(this)+off);
+    }
+  };
+
+  //
+  //  Map the whole queue window of an open channel or BSA device.
+  //  0 if it cannot be mapped or the driver's header is not understood.
+  //
+  inline TprQueues* mapQueues(int fd) {
+    size_t pgsz = sysconf(_SC_PAGESIZE);
+    void* p = mmap(0, pgsz, PROT_READ, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED)
+      return 0;
+    TprQueues* q = reinterpret_cast<TprQueues*>(p);
+    size_t sz = q->valid() ? q->size : 0;
+    munmap(p, pgsz);
+    if (!sz)
+      return 0;
+    p = mmap(0, sz, PROT_READ, MAP_SHARED, fd, 0);
+    return p == MAP_FAILED ? 0 : reinterpret_cast<TprQueues*>(p);
+  }
+
+  inline void unmapQueues(TprQueues* q) {
+    size_t sz = q->size;
+    munmap(q, sz);
+  }
+
+  //  The DMA buffers behind the zero-copy descriptors, 0 on failure
+  inline const char* mapBuffers(int fd, const TprQueues& q) {
+    void* p = mmap(0, size_t(q.nbuffers)*q.bufsize, PROT_READ, MAP_SHARED, fd, TPR_ZC_MMAP_OFFSET);
+    return p == MAP_FAILED ? 0 : reinterpret_cast<const char*>(p);
+  }
+
+  inline void unmapBuffers(const char* bufs, const TprQueues& q) {
+    munmap(const_cast<char*>(bufs), size_t(q.nbuffers)*q.bufsize);
+  }
+
+  //
+  //  Driver counters and queue pointers (TPR_IOC_STATS)
+  //
+  class TprCounters {
+  public:
+    uint64_t irqEnable;
+    uint64_t irqDisable;
+    uint64_t irqCount;
+    uint64_t irqNoReq;
+    uint64_t dmaCount;
+    uint64_t dmaEvent;
+    uint64_t dmaErrors;
+    uint64_t dmaBsaChan;
+    uint64_t dmaBsaCtrl;
+    uint64_t bhCount;
+    uint64_t bhBuffers;
+    uint64_t bhBudget;
+    uint64_t bhTime;
+    uint64_t pollCount;
+    uint64_t pollBuffers;
+    uint64_t pollIdle;
+  };
+
+#define TPR_IOC_MAGIC      'T'
+#define TPR_STATS_VERSION  2
+
+  class TprStats {
+  public:
+    uint32_t    version;
+    uint32_t    size;
+    TprCounters counters;
+    long long   allwp [MOD_SHARED];
+    long long   bsawp;
+    long long   gwp;
+    // version 2
+    uint64_t    zcHeld;
+    uint64_t    zcForced;
+  };
+
+#define TPR_IOC_STATS   _IOR(TPR_IOC_MAGIC, 0x01, Tpr::TprStats)
+
+  //
+  //  Stage latency histograms (TPR_IOC_LATENCY).
+  //  Bin i counts latencies in [2^i, 2^(i+1)) ns.
+  //
+  enum LatencyStage { IrqToBh=0, BhToWake=1, WakeToRead=2 };
+#define TPR_LAT_STAGES   3
+#define TPR_LAT_BINS     32
+
+  class TprLatency {
+  public:
+    uint64_t bin[TPR_LAT_STAGES][TPR_LAT_BINS];
+  };
+
+#define TPR_IOC_LATENCY  _IOR(TPR_IOC_MAGIC, 0x02, Tpr::TprLatency)
+#define TPR_IOC_LATRESET _IO (TPR_IOC_MAGIC, 0x03)
+#define TPR_IOC_SETRP    _IOW(TPR_IOC_MAGIC, 0x04, long long)
+
+  //
+  //  Card placement (TPR_IOC_INFO)
+  //
+#define TPR_INFO_VERSION  2
+
+  enum IrqMode { IrqIntx=0, IrqMsi=1, IrqMsix=2, IrqNone=3 };
+
+  class TprInfo {
+  public:
+    uint32_t    version;
+    uint32_t    size;
+    int32_t     node;     // NUMA node of the card, -1 if unknown
+    int32_t     irq;
+    uint32_t    domain;
+    uint32_t    bus;
+    uint32_t    devfn;
+    uint32_t    layout;
+    uint64_t    qsize;
+    // version 2
+    uint32_t    irqmode;  // IrqMode
+    uint32_t    nvec;
+  };
+
+#define TPR_IOC_INFO     _IOR(TPR_IOC_MAGIC, 0x05, Tpr::TprInfo)
+
+  //
+  //  How far this client trails the driver, as of its last TPR_IOC_SETRP
+  //  (TPR_IOC_CLIENT).  poll() reports POLLPRI once lag reaches the
+  //  driver's lag_warn percent of depth.
+  //
+#define TPR_CLIENT_VERSION  1
+
+  class TprClient {
+  public:
+    uint32_t    version;
+    uint32_t    size;
+    int32_t     minor;    // channel, -1 for BSA
+    uint32_t    depth;    // entries the client's ring holds
+    long long   wp;
+    long long   rp;       // -1 if never reported
+    long long   lag;
+    long long   maxlag;
+    long long   lost;     // entries overwritten before rp reached them
+    long long   drops;    // hardware drops flagged on the channel
   };
+
+#define TPR_IOC_CLIENT   _IOR(TPR_IOC_MAGIC, 0x06, Tpr::TprClient)
+
+  //
+  //  Which events wake this client (TPR_IOC_SETFILTER).  An event passes if
+  //  its pulse ID is pidrem modulo pidmod and all (FilterAny: any) of
+  //  match[] hold; the client is woken on every decimate-th event that
+  //  passes.  match[].word indexes the 32-bit words of the event message,
+  //  so event codes and destinations are selected by the bits that carry
+  //  them.  An all-zero filter removes it.
+  //
+#define TPR_FILTER_VERSION  1
+#define TPR_FILTER_MATCHES  4
+
+  enum FilterFlags { FilterAny=1 };
+
+  class TprFilterMatch {
+  public:
+    uint32_t    word;
+    uint32_t    mask;
+    uint32_t    value;    // holds if (word & mask) == value
+  };
+
+  class TprFilter {
+  public:
+    uint32_t    version;
+    uint32_t    flags;    // FilterFlags
+    uint32_t    decimate;
+    uint32_t    pidmod;
+    uint32_t    pidrem;
+    uint32_t    nmatch;
+    TprFilterMatch match[TPR_FILTER_MATCHES];
+  };
+
+#define TPR_IOC_SETFILTER _IOW(TPR_IOC_MAGIC, 0x07, Tpr::TprFilter)
+
+  //
+  //  Batch this client's wake-ups (TPR_IOC_SETBATCH): once count events
+  //  have passed its filter, or usec after the first of them, whichever
+  //  comes first.
+  //
+#define TPR_BATCH_VERSION  1
+
+  class TprBatch {
+  public:
+    uint32_t    version;
+    uint32_t    count;
+    uint32_t    usec;
+    uint32_t    reserved;
+  };
+
+#define TPR_IOC_SETBATCH  _IOW(TPR_IOC_MAGIC, 0x08, Tpr::TprBatch)
+
+  //  What read() returns to a filtered client given room for it
+  class TprWake {
+  public:
+    uint32_t    pending;
+    uint32_t    reserved;
+    long long   rp;       // allwp position of the newest entry that passed
+  };
+
+  //
+  //  Copy nwords of event gwp out of the zero-copy buffers.  False if the
+  //  card may have overwritten the message while it was copied.
+  //
+  inline bool zcRead(TprQueues& q, const char* bufs,
+                     long long gwp, uint32_t* dst, unsigned nwords) {
+    const TprDesc& d = q.desc(gwp);
+    uint32_t b = d.buffer, o = d.offset;
+    if (b >= q.nbuffers || o + 4*nwords > q.bufsize)
+      return false;
+    const volatile uint32_t* src =
+      reinterpret_cast<const volatile uint32_t*>(bufs + size_t(b)*q.bufsize + o);
+    for(unsigned i=0; i<nwords; i++)
+      dst[i] = src[i];
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return gwp >= q.zcq().freewp && q.gwp - gwp < q.allqdepth;
+  }
 };
 
 #endif
@@ -0,0 +1,236 @@
+//
+//  Periodically print driver counter rates and queue write pointer rates
+//  from the TPR_IOC_STATS snapshot.  Uses the BSA device, which can be opened
+//  any number of times and does not enable any channel DMA.
+//
+#include <stdio.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include "tprsh.hh"
+
+using namespace Tpr;
+
+extern int optind;
+
+static void usage(const char* p) {
+    printf("Usage: %s [options]\n",p);
+    printf("          -d <dev>  : <tpr a/b>\n");
+    printf("          -p <sec>  : update period\n");
+    printf("          -n <num>  : number of updates (0=forever)\n");
+    printf("          -l        : show latency histograms instead of rates\n");
+    printf("          -r        : reset latency histograms\n");
+    printf("          -i        : show card placement and interrupt mode\n");
+}
+
+static double now()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return double(ts.tv_sec)+1.e-9*double(ts.tv_nsec);
+}
+
+//  Upper edge of the bin containing fraction f of the counts
+static double percentile(const uint64_t* bin, uint64_t sum, double f)
+{
+    uint64_t n = 0;
+    for(unsigned i=0; i<TPR_LAT_BINS; i++) {
+        n += bin[i];
+        if (double(n) >= f*double(sum))
+            return double(2ULL<<i);
+    }
+    return double(2ULL<<(TPR_LAT_BINS-1));
+}
+
+static void latency(const TprLatency& lat)
+{
+    static const char* names[] = { "irq->bh", "bh->wake", "wake->read" };
+    printf("%12.12s %12.12s %10.10s %10.10s %10.10s %10.10s\n",
+           "stage", "count", "p50(us)", "p99(us)", "p99.9(us)", "max(us)");
+    for(unsigned i=0; i<TPR_LAT_STAGES; i++) {
+        uint64_t sum = 0;
+        unsigned imax = 0;
+        for(unsigned j=0; j<TPR_LAT_BINS; j++) {
+            sum += lat.bin[i][j];
+            if (lat.bin[i][j])
+                imax = j;
+        }
+        if (!sum) {
+            printf("%12.12s %12u\n", names[i], 0);
+            continue;
+        }
+        printf("%12.12s %12llu %10.3f %10.3f %10.3f %10.3f\n",
+               names[i], (unsigned long long)sum,
+               percentile(lat.bin[i], sum, 0.5  )*1.e-3,
+               percentile(lat.bin[i], sum, 0.99 )*1.e-3,
+               percentile(lat.bin[i], sum, 0.999)*1.e-3,
+               double(2ULL<<imax)*1.e-3);
+    }
+}
+
+static void rate(const char* name, uint64_t v1, uint64_t v0, double dt)
+{
+    printf("%12.12s: %14llu  %12.1f/s\n", name,
+           (unsigned long long)v1, double(v1-v0)/dt);
+}
+
+int main(int argc, char** argv) {
+
+    extern char* optarg;
+    char tprid='a';
+    double period = 1;
+    unsigned nupdates = 0;
+    bool lLatency = false;
+    bool lReset = false;
+    bool lInfo = false;
+
+    int c;
+    bool lUsage = false;
+
+    while ( (c=getopt( argc, argv, "d:p:n:lrih?")) != EOF ) {
+        switch(c) {
+        case 'd':
+            tprid  = optarg[0];
+            if (strlen(optarg) != 1) {
+                printf("%s: option `-d' parsing error\n", argv[0]);
+                lUsage = true;
+            }
+            break;
+        case 'p':
+            period = strtod(optarg,NULL);
+            break;
+        case 'n':
+            nupdates = strtoul(optarg,NULL,0);
+            break;
+        case 'l':
+            lLatency = true;
+            break;
+        case 'r':
+            lReset = true;
+            break;
+        case 'i':
+            lInfo = true;
+            break;
+        case 'h':
+            usage(argv[0]);
+            exit(0);
+        case '?':
+        default:
+            lUsage = true;
+            break;
+        }
+    }
+
+    if (optind < argc) {
+        printf("%s: invalid argument -- %s\n",argv[0], argv[optind]);
+        lUsage = true;
+    }
+
+    if (lUsage) {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    char dev[16];
+    sprintf(dev,"/dev/tpr%cBSA",tprid);
+    int fd = open(dev, O_RDONLY);
+    if (fd<0) {
+        printf("Open failure for dev %s\n",dev);
+        perror("Could not open");
+        return -1;
+    }
+
+    if (lReset && ioctl(fd, TPR_IOC_LATRESET) < 0) {
+        perror("TPR_IOC_LATRESET");
+        return -2;
+    }
+
+    if (lInfo) {
+        static const char* modes[] = { "INTx", "MSI", "MSI-X", "virtual" };
+        TprInfo info;
+        memset(&info, 0, sizeof(info));
+        if (ioctl(fd, TPR_IOC_INFO, &info) < 0) {
+            perror("TPR_IOC_INFO");
+            return -2;
+        }
+        printf("pci %04x:%02x:%02x.%x  node %d  irq %d",
+               info.domain, info.bus, info.devfn>>3, info.devfn&7, info.node, info.irq);
+        if (info.version >= 2 && info.irqmode < 4)
+            printf(" (%s x%u)", modes[info.irqmode], info.nvec);
+        printf("  layout %u  qsize %llu\n", info.layout, (unsigned long long)info.qsize);
+        close(fd);
+        return 0;
+    }
+
+    if (lLatency) {
+        TprLatency lat;
+        for(unsigned n=0; nupdates==0 || n<nupdates; n++) {
+            usleep(unsigned(period*1.e6));
+            if (ioctl(fd, TPR_IOC_LATENCY, &lat) < 0) {
+                perror("TPR_IOC_LATENCY");
+                return -2;
+            }
+            printf("--\n");
+            latency(lat);
+        }
+        close(fd);
+        return 0;
+    }
+
+    TprStats s0, s1;
+    if (ioctl(fd, TPR_IOC_STATS, &s0) < 0) {
+        perror("TPR_IOC_STATS");
+        return -2;
+    }
+    if (s0.version != TPR_STATS_VERSION)
+        printf("Driver stats version %u, expected %u\n", s0.version, TPR_STATS_VERSION);
+
+    double t0 = now();
+    for(unsigned n=0; nupdates==0 || n<nupdates; n++) {
+        usleep(unsigned(period*1.e6));
+        if (ioctl(fd, TPR_IOC_STATS, &s1) < 0) {
+            perror("TPR_IOC_STATS");
+            return -2;
+        }
+        double t1 = now();
+        double dt = t1-t0;
+
+        const TprCounters& c1 = s1.counters;
+        const TprCounters& c0 = s0.counters;
+        printf("--\n");
+        rate("irqCount"   , c1.irqCount   , c0.irqCount   , dt);
+        rate("irqNoReq"   , c1.irqNoReq   , c0.irqNoReq   , dt);
+        rate("dmaCount"   , c1.dmaCount   , c0.dmaCount   , dt);
+        rate("dmaEvent"   , c1.dmaEvent   , c0.dmaEvent   , dt);
+        rate("dmaErrors"  , c1.dmaErrors  , c0.dmaErrors  , dt);
+        rate("dmaBsaChan" , c1.dmaBsaChan , c0.dmaBsaChan , dt);
+        rate("dmaBsaCtrl" , c1.dmaBsaCtrl , c0.dmaBsaCtrl , dt);
+        rate("bhCount"    , c1.bhCount    , c0.bhCount    , dt);
+        rate("bhBuffers"  , c1.bhBuffers  , c0.bhBuffers  , dt);
+        rate("pollCount"  , c1.pollCount  , c0.pollCount  , dt);
+        rate("pollBuffers", c1.pollBuffers, c0.pollBuffers, dt);
+        if (c1.bhBuffers != c0.bhBuffers)
+            printf("%12.12s: %14.1f ns/buffer\n", "bhTime",
+                   double(c1.bhTime-c0.bhTime)/double(c1.bhBuffers-c0.bhBuffers));
+        rate("gwp"        , s1.gwp        , s0.gwp        , dt);
+        rate("bsawp"      , s1.bsawp      , s0.bsawp      , dt);
+        if (s1.version >= 2) {
+            printf("%12.12s: %14llu\n", "zcHeld", (unsigned long long)s1.zcHeld);
+            rate("zcForced"   , s1.zcForced   , s0.zcForced   , dt);
+        }
+        for(unsigned i=0; i<MOD_SHARED; i++) {
+            char name[16];
+            sprintf(name,"allwp[%u]",i);
+            rate(name, s1.allwp[i], s0.allwp[i], dt);
+        }
+        s0 = s1;
+        t0 = t1;
+    }
+
+    close(fd);
+    return 0;
+}
@@ -10,6 +10,7 @@
 
 #include "tpr.hh"
 #include "tprsh.hh"
+#include "tprreader.hh"
 
 #include <string>
 
@@ -24,6 +25,7 @@ static unsigned triggerWidth = 0;
 static bool     verbose = false;
 static bool     markerRev = false;
 static bool     checkBSA  = false;
+static int      checkEdef = -1;
 
 enum TimingMode { LCLS1=0, LCLS2=1, UED=2 };
 
@@ -32,12 +34,6 @@ extern int optind;
 static void link_test          (TprReg&, TimingMode, bool lring);
 static void frame_rates        (TprReg&, TimingMode);
 static void frame_capture      (TprReg&, char, TimingMode);
-static void dump_frame         (volatile const uint32_t*);
-static bool parse_frame        (volatile const uint32_t*, uint64_t&, uint64_t&);
-static bool parse_bsa_event    (volatile const uint32_t*, uint64_t&, uint64_t&,
-                                uint64_t&, uint64_t&, uint64_t&);
-static bool parse_bsa_control  (volatile const uint32_t*, uint64_t&, uint64_t&,
-                                uint64_t&, uint64_t&, uint64_t&);
 static void generate_triggers  (TprReg&, TimingMode);
 static void generate_refclk    (TprReg&, bool, TimingMode);
 
@@ -50,6 +46,7 @@ static void usage(const char* p) {
     printf("          -n        : skip frame capture test\n");
     printf("          -r        : dump ring buffers\n");
     printf("          -B        : check BSA\n");
+    printf("          -E <edef> : follow the pulse records of a BSA EDEF [0..%d]\n",TPR_EDEFS-1);
     printf("          -C        : enable 10MHz refclk\n");
     printf("          -D delay[,width[,polarity]]  : trigger parameters\n");
     printf("          -S <sec>  : link settle period\n");
@@ -71,7 +68,7 @@ int main(int argc, char** argv) {
     bool refClkEn = false;
     char* endptr;
 
-    while ( (c=getopt( argc, argv, "12Ud:nrS:T:D:BCvh?")) != EOF ) {
+    while ( (c=getopt( argc, argv, "12Ud:nrS:T:D:BE:Cvh?")) != EOF ) {
         switch(c) {
         case '1': tmode = LCLS1; break;
         case '2': tmode = LCLS2; break;
@@ -89,6 +86,11 @@ int main(int argc, char** argv) {
         case 'B':
             checkBSA = true;
             break;
+        case 'E':
+            checkEdef = strtoul(optarg,NULL,0);
+            if (checkEdef >= TPR_EDEFS)
+                lUsage = true;
+            break;
         case 'C':
             refClkEn = true;
             break;
@@ -328,21 +330,14 @@ void frame_rates(TprReg& reg, TimingMode tmode)
 void frame_capture(TprReg& reg, char tprid, TimingMode tmode )
 {
     int idx=0;
-    char dev[16];
-    sprintf(dev,"/dev/tpr%c%x",tprid,idx);
-
-    int fd = open(dev, O_RDONLY);
-    if (fd<0) {
-        printf("Open failure for dev %s [FAIL]\n",dev);
+    Reader rdr;
+    if (rdr.open(tprid, idx) < 0) {
+        printf("Open failure for dev /dev/tpr%c%x [FAIL]\n",tprid,idx);
         perror("Could not open");
         return;
     }
-
-    void* ptr = mmap(0, sizeof(TprQueues), PROT_READ, MAP_SHARED, fd, 0);
-    if (ptr == MAP_FAILED) {
-        perror("Failed to map - FAIL");
-        return;
-    }
+    if (rdr.node() >= 0)
+        printf("Running on NUMA node %d\n", rdr.node());
 
     unsigned _channel = idx;
     unsigned ucontrol = reg.base.channel[_channel].control;
@@ -361,11 +356,9 @@ void frame_capture(TprReg& reg, char tprid, TimingMode tmode )
 
     //  follow bsa
 
-    char devbsa[16];
-    sprintf(devbsa,"/dev/tpr%cBSA",tprid);
-    int fdbsa = open(dev, O_RDONLY);
-    if (fdbsa<0) {
-        printf("Open failure for dev %s [FAIL]\n",devbsa);
+    Reader bsa;
+    if (bsa.open(tprid, Reader::BSA, Reader::Block, false) < 0) {
+        printf("Open failure for dev /dev/tpr%cBSA [FAIL]\n",tprid);
         perror("Could not open");
         return;
     }
@@ -377,16 +370,13 @@ void frame_capture(TprReg& reg, char tprid, TimingMode tmode )
     printf("   %16.16s %8.8s %8.8s\n",
            "PulseId","Seconds","Nanosec");
 
-    TprQueues& q = *(TprQueues*)ptr;
-
-    char* buff = new char[32];
+    TprQueues& q = rdr.queues();
+    Frame frame[16];
 
-    int64_t allrp = q.allwp[idx];
-    int64_t bsarp = q.bsawp;
-    printf("allrp %#lx  q.allwp[%d] %#lx\n", (uint64_t) allrp, idx, (uint64_t) q.allwp[idx]);
+    printf("allrp %#llx  q.allwp[%d] %#llx\n", rdr.position(), idx, qload(q.allwp[idx]));
 
-    read(fd, buff, 32);
-    read(fdbsa, buff, 32);
+    rdr.await();
+    bsa.await();
     usleep(tmode!=LCLS1 ? 20 : 100000);
     //  disable channel 0
     reg.base.channel[_channel].control = ucontrol;
@@ -394,132 +384,96 @@ void frame_capture(TprReg& reg, char tprid, TimingMode tmode )
     uint64_t pulseIdP=0;
     uint64_t pulseId, timeStamp;
     unsigned nframes=0;
-
-    do {
-        printf("allrp %#lx  q.allwp[%d] %#lx\n", (uint64_t) allrp, idx, (uint64_t) q.allwp[idx]);
-        while(allrp < q.allwp[idx] && nframes<10) {
-            volatile const uint32_t* p = reinterpret_cast<volatile const uint32_t*>
-                (&q.allq[q.allrp[idx].idx[allrp &(MAX_TPR_ALLQ-1)] &(MAX_TPR_ALLQ-1) ].word[0]);
+    long long lost=0;
+
+    while (nframes<10) {
+        printf("allrp %#llx  q.allwp[%d] %#llx\n", rdr.position(), idx, qload(q.allwp[idx]));
+        size_t n = rdr.next(frame);
+        if (rdr.lost() != lost) {
+            printf("%lld overwritten\n", rdr.lost()-lost);
+            lost = rdr.lost();
+        }
+        for(size_t i=0; i<n && nframes<10; i++) {
             if (verbose)
-                dump_frame(p);
-            if (parse_frame(p, pulseId, timeStamp)) {
+                frame[i].dump();
+            if (frame[i].isEvent()) {
+                EventMsg e = frame[i].event();
+                pulseId = e.pulseId();
                 if (pulseIdP) {
                     uint64_t pulseIdN = pulseIdP+1;
                     if (tmode==LCLS1) pulseIdN = (pulseId&~0x1ffffULL) | (pulseIdN&0x1ffffULL);
                     printf(" 0x%016llx %9u.%09u %s\n",
                            (unsigned long long)pulseId,
-                           unsigned(timeStamp>>32),
-                           unsigned(timeStamp&0xffffffff),
+                           e.seconds(), e.nanoseconds(),
                            (pulseId==pulseIdN) ? "PASS":"FAIL");
                     nframes++;
                 }
                 pulseIdP  =pulseId;
             }
-            allrp++;
         }
-        if (nframes>=10)
-            break;
-        read(fd, buff, 32);
-    } while(1);
+    }
 
 
     if (checkBSA) {  
-        uint64_t active, avgdn, update, init, minor, major;
         nframes = 0;
-        do {
-            printf("bsarp %#lx  q.bsawp %#lx\n", (uint64_t) bsarp, (uint64_t) q.bsawp);
-            while(bsarp < q.bsawp && nframes<10) {
-                volatile uint32_t* p = reinterpret_cast<volatile uint32_t*>
-                    (&q.bsaq[bsarp &(MAX_TPR_BSAQ-1)].word[0]);
-                if (parse_bsa_control(p, pulseId, timeStamp, init, minor, major)) {
+        while (nframes<10) {
+            printf("bsarp %#llx  q.bsawp %#llx\n", bsa.position(), qload(q.bsawp));
+            size_t n = bsa.next(frame);
+            for(size_t i=0; i<n && nframes<10; i++) {
+                if (frame[i].isBsaControl()) {
+                    BsaControlMsg m = frame[i].bsaControl();
                     printf(" 0x%016llx %9u.%09u I%016llx m%016llx M%016llx\n",
-                           (unsigned long long)pulseId,
-                           unsigned(timeStamp>>32),
-                           unsigned(timeStamp&0xffffffff),
-                           (unsigned long long)init,
-                           (unsigned long long)minor,
-                           (unsigned long long)major);
+                           (unsigned long long)m.pulseId(),
+                           unsigned(m.timeStamp()>>32),
+                           unsigned(m.timeStamp()&0xffffffff),
+                           (unsigned long long)m.init(),
+                           (unsigned long long)m.minor(),
+                           (unsigned long long)m.major());
                 }
-                if (parse_bsa_event(p, pulseId, timeStamp, active, avgdn, update)) {
+                if (frame[i].isBsaEvent()) {
+                    BsaEventMsg m = frame[i].bsaEvent();
                     printf(" 0x%016llx %9u.%09u A%016llx D%016llx U%016llx\n",
-                           (unsigned long long)pulseId,
-                           unsigned(timeStamp>>32),
-                           unsigned(timeStamp&0xffffffff),
-                           (unsigned long long)active,
-                           (unsigned long long)avgdn,
-                           (unsigned long long)update);
+                           (unsigned long long)m.pulseId(),
+                           unsigned(m.timeStamp()>>32),
+                           unsigned(m.timeStamp()&0xffffffff),
+                           (unsigned long long)m.active(),
+                           (unsigned long long)m.avgDone(),
+                           (unsigned long long)m.update());
                     nframes++;
                 }
-                bsarp++;
+            }
+        }
+    }
+
+    if (checkEdef >= 0) {
+        EdefReader edef(q, checkEdef);
+        uint32_t status;
+        nframes = 0;
+        printf("edef %d  rp %#llx\n", checkEdef, edef.position());
+        do {
+            QueueReader::Result res;
+            while(nframes<10 && (res = edef.next(pulseId, timeStamp, status)) != QueueReader::Empty) {
+                if (res == QueueReader::Lost)
+                    continue;
+                printf(" 0x%016llx %9u.%09u %s%s%s%s%s%s\n",
+                       (unsigned long long)pulseId,
+                       unsigned(timeStamp>>32),
+                       unsigned(timeStamp&0xffffffff),
+                       (status & EdefInit)    ? " init"   :"",
+                       (status & EdefMinor)   ? " minor"  :"",
+                       (status & EdefMajor)   ? " major"  :"",
+                       (status & EdefActive)  ? " active" :"",
+                       (status & EdefAvgDone) ? " avgdone":"",
+                       (status & EdefUpdate)  ? " update" :"");
+                nframes++;
             }
             if (nframes>=10)
                 break;
-            read(fdbsa, buff, 32);
+            bsa.await();
         } while(1);
+        if (edef.lost())
+            printf("edef %d: %lld records overwritten\n", checkEdef, edef.lost());
     }
-
-    munmap(ptr, sizeof(TprQueues));
-    close(fd);
-    close(fdbsa);
-}
-
-void dump_frame(volatile const uint32_t* p)
-{
-    char m = p[0]&(0x808<<20) ? 'D':' ';
-    if (((p[0]>>16)&0xf)==0) {
-        volatile const uint64_t* pl = reinterpret_cast<volatile const uint64_t*>(p+2);
-        printf("EVENT LCLS%c chmask [x%x] [x%x] %c: %16lx %16lx",
-               (p[0]&(1<<22)) ? '1':'2',
-               (p[0]>>0)&0xffff,p[1],m,pl[0],pl[1]);
-        for(unsigned i=6; i<20; i++)
-            printf(" %08x",p[i]);
-        printf("\n");
-    }
-}
-
-bool parse_frame(volatile const uint32_t* p,
-                 uint64_t& pulseId, uint64_t& timeStamp)
-{
-    //  char m = p[0]&(0x808<<20) ? 'D':' ';
-    if (((p[0]>>16)&0xf)==0) { // EVENT_TAG
-        volatile const uint64_t* pl = reinterpret_cast<volatile const uint64_t*>(p+2);
-        pulseId = pl[0];
-        timeStamp = pl[1];
-        return true;
-    }
-    return false;
-}
-
-bool parse_bsa_event(volatile const uint32_t* p,
-                     uint64_t& pulseId, uint64_t& timeStamp,
-                     uint64_t& active, uint64_t& avgdone, uint64_t& update)
-{
-    if (((p[0]>>16)&0xf)==2) { // BSAEVNT_TAG
-        volatile const uint64_t* pl = reinterpret_cast<volatile const uint64_t*>(p+1);
-        pulseId   = pl[0];
-        active    = pl[1];
-        avgdone   = pl[2];
-        timeStamp = pl[3];
-        update    = pl[4];
-        return true;
-    }
-    return false;
-}
-
-bool parse_bsa_control(volatile const uint32_t* p,
-                       uint64_t& pulseId, uint64_t& timeStamp,
-                       uint64_t& init, uint64_t& minor, uint64_t& major)
-{
-    if (((p[0]>>16)&0xf)==1) { // BSACNTL_TAG
-        volatile const uint64_t* pl = reinterpret_cast<volatile const uint64_t*>(p+1);
-        pulseId   = pl[0];
-        timeStamp = pl[1];
-        init      = pl[2];
-        minor     = pl[3];
-        major     = pl[4];
-        return true;
-    }
-    return false;
 }
 
 void generate_triggers(TprReg& reg, TimingMode tmode)
@@ -29,8 +29,20 @@
 #include <asm/atomic.h>
 #include <linux/cdev.h>
 #include <linux/vmalloc.h>
+#include <linux/slab.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/log2.h>
+#include <linux/timex.h>
+#include <linux/math64.h>
 #include "tpr.h"
 
+#define CREATE_TRACE_POINTS
+#include "tpr_trace.h"
+
+// Card index for the tracepoints
+#define TPR_CARD(dev) ((int)((dev) - gDevices))
+
 /**
  * HAVE_UNLOCKED_IOCTL has been dropped in kernel version 5.9.
  * There is a chance that the removal might be ported back to 5.x.
@@ -63,12 +75,34 @@
 #define SA_SHIRQ IRQF_SHARED
 #endif
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 3, 0)
+static inline int wq_has_sleeper(wait_queue_head_t *wq)
+{
+  smp_mb();
+  return waitqueue_active(wq);
+}
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
 static __u64 __rdtsc(void);
 static __u64 __rdtsc(void){
     __u32 lo, hi;
     __asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
     return ((__u64)hi << 32) | lo;
 }
+#else
+//  The architected counter on arm64, whatever the arch offers elsewhere
+static inline __u64 __rdtsc(void) { return get_cycles(); }
+#endif
+
+//  Publish a queue write pointer (see tpr_handle_dma)
+#if BITS_PER_LONG == 64
+#define tpr_publish(p, v) smp_store_release(p, v)
+#else
+//  No 64-bit smp_store_release here; the store is only single-copy atomic
+//  where the CPU makes it so (e.g. ARMv7 with LPAE)
+#define tpr_publish(p, v) do { smp_wmb(); WRITE_ONCE(*(p), v); } while (0)
+#endif
 
 // Function prototypes
 int     tpr_open     (struct inode *inode, struct file *filp);
@@ -87,6 +121,7 @@ irqreturn_t tpr_intr(int irq, void *dev_id, struct pt_regs *regs);
 #else
 irqreturn_t tpr_intr(int irq, void *dev_id);
 #endif
+irqreturn_t tpr_msi_intr(int irq, void *dev_id);
 
 int     tpr_probe    (struct pci_dev *pcidev, const struct pci_device_id *dev_id);
 void    tpr_remove   (struct pci_dev *pcidev);
@@ -113,6 +148,11 @@ int     tpr_vmfault  (struct vm_area_struct *vma, struct vm_fault *vmf);
 long tpr_compat_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
 #endif
 
+// Interrupt mode
+static int msi = 1;
+module_param(msi, int, 0444);
+MODULE_PARM_DESC(msi, "Use MSI-X or MSI when the card offers it, 0=legacy shared IRQ");
+
 // PCI device IDs
 static struct pci_device_id tpr_ids[] = {
   { PCI_DEVICE(0x1A4A, 0x2011) },  // SLAC TPR
@@ -124,6 +164,90 @@ MODULE_DEVICE_TABLE(pci, tpr_ids);
 module_init(tpr_init);
 module_exit(tpr_exit);
 
+// Shared queue layout
+static int qlayout = TPR_QLAYOUT_INDEX;
+module_param(qlayout, int, 0444);
+MODULE_PARM_DESC(qlayout, "Channel queue layout: 0=index into allq, 1=per-channel rings");
+
+// Queue depths, rounded up to powers of two
+static int allq_depth = MAX_TPR_ALLQ;
+module_param(allq_depth, int, 0444);
+MODULE_PARM_DESC(allq_depth, "Events kept in allq and in each channel index (or zero-copy descriptors)");
+static int bsaq_depth = MAX_TPR_BSAQ;
+module_param(bsaq_depth, int, 0444);
+MODULE_PARM_DESC(bsaq_depth, "BSA messages kept in bsaq");
+
+static int clk_ms = 100;
+module_param(clk_ms, int, 0644);
+MODULE_PARM_DESC(clk_ms, "Period of the TSC to timing clock fit, ms (10 to 2000)");
+
+static int edefq_depth = 256;
+module_param(edefq_depth, int, 0444);
+MODULE_PARM_DESC(edefq_depth, "Pulse records kept for each BSA EDEF");
+static int chnq_depth = MAX_TPR_CHNQ;
+module_param(chnq_depth, int, 0444);
+MODULE_PARM_DESC(chnq_depth, "Events kept per channel with qlayout=1");
+
+// Zero-copy delivery
+static int zcopy = 0;
+module_param(zcopy, int, 0444);
+MODULE_PARM_DESC(zcopy, "Map the DMA buffers to readers instead of copying events (overrides qlayout)");
+static int zc_hold = 512;
+module_param(zc_hold, int, 0644);
+MODULE_PARM_DESC(zc_hold, "Max DMA buffers held back from the card for slow zero-copy readers");
+
+static int lag_warn = 50;
+module_param(lag_warn, int, 0644);
+MODULE_PARM_DESC(lag_warn, "Raise POLLPRI when a client trails by this percent of its ring");
+
+// DMA bottom half polling
+static int dma_budget = 64;
+module_param(dma_budget, int, 0644);
+MODULE_PARM_DESC(dma_budget, "Max DMA buffers drained per bottom half pass");
+static int poll_us = 20;
+module_param(poll_us, int, 0644);
+MODULE_PARM_DESC(poll_us, "Poll interval (us) while traffic is sustained, 0=always re-enable the IRQ");
+
+// Queue window mapping
+static int qprefault = 1;
+module_param(qprefault, int, 0644);
+MODULE_PARM_DESC(qprefault, "Map the whole queue window at mmap instead of faulting in pages");
+
+// Allocate the queue window in 2MB chunks where the buddy allocator has them
+#define TPR_QORDER (21-PAGE_SHIFT)
+
+// RX DMA ring
+static int rx_bufsize = BUF_SIZE;
+module_param(rx_bufsize, int, 0444);
+MODULE_PARM_DESC(rx_bufsize, "Bytes per DMA buffer, 512 to 65536, rounded up to a power of 2");
+
+static int rx_count = NUMBER_OF_RX_BUFFERS;
+module_param(rx_count, int, 0444);
+MODULE_PARM_DESC(rx_count, "DMA buffers in the RX ring, 16 to 1023");
+
+// Virtual cards
+static int vdev = 0;
+module_param(vdev, int, 0444);
+MODULE_PARM_DESC(vdev, "Virtual cards to create, generating synthetic timing traffic without hardware");
+
+static int vrate = 929000;
+module_param(vrate, int, 0644);
+MODULE_PARM_DESC(vrate, "Virtual card pulse rate, Hz (1 to 929000)");
+
+static int vbsa = 910;
+module_param(vbsa, int, 0644);
+MODULE_PARM_DESC(vbsa, "Virtual card BSA messages every vbsa pulses, 0 for none");
+
+static int vtick_us = 100;
+module_param(vtick_us, int, 0644);
+MODULE_PARM_DESC(vtick_us, "Virtual card DMA interval, us");
+
+static int rx_batch = 16;
+module_param(rx_batch, int, 0644);
+MODULE_PARM_DESC(rx_batch, "Drained DMA buffers handed back to the card per burst of doorbells");
+
+static struct dentry* tpr_debugfs;
+
 
 // PCI driver structure
 static struct pci_driver tprDriver = {
@@ -171,6 +295,307 @@ static void printList(struct shared_tpr *sh)
 }
 #endif
 
+// Sum the per-CPU counters
+static void tpr_counters(struct tpr_dev *dev, struct TprCounters *sum)
+{
+  int cpu;
+  memset(sum, 0, sizeof(*sum));
+  for_each_possible_cpu(cpu) {
+    struct TprCounters *c = per_cpu_ptr(dev->stats, cpu);
+    sum->irqEnable   += c->irqEnable;
+    sum->irqDisable  += c->irqDisable;
+    sum->irqCount    += c->irqCount;
+    sum->irqNoReq    += c->irqNoReq;
+    sum->dmaCount    += c->dmaCount;
+    sum->dmaEvent    += c->dmaEvent;
+    sum->dmaErrors   += c->dmaErrors;
+    sum->dmaBsaChan  += c->dmaBsaChan;
+    sum->dmaBsaCtrl  += c->dmaBsaCtrl;
+    sum->bhCount     += c->bhCount;
+    sum->bhBuffers   += c->bhBuffers;
+    sum->bhBudget    += c->bhBudget;
+    sum->bhTime      += c->bhTime;
+    sum->pollCount   += c->pollCount;
+    sum->pollBuffers += c->pollBuffers;
+    sum->pollIdle    += c->pollIdle;
+  }
+}
+
+// Counters and queue pointers as of a single DMA buffer boundary
+static void tpr_snapshot(struct tpr_dev *dev, struct TprStats *st)
+{
+  struct TprQueues *tprq = dev->amem;
+  unsigned seq;
+  int i;
+
+  memset(st, 0, sizeof(*st));
+  st->version = TPR_STATS_VERSION;
+  st->size    = sizeof(*st);
+  do {
+    seq = read_seqcount_begin(&dev->qseq);
+    tpr_counters(dev, &st->counters);
+    for( i=0; i<MOD_SHARED; i++)
+      st->allwp[i] = tprq->allwp[i];
+    st->bsawp = tprq->bsawp;
+    st->gwp   = tprq->gwp;
+    st->zcHeld   = dev->zcHeld;
+    st->zcForced = dev->zcForced;
+  } while (read_seqcount_retry(&dev->qseq, seq));
+}
+
+// Count a latency in its log2 bin.  Lock-free; per-CPU.
+static inline void tpr_lat(struct tpr_dev* dev, int stage, u64 ns)
+{
+  int b = ns ? fls64(ns)-1 : 0;
+  if (b >= TPR_LAT_BINS)
+    b = TPR_LAT_BINS-1;
+  this_cpu_inc(dev->lat->bin[stage][b]);
+}
+
+// Sum the per-CPU latency histograms
+static void tpr_latency(struct tpr_dev *dev, struct TprLatency *sum)
+{
+  int cpu, i, j;
+  memset(sum, 0, sizeof(*sum));
+  for_each_possible_cpu(cpu) {
+    struct TprLatency *l = per_cpu_ptr(dev->lat, cpu);
+    for( i=0; i<TPR_LAT_STAGES; i++)
+      for( j=0; j<TPR_LAT_BINS; j++)
+        sum->bin[i][j] += l->bin[i][j];
+  }
+}
+
+// Clear the latency histograms.  Counts racing with the reset may survive it.
+static void tpr_latency_reset(struct tpr_dev *dev)
+{
+  int cpu;
+  for_each_possible_cpu(cpu)
+    memset(per_cpu_ptr(dev->lat, cpu), 0, sizeof(struct TprLatency));
+}
+
+// Index into tpr_dev waitq[]/gen[] for a client
+static inline int tpr_wqidx(struct shared_tpr *shared)
+{
+  return shared->minor < 0 ? MOD_SHARED+1 : shared->minor;
+}
+
+// Lowest position of the zero-copy clients.  Caller holds dev->lock.
+static void tpr_zc_update(struct tpr_dev *dev)
+{
+  struct shared_tpr *shared;
+  long long zcmin = LLONG_MAX;
+  int i;
+
+  for( i=0; i<MOD_SHARED; i++)
+    for( shared=dev->shared[i]; shared; shared=shared->next)
+      if (shared->zc && shared->zcpos < zcmin)
+        zcmin = shared->zcpos;
+  WRITE_ONCE(dev->zcmin, zcmin);
+}
+
+// Row of allrp for a channel
+static inline long long* tpr_allrp(struct tpr_dev *dev, int ich)
+{
+  return dev->allrp + (size_t)ich * (dev->allqmask+1);
+}
+
+// Generation and waitqueue a client waits on
+static inline unsigned long *tpr_client_gen(struct tpr_dev *dev, struct shared_tpr *shared)
+{
+  return shared->filtered ? &shared->fgen : &dev->gen[tpr_wqidx(shared)];
+}
+
+static inline wait_queue_head_t *tpr_client_wq(struct tpr_dev *dev, struct shared_tpr *shared)
+{
+  return shared->filtered ? &shared->fwaitq : &dev->waitq[tpr_wqidx(shared)];
+}
+
+static inline unsigned long tpr_client_seen(struct shared_tpr *shared)
+{
+  return shared->filtered ? shared->fseen : shared->gen;
+}
+
+// Does an event message pass a client's filter
+static int tpr_filter_match(const struct TprFilter *f, const __u32 *msg)
+{
+  int any = f->flags & TPR_FILTER_ANY;
+  unsigned i;
+
+  if (f->pidmod) {
+    u64 pid = ((u64)msg[3] << 32) | msg[2];
+    if (do_div(pid, f->pidmod) != f->pidrem)
+      return 0;
+  }
+  if (!f->nmatch)
+    return 1;
+  for( i=0; i<f->nmatch; i++)
+    if (((msg[f->match[i].word] & f->match[i].mask) == f->match[i].value) == !!any)
+      return any;
+  return !any;
+}
+
+// Run the filtered clients of the channels in chm against an event message
+// about to be published, and mark those due a wake-up.  Returns the
+// channels where some client took the event.
+static u32 tpr_filter(struct tpr_dev *dev, u32 chm, const __u32 *msg, u64 now)
+{
+  struct TprQueues *tprq = dev->amem;
+  struct shared_tpr *shared;
+  u32 ich, wake = 0;
+
+  spin_lock(&dev->lock);
+  for( ich=0; chm; ich++) {
+    if (!(chm & (1<<ich)))
+      continue;
+    chm = chm & ~(1<<ich);
+    for( shared=dev->shared[ich]; shared; shared=shared->next) {
+      if (!shared->filtered || !tpr_filter_match(&shared->filter, msg))
+        continue;
+      if (++shared->fcount < shared->filter.decimate)
+        continue;
+      shared->fcount   = 0;
+      shared->fwp      = tprq->allwp[ich];
+      if (++shared->npend >= shared->bcount)
+        shared->fpending = 1;
+      else if (shared->npend == 1 && shared->busec)
+        shared->bdeadline = now + (u64)shared->busec*NSEC_PER_USEC;
+      wake = wake | (1<<ich);
+    }
+  }
+  spin_unlock(&dev->lock);
+  return wake;
+}
+
+// Wake the filtered clients marked by tpr_filter or past their batch
+// deadline, and arm batch_timer for the earliest deadline left
+static void tpr_filter_wake(struct tpr_dev *dev, u64 now)
+{
+  struct shared_tpr *shared;
+  u32 ich, chm, npend;
+  u64 next = 0;
+  int sleepers;
+
+  spin_lock(&dev->lock);
+  chm = dev->fmask;
+  for( ich=0; chm; ich++) {
+    if (!(chm & (1<<ich)))
+      continue;
+    chm = chm & ~(1<<ich);
+    for( shared=dev->shared[ich]; shared; shared=shared->next) {
+      if (!shared->filtered || !shared->npend)
+        continue;
+      if (!shared->fpending && shared->busec && now >= shared->bdeadline)
+        shared->fpending = 1;
+      if (!shared->fpending) {
+        if (shared->busec && (!next || shared->bdeadline < next))
+          next = shared->bdeadline;
+        continue;
+      }
+      npend = shared->npend;
+      shared->fpending = 0;
+      shared->npend    = 0;
+      WRITE_ONCE(shared->fwake_ns, now);
+      smp_store_release(&shared->fgen, shared->fgen+1);
+      sleepers = wq_has_sleeper(&shared->fwaitq);
+      trace_tpr_fwake(TPR_CARD(dev), ich, shared->idx, shared->fgen, npend, sleepers);
+      if (sleepers)
+        wake_up(&shared->fwaitq);
+    }
+  }
+  //  No minors once removal has begun; batch_timer must stay cancelled
+  if (next && dev->minors)
+    hrtimer_start(&dev->batch_timer, ns_to_ktime(next), HRTIMER_MODE_ABS);
+  spin_unlock(&dev->lock);
+}
+
+static enum hrtimer_restart tpr_batch_timer(struct hrtimer *timer)
+{
+  struct tpr_dev* dev = container_of(timer, struct tpr_dev, batch_timer);
+  tasklet_schedule(&dev->batch_task);
+  return HRTIMER_NORESTART;
+}
+
+static void tpr_batch_expire(unsigned long arg)
+{
+  tpr_filter_wake(&gDevices[arg], ktime_get_ns());
+}
+
+// Switch a client between the per-minor wake-ups and its own, as its
+// filter and batch settings call for.  Caller holds dev->lock.
+static void tpr_set_filtered(struct tpr_dev *dev, struct shared_tpr *shared)
+{
+  const struct TprFilter *f = &shared->filter;
+  int m  = shared->minor;
+  int on = f->decimate > 1 || f->pidmod || f->nmatch || shared->bcount > 1 || shared->busec;
+
+  if (on && !shared->filtered) {
+    dev->nfilt[m]++;
+    WRITE_ONCE(dev->fmask, dev->fmask | (1<<m));
+    shared->fseen = shared->fgen;
+  }
+  else if (!on && shared->filtered) {
+    if (!--dev->nfilt[m])
+      WRITE_ONCE(dev->fmask, dev->fmask & ~(1<<m));
+    shared->gen = READ_ONCE(dev->gen[m]);
+  }
+  shared->fcount   = 0;
+  shared->npend    = 0;
+  shared->fpending = 0;
+  WRITE_ONCE(shared->filtered, on);
+}
+
+// Write pointer and ring depth a client reads against
+static long long *tpr_client_wp(struct tpr_dev *dev, struct shared_tpr *shared, unsigned *depth)
+{
+  struct TprQueues *tprq = dev->amem;
+
+  if (shared->minor < 0) {
+    *depth = dev->bsaqmask+1;
+    return &tprq->bsawp;
+  }
+  *depth = dev->chnq ? dev->chnqmask+1 : dev->allqmask+1;
+  return &tprq->allwp[shared->minor];
+}
+
+// Record a client's read pointer and count the entries it was lapped on.
+// Caller holds dev->lock.
+static void tpr_client_rp(struct tpr_dev *dev, struct shared_tpr *shared, long long rp)
+{
+  unsigned  depth;
+  long long wp = smp_load_acquire(tpr_client_wp(dev, shared, &depth));
+  long long oldest = wp - depth + 1, lo;
+
+  if (rp > wp)
+    rp = wp;
+  if (rp < oldest) {
+    lo = max(rp, shared->lostto);
+    if (lo < oldest) {
+      shared->lost  += oldest - lo;
+      shared->lostto = oldest;
+    }
+  }
+  if (wp - rp > shared->maxlag)
+    shared->maxlag = wp - rp;
+  WRITE_ONCE(shared->rp, rp);
+  smp_store_release(&shared->rpset, 1);
+}
+
+// Convert a channel read pointer to the first gwp the client still needs
+static long long tpr_zc_pos(struct tpr_dev *dev, int minor, long long rp)
+{
+  struct TprQueues *tprq = dev->amem;
+  long long gwp, wp;
+
+  //  gwp first: anything published after we read it is at or above it
+  gwp = smp_load_acquire(&tprq->gwp);
+  wp  = smp_load_acquire(&tprq->allwp[minor]);
+  if (rp >= wp)
+    return gwp;
+  if (rp < wp - tprq->allqdepth)
+    rp = wp - tprq->allqdepth;
+  return tpr_allrp(dev, minor)[rp & dev->allqmask];
+}
+
 // Open Returns 0 on success, error code on failure
 int tpr_open(struct inode *inode, struct file *filp) {
   struct tpr_dev *   dev;
@@ -186,11 +611,11 @@ int tpr_open(struct inode *inode, struct file *filp) {
 
   if (minor < MOD_SHARED || minor == (MOD_SHARED+1)) { // A single channel or BSA
     struct shared_tpr *shared;
-    spin_lock(&dev->lock);
+    spin_lock_bh(&dev->lock);
     shared = dev->freelist;
     if (shared)
         dev->freelist = shared->next;
-    spin_unlock(&dev->lock);
+    spin_unlock_bh(&dev->lock);
     if (!shared) {
       printk(KERN_WARNING "%s: Open: module open failed.  Too many opens. Maj=%i, Min=%i.\n",
              MOD_NAME, dev->major, (unsigned)minor);
@@ -198,6 +623,18 @@ int tpr_open(struct inode *inode, struct file *filp) {
     }
     filp->private_data = shared;
     shared->parent = dev;
+    shared->mapping = filp->f_mapping;
+    shared->zc     = 0;
+    shared->rpset  = 0;
+    shared->filtered = 0;
+    shared->fpending = 0;
+    shared->npend    = 0;
+    shared->bcount   = 1;
+    shared->busec    = 0;
+    memset(&shared->filter, 0, sizeof(shared->filter));
+    shared->maxlag = 0;
+    shared->lost   = 0;
+    shared->lostto = 0;
 #ifdef TPRDEBUG
     printk(KERN_WARNING "%s: Open: minor %d opened as index %d.\n",
            MOD_NAME, minor, shared->idx);
@@ -214,16 +651,17 @@ int tpr_open(struct inode *inode, struct file *filp) {
             reg = (struct TprReg*)(dev->bar[0].reg);
             reg->channel[minor].control = reg->channel[minor].control | (1<<2);
             reg->irqControl = 1;
-            dev->irqEnable++;
+            this_cpu_inc(dev->stats->irqEnable);
         }
         shared->minor = minor;
-        spin_lock(&dev->lock);
+        shared->gen   = READ_ONCE(dev->gen[minor]);
+        spin_lock_bh(&dev->lock);
         shared->next = dev->shared[minor];
         if (shared->next)
             shared->next->prev = shared;
         shared->prev = NULL;
         dev->shared[minor] = shared;
-        spin_unlock(&dev->lock);
+        spin_unlock_bh(&dev->lock);
 #ifdef TPRDEBUG
         printk(KERN_WARNING "%s         dev->shared[%d]\n", MOD_NAME, minor);
         printList(dev->shared[minor]);
@@ -231,13 +669,14 @@ int tpr_open(struct inode *inode, struct file *filp) {
     }
     else if (minor == MOD_SHARED+1) {
         shared->minor = -1;
-        spin_lock(&dev->lock);
+        shared->gen   = READ_ONCE(dev->gen[MOD_SHARED+1]);
+        spin_lock_bh(&dev->lock);
         shared->next = dev->bsa;
         if (shared->next)
             shared->next->prev = shared;
         shared->prev = NULL;
         dev->bsa = shared;
-        spin_unlock(&dev->lock);
+        spin_unlock_bh(&dev->lock);
 #ifdef TPRDEBUG
         printk(KERN_WARNING "%s: BSA list. Maj=%i, Min=%i.\n",
                MOD_NAME, dev->major, (unsigned)shared->minor);
@@ -273,6 +712,7 @@ int tpr_release(struct inode *inode, struct file *filp) {
   struct shared_tpr *shared = (struct shared_tpr*)filp->private_data;
   struct TprReg* reg;
   struct tpr_dev *dev;
+  struct TprCounters c;
 
   if (!shared->parent) {
     printk("%s: Release: module close failed. Already closed.\n",MOD_NAME);
@@ -284,7 +724,7 @@ int tpr_release(struct inode *inode, struct file *filp) {
       // Nothing to do!
   }
   else {                                      // Single channel or BSA
-    spin_lock(&dev->lock);
+    spin_lock_bh(&dev->lock);
     if (shared->prev)
         shared->prev->next = shared->next;
     if (shared->next)
@@ -299,6 +739,16 @@ int tpr_release(struct inode *inode, struct file *filp) {
 #endif
     } else {                 // Single channel
         if(!shared->prev) dev->shared[shared->minor] = shared->next;
+        if (shared->filtered) {
+          shared->filtered = 0;
+          if (!--dev->nfilt[shared->minor])
+            WRITE_ONCE(dev->fmask, dev->fmask & ~(1<<shared->minor));
+        }
+        if (shared->zc) {                        // Let go of its buffers
+          shared->zc = 0;
+          tpr_zc_update(dev);
+          tasklet_schedule(&dev->dma_task);
+        }
         if (!dev->shared[shared->minor]) {       // Last one leaving, shut out the lights...
           i = shared->minor;
           reg = (struct TprReg*)shared->parent->bar[0].reg;
@@ -323,22 +773,24 @@ int tpr_release(struct inode *inode, struct file *filp) {
     }
     dev->freelist = shared;
 
-    spin_unlock(&dev->lock);
+    spin_unlock_bh(&dev->lock);
   }
 
-  printk("%s: Release: Major %u: irqEnable %u, irqDisable %u, irqCount %u, irqNoReq %u\n",
+  tpr_counters(dev, &c);
+
+  printk("%s: Release: Major %u: irqEnable %llu, irqDisable %llu, irqCount %llu, irqNoReq %llu\n",
 	   MOD_NAME, shared->parent->major,
-	   dev->irqEnable,
-	   dev->irqDisable,
-	   dev->irqCount,
-	   dev->irqNoReq);
+	   c.irqEnable,
+	   c.irqDisable,
+	   c.irqCount,
+	   c.irqNoReq);
 
-  printk("%s: Release: Major %u: dmaCount %u, dmaEvent %u, dmaBsaChan %u, dmaBsaCtrl %u\n",
+  printk("%s: Release: Major %u: dmaCount %llu, dmaEvent %llu, dmaBsaChan %llu, dmaBsaCtrl %llu\n",
 	   MOD_NAME, shared->parent->major,
-	   dev->dmaCount,
-	   dev->dmaEvent,
-	   dev->dmaBsaChan,
-	   dev->dmaBsaCtrl);
+	   c.dmaCount,
+	   c.dmaEvent,
+	   c.dmaBsaChan,
+	   c.dmaBsaCtrl);
 
   //  Unlink
   shared->parent = NULL;
@@ -360,30 +812,65 @@ ssize_t tpr_read(struct file *filp, char *buffer, size_t count, loff_t *f_pos)
 {
   ssize_t retval = 0;
   struct shared_tpr *shared = ((struct shared_tpr *) filp->private_data);
+  struct tpr_dev *dev = shared->parent;
+  int m = tpr_wqidx(shared);
+  unsigned long gen, *genp;
+  wait_queue_head_t *wq;
+  int filtered, slept = 0;
   __u32 pendingirq;
 
   do {
     if (count < sizeof(pendingirq))
       break;
-    while (!shared->pendingirq) {
+    while (1) {
+      filtered = READ_ONCE(shared->filtered);
+      genp = tpr_client_gen(dev, shared);
+      if ((gen = smp_load_acquire(genp)) != tpr_client_seen(shared))
+        break;
       if (filp->f_flags & O_NONBLOCK)
         return -EAGAIN;
 #ifdef TPRDEBUG2
       printk(KERN_WARNING "%s: sleeping %d for %d\n", MOD_NAME, shared->idx, shared->minor);
 #endif
-      if (wait_event_interruptible(shared->waitq, shared->pendingirq))
+      wq = tpr_client_wq(dev, shared);
+      if (wait_event_interruptible(*wq, READ_ONCE(*genp) != tpr_client_seen(shared) ||
+                                   READ_ONCE(shared->filtered) != filtered))
         return -ERESTARTSYS;
+      slept = 1;
     }
-    pendingirq = (__u32) test_and_clear_bit(0, (volatile unsigned long*)&shared->pendingirq);
+    if (filtered)
+      shared->fseen = gen;
+    else
+      shared->gen   = gen;
+    pendingirq = 1;
+    //  Only a reader the wake-up ended a sleep for measures it, against
+    //  its own wake-up if tpr_filter_wake sent it
+    if (slept)
+      tpr_lat(dev, TPR_LAT_WAKE2RD, ktime_get_ns() -
+              (filtered ? READ_ONCE(shared->fwake_ns) : READ_ONCE(dev->wake_ns[m])));
 #ifdef TPRDEBUG2
-    printk(KERN_WARNING "%s: woke up %d for %d, pendingirq=%d\n", MOD_NAME, shared->idx, shared->minor, pendingirq);
+    printk(KERN_WARNING "%s: woke up %d for %d, gen=%lu\n", MOD_NAME, shared->idx, shared->minor, gen);
 #endif
-    if (copy_to_user(buffer, &pendingirq, sizeof(pendingirq))) {
-      retval = -EFAULT;
-      break;
+    if (filtered && count >= sizeof(struct TprWake)) {
+      struct TprWake w;
+      w.pending  = pendingirq;
+      w.reserved = 0;
+      w.rp       = READ_ONCE(shared->fwp);
+      if (copy_to_user(buffer, &w, sizeof(w))) {
+        retval = -EFAULT;
+        break;
+      }
+      retval = sizeof(w);
     }
-    *f_pos = *f_pos + sizeof(pendingirq);
-    retval = sizeof(pendingirq);
+    else {
+      if (copy_to_user(buffer, &pendingirq, sizeof(pendingirq))) {
+        retval = -EFAULT;
+        break;
+      }
+      retval = sizeof(pendingirq);
+    }
+    *f_pos = *f_pos + retval;
+    trace_tpr_read(TPR_CARD(dev), shared->minor, shared->idx, gen, retval);
   } while(0);
 
   return retval;
@@ -397,7 +884,139 @@ long tpr_unlocked_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 int tpr_ioctl(struct inode *inode, struct file *filp, unsigned int cmd, unsigned long arg) {
 #endif
 
-  // lcls-i ioctls only?
+  struct shared_tpr *shared = (struct shared_tpr *)filp->private_data;
+  struct tpr_dev *dev = shared->parent;
+
+  if (_IOC_TYPE(cmd) != TPR_IOC_MAGIC)
+    return(ERROR);
+
+  switch (_IOC_NR(cmd)) {
+  case _IOC_NR(TPR_IOC_STATS): {
+    struct TprStats st;
+    tpr_snapshot(dev, &st);
+    if (copy_to_user((void*)arg, &st, min_t(size_t, _IOC_SIZE(cmd), sizeof(st))))
+      return -EFAULT;
+    return SUCCESS;
+  }
+  case _IOC_NR(TPR_IOC_LATENCY): {
+    struct TprLatency lat;
+    tpr_latency(dev, &lat);
+    if (copy_to_user((void*)arg, &lat, min_t(size_t, _IOC_SIZE(cmd), sizeof(lat))))
+      return -EFAULT;
+    return SUCCESS;
+  }
+  case _IOC_NR(TPR_IOC_LATRESET):
+    tpr_latency_reset(dev);
+    return SUCCESS;
+  case _IOC_NR(TPR_IOC_INFO): {
+    struct TprInfo info;
+    memset(&info, 0, sizeof(info));
+    info.version = TPR_INFO_VERSION;
+    info.size    = sizeof(info);
+    info.node    = dev->node;
+    info.irq     = dev->irq;
+    if (dev->pcidev) {
+      info.domain  = pci_domain_nr(dev->pcidev->bus);
+      info.bus     = dev->pcidev->bus->number;
+      info.devfn   = dev->pcidev->devfn;
+    }
+    info.layout  = ((struct TprQueues*)dev->amem)->layout;
+    info.qsize   = dev->qsize;
+    info.irqmode = dev->irqmode;
+    info.nvec    = dev->virt ? 0 : 1;
+    if (copy_to_user((void*)arg, &info, min_t(size_t, _IOC_SIZE(cmd), sizeof(info))))
+      return -EFAULT;
+    return SUCCESS;
+  }
+  case _IOC_NR(TPR_IOC_SETRP): {
+    long long rp, zcpos = 0;
+    int zc;
+    if (shared->idx < 0)
+      return(ERROR);
+    if (copy_from_user(&rp, (void*)arg, sizeof(rp)))
+      return -EFAULT;
+    zc = dev->zcq && shared->minor >= 0;
+    if (zc)
+      zcpos = tpr_zc_pos(dev, shared->minor, rp);
+    spin_lock_bh(&dev->lock);
+    tpr_client_rp(dev, shared, rp);
+    if (zc) {
+      shared->zcpos = zcpos;
+      shared->zc    = 1;
+      tpr_zc_update(dev);
+    }
+    spin_unlock_bh(&dev->lock);
+    //  Buffers may now be returned to the card
+    if (zc && READ_ONCE(dev->zcHeld))
+      tasklet_schedule(&dev->dma_task);
+    return SUCCESS;
+  }
+  case _IOC_NR(TPR_IOC_SETFILTER): {
+    struct TprFilter f;
+    int i;
+    if (shared->idx < 0 || shared->minor < 0)
+      return(ERROR);
+    if (copy_from_user(&f, (void*)arg, sizeof(f)))
+      return -EFAULT;
+    if (f.version != TPR_FILTER_VERSION || f.nmatch > TPR_FILTER_MATCHES ||
+        (f.pidmod && f.pidrem >= f.pidmod))
+      return -EINVAL;
+    for( i=0; i<f.nmatch; i++)
+      if (f.match[i].word >= (EVENT_MSGSZ>>2))
+        return -EINVAL;
+    spin_lock_bh(&dev->lock);
+    shared->filter = f;
+    tpr_set_filtered(dev, shared);
+    spin_unlock_bh(&dev->lock);
+    //  Move a reader asleep on the other waitqueue
+    wake_up(&dev->waitq[shared->minor]);
+    wake_up(&shared->fwaitq);
+    return SUCCESS;
+  }
+  case _IOC_NR(TPR_IOC_SETBATCH): {
+    struct TprBatch b;
+    if (shared->idx < 0 || shared->minor < 0)
+      return(ERROR);
+    if (copy_from_user(&b, (void*)arg, sizeof(b)))
+      return -EFAULT;
+    if (b.version != TPR_BATCH_VERSION)
+      return -EINVAL;
+    spin_lock_bh(&dev->lock);
+    shared->bcount = max(b.count, 1U);
+    shared->busec  = b.usec;
+    tpr_set_filtered(dev, shared);
+    spin_unlock_bh(&dev->lock);
+    wake_up(&dev->waitq[shared->minor]);
+    wake_up(&shared->fwaitq);
+    return SUCCESS;
+  }
+  case _IOC_NR(TPR_IOC_CLIENT): {
+    struct TprClient cl;
+    long long *wp;
+    if (shared->idx < 0)
+      return(ERROR);
+    memset(&cl, 0, sizeof(cl));
+    cl.version = TPR_CLIENT_VERSION;
+    cl.size    = sizeof(cl);
+    cl.minor   = shared->minor;
+    wp = tpr_client_wp(dev, shared, &cl.depth);
+    spin_lock_bh(&dev->lock);
+    cl.wp      = smp_load_acquire(wp);
+    cl.rp      = shared->rpset ? shared->rp : -1;
+    cl.lag     = shared->rpset ? cl.wp - cl.rp : 0;
+    cl.maxlag  = shared->maxlag;
+    cl.lost    = shared->lost;
+    spin_unlock_bh(&dev->lock);
+    cl.drops   = READ_ONCE(shared->minor < 0 ?
+                           ((struct TprQueues*)dev->amem)->bsadrops :
+                           ((struct TprQueues*)dev->amem)->drops[shared->minor]);
+    if (copy_to_user((void*)arg, &cl, min_t(size_t, _IOC_SIZE(cmd), sizeof(cl))))
+      return -EFAULT;
+    return SUCCESS;
+  }
+  default:
+    break;
+  }
 
   return(ERROR);
 }
@@ -412,142 +1031,634 @@ long tpr_compat_ioctl(struct file *file, unsigned int cmd, unsigned long arg) {
 }
 #endif
 
+// Publish new data for a minor.
+// Clients compare gen[] against the last value they consumed, so one store
+// serves every client of the minor.  Only take the waitqueue lock when
+// somebody is actually asleep; busy-polling readers cost nothing.
+static void tpr_wake(struct tpr_dev* dev, int m, u64 now)
+{
+  int sleepers;
+
+  WRITE_ONCE(dev->wake_ns[m], now);
+  smp_store_release(&dev->gen[m], dev->gen[m]+1);
+#ifdef TPRDEBUG2
+  printk(KERN_WARNING "%s: gen for %d == %lu\n", MOD_NAME, m, dev->gen[m]);
+#endif
+  sleepers = wq_has_sleeper(&dev->waitq[m]);
+  trace_tpr_wake(TPR_CARD(dev), m, dev->gen[m], sleepers);
+  if (sleepers)
+    wake_up(&dev->waitq[m]);
+}
+
+// Hand the n oldest drained buffers back to the card.  The card takes one
+// descriptor per rxFree write, so a batch is a single barrier followed by
+// a burst of posted writes.
+static void tpr_rx_return(struct tpr_dev* dev, unsigned n)
+{
+  struct TprReg* reg = (struct TprReg*)dev->bar[0].reg;
+  unsigned       i   = dev->rxHeld;
+
+  //  Our accesses to the buffers complete before the card may refill them
+  mb();
+  if (dev->virt)
+    atomic_add(n, &dev->vposted);
+  while (n--) {
+    reg->rxFree[0] = dev->rxBuffer[i].dma;
+    if (++i == dev->rxCount)
+      i = 0;
+  }
+  dev->rxHeld = i;
+}
+
+// Return held DMA buffers to the card, oldest first, once every zero-copy
+// client has moved past them.  Past zc_hold, the card's need for free
+// buffers wins over a slow client.
+static void tpr_zc_recycle(struct tpr_dev* dev)
+{
+  long long        zcmin = READ_ONCE(dev->zcmin), lastgwp = 0;
+  u64              hold = clamp(zc_hold, 0, (int)dev->rxCount-1);
+  unsigned         i = dev->rxHeld, n = 0;
+
+  while (n < dev->zcHeld) {
+    if (dev->rxBuffer[i].lastgwp > zcmin) {
+      if (dev->zcHeld - n <= hold)
+        break;
+      dev->zcForced++;
+    }
+    lastgwp = dev->rxBuffer[i].lastgwp;
+    n++;
+    if (++i == dev->rxCount)
+      i = 0;
+  }
+  if (!n)
+    return;
+
+  //  Readers must see the buffers retired before the card can overwrite them
+  smp_store_release(&dev->zcq->freewp, lastgwp);
+  dev->zcHeld -= n;
+  tpr_rx_return(dev, n);
+}
+
+// Allocate and map the queue window.  Chunks are physically contiguous and
+// split into pages that user mappings reference one by one.
+static int tpr_qalloc(struct tpr_dev* dev)
+{
+  unsigned long i = 0, j, n = dev->qsize >> PAGE_SHIFT;
+  int order = TPR_QORDER;
+  struct page* page;
+
+  dev->qpages = vzalloc_node(n * sizeof(struct page*), dev->node);
+  if (!dev->qpages)
+    return -ENOMEM;
+
+  while (i < n) {
+    while (order && (1UL<<order) > n-i)
+      order--;
+    page = alloc_pages_node(dev->node, GFP_KERNEL | __GFP_ZERO | __GFP_NOWARN, order);
+    if (!page) {
+      if (!order)
+        goto fail;
+      order--;
+      continue;
+    }
+    split_page(page, order);
+    for( j=0; j<(1UL<<order); j++)
+      dev->qpages[i++] = page + j;
+  }
+  dev->qnpages = n;
+
+  dev->amem = vmap(dev->qpages, n, VM_MAP, PAGE_KERNEL);
+  if (dev->amem)
+    return 0;
+
+ fail:
+  while (i)
+    __free_page(dev->qpages[--i]);
+  vfree(dev->qpages);
+  dev->qpages = NULL;
+  return -ENOMEM;
+}
+
+static void tpr_qfree(struct tpr_dev* dev)
+{
+  unsigned long i;
+
+  if (!dev->qpages)
+    return;
+  vunmap(dev->amem);
+  for( i=0; i<dev->qnpages; i++)
+    __free_page(dev->qpages[i]);
+  vfree(dev->qpages);
+  dev->qpages = NULL;
+  dev->amem   = NULL;
+}
+
+// Allocate the RX ring in as few coherent chunks as the allocator allows,
+// from 2MB down to one buffer, so the card sees few IOMMU mappings.
+static int tpr_rxalloc(struct tpr_dev* dev)
+{
+  size_t   chunk = max_t(size_t, PAGE_SIZE << TPR_QORDER, dev->rxSize);
+  unsigned idx = 0, n, j;
+
+  dev->rxBuffer = vzalloc_node(dev->rxCount * sizeof(struct RxBuffer), dev->node);
+  dev->rxChunk  = vzalloc_node(dev->rxCount * sizeof(struct RxChunk), dev->node);
+  dev->rxNChunk = 0;
+  if (!dev->rxBuffer || !dev->rxChunk)
+    return -ENOMEM;
+
+  while (idx < dev->rxCount) {
+    struct RxChunk* c = &dev->rxChunk[dev->rxNChunk];
+    n = min_t(unsigned, chunk / dev->rxSize, dev->rxCount - idx);
+    c->size   = (size_t)n * dev->rxSize;
+    c->dma    = 0;
+    if (dev->virt)
+      c->buffer = vmalloc_node(c->size, dev->node);
+    else
+      c->buffer = dma_alloc_coherent(&dev->pcidev->dev, c->size, &c->dma,
+                                     GFP_DMA32|GFP_KERNEL|__GFP_NOWARN);
+    if (!c->buffer) {
+      if (chunk == dev->rxSize)
+        return -ENOMEM;
+      chunk >>= 1;
+      continue;
+    }
+    dev->rxNChunk++;
+    for( j=0; j<n; j++, idx++) {
+      dev->rxBuffer[idx].buffer  = (unchar*)c->buffer + (size_t)j*dev->rxSize;
+      dev->rxBuffer[idx].dma     = c->dma + (dma_addr_t)j*dev->rxSize;
+      dev->rxBuffer[idx].lastgwp = 0;
+    }
+  }
+  return 0;
+}
+
+static void tpr_rxfree(struct tpr_dev* dev)
+{
+  unsigned i;
+
+  for( i=0; i<dev->rxNChunk; i++)
+    if (dev->virt)
+      vfree(dev->rxChunk[i].buffer);
+    else
+      dma_free_coherent(&dev->pcidev->dev, dev->rxChunk[i].size,
+                        dev->rxChunk[i].buffer, dev->rxChunk[i].dma);
+  dev->rxNChunk = 0;
+  vfree(dev->rxChunk);
+  vfree(dev->rxBuffer);
+  dev->rxChunk  = NULL;
+  dev->rxBuffer = NULL;
+}
+
+// Map [offset, offset+vsize) of the queue window now, so clients never
+// fault on it.  vm_insert_page takes a reference on each page, as
+// tpr_vmfault does, so a mapping that outlives the device keeps its pages
+// rather than reading them back from the allocator after tpr_qfree.
+static int tpr_qremap(struct tpr_dev* dev, struct vm_area_struct* vma,
+                      unsigned long offset, unsigned long vsize)
+{
+  unsigned long first = offset >> PAGE_SHIFT, n = vsize >> PAGE_SHIFT, i;
+
+  for( i=0; i<n; i++)
+    if (vm_insert_page(vma, vma->vm_start + (i << PAGE_SHIFT), dev->qpages[first+i]))
+      return -EAGAIN;
+  return 0;
+}
+
+// Map [offset, offset+vsize) of the zero-copy window, which lies over the
+// coherent RX chunks back to back.  dma_mmap_coherent maps a whole vma from
+// one allocation, so narrow the vma to each chunk's share in turn.  The
+// pages are never refcounted; the mapping is VM_PFNMAP, so tpr_zcunmap
+// must zap it before the chunks are freed.
+static int tpr_zcremap(struct tpr_dev* dev, struct vm_area_struct* vma,
+                       unsigned long offset, unsigned long vsize)
+{
+  unsigned long start = vma->vm_start, end = vma->vm_end, pgoff = vma->vm_pgoff;
+  unsigned long cbase = 0, lo, hi;
+  unsigned      i;
+  int           result = 0;
+
+  for( i=0; i<dev->rxNChunk && !result; cbase += dev->rxChunk[i++].size) {
+    lo = max(offset, cbase);
+    hi = min(offset + vsize, cbase + dev->rxChunk[i].size);
+    if (lo >= hi)
+      continue;
+    vma->vm_start = start + (lo - offset);
+    vma->vm_end   = start + (hi - offset);
+    vma->vm_pgoff = (lo - cbase) >> PAGE_SHIFT;
+    result = dma_mmap_coherent(&dev->pcidev->dev, vma, dev->rxChunk[i].buffer,
+                               dev->rxChunk[i].dma, dev->rxChunk[i].size);
+  }
+  vma->vm_start = start;
+  vma->vm_end   = end;
+  vma->vm_pgoff = pgoff;
+  return result ? -EAGAIN : 0;
+}
+
+// Zap every client's mapping of the zero-copy window before the RX chunks
+// go back to the allocator; a file with a mapping is still open, so its
+// client is on one of the lists.  A later touch of the window faults and
+// gets SIGBUS from tpr_vmfault.
+static void tpr_zcunmap(struct tpr_dev* dev)
+{
+  struct shared_tpr *shared;
+  struct inode **inodes;
+  unsigned n = 0, i, j;
+
+  inodes = kmalloc_array(OPEN_SHARES, sizeof(*inodes), GFP_KERNEL);
+  if (!inodes)
+    return;
+
+  spin_lock_bh(&dev->lock);
+  for( i=0; i<=MOD_SHARED; i++)
+    for( shared = i<MOD_SHARED ? dev->shared[i] : dev->bsa; shared; shared=shared->next) {
+      for( j=0; j<n && inodes[j] != shared->mapping->host; j++)
+        ;
+      if (j < n || n == OPEN_SHARES)
+        continue;
+      if ((inodes[n] = igrab(shared->mapping->host)))
+        n++;
+    }
+  spin_unlock_bh(&dev->lock);
+
+  for( i=0; i<n; i++) {
+    unmap_mapping_range(inodes[i]->i_mapping, TPR_ZC_MMAP_OFFSET,
+                        (loff_t)dev->rxCount*dev->rxSize, 1);
+    iput(inodes[i]);
+  }
+  kfree(inodes);
+}
+
+// 64-bit field i of a BSA message; they follow the tag word, unaligned
+static inline u64 tpr_msg64(const u32* msg, int i)
+{
+  return msg[1+2*i] | ((u64)msg[2+2*i] << 32);
+}
+
+// Append a record for each EDEF named in any of the three masks of a BSA
+// message, under the same protocol as the other rings.
+static void tpr_edef_append(struct tpr_dev* dev, struct TprQueues* tprq,
+                            u64 pulseId, u64 timeStamp,
+                            u64 m0, u32 s0, u64 m1, u32 s1, u64 m2, u32 s2)
+{
+  u64                 m = m0 | m1 | m2;
+  struct TprEdefRec*  rec;
+  int                 e;
+
+  if (!m)
+    return;
+  smp_wmb();
+  for( e=0; m; e++) {
+    if (!(m & (1ULL<<e)))
+      continue;
+    m &= ~(1ULL<<e);
+    rec = &dev->edefq[e*(dev->edefqmask+1) + (tprq->edefwp[e] & dev->edefqmask)];
+    rec->pulseId   = pulseId;
+    rec->timeStamp = timeStamp;
+    rec->status    = (m0 & (1ULL<<e) ? s0 : 0) |
+                     (m1 & (1ULL<<e) ? s1 : 0) |
+                     (m2 & (1ULL<<e) ? s2 : 0);
+    rec->seq       = tprq->edefwp[e];
+    tpr_publish(&tprq->edefwp[e], tprq->edefwp[e]+1);
+  }
+}
+
+// Publish the clock model under its sequence count
+static void tpr_clk_publish(struct tpr_dev* dev, struct TprQueues* tprq,
+                            u64 latmean, u64 latmax, u64 n)
+{
+  struct tpr_clkfit* f = &dev->clk;
+  struct TprClock*   c = &tprq->clock;
+
+  WRITE_ONCE(c->seq, c->seq+1);
+  smp_wmb();
+  WRITE_ONCE(c->tsc0,     f->atsc);
+  WRITE_ONCE(c->ts0,      f->ats);
+  WRITE_ONCE(c->mult,     f->mult);
+  WRITE_ONCE(c->latmean,  latmean);
+  WRITE_ONCE(c->latmax,   latmax);
+  WRITE_ONCE(c->nsamples, n);
+  WRITE_ONCE(c->updates,  c->updates+1);
+  WRITE_ONCE(c->valid,    1);
+  smp_store_release(&c->seq, c->seq+1);
+}
+
+// (dts << 32) / dtsc, the slope in 32.32 ns per cycle.  Intervals past
+// about 4.29s would overflow the shift, so drop low bits of both first.
+static u64 tpr_clk_slope(u64 dts, u64 dtsc)
+{
+  unsigned s = (dts >> 32) ? fls64(dts >> 32) : 0;
+  return div64_u64((dts >> s) << 32, max_t(u64, dtsc >> s, 1));
+}
+
+// Feed one event to the clock fit.  Within a period the event handled
+// soonest after its timestamp, judged against the current line, becomes
+// the next anchor; the slope between anchors, smoothed, is the rate.
+static void tpr_clk_sample(struct tpr_dev* dev, struct TprQueues* tprq,
+                           u64 tsc, const u32* msg)
+{
+  struct tpr_clkfit* f = &dev->clk;
+  u64  ts     = (u64)msg[5]*NSEC_PER_SEC + msg[4];
+  u64  period = (u64)clamp(clk_ms, 10, 2000)*NSEC_PER_MSEC;
+  s64  d;
+
+  //  Start over on the first event, or if time stepped back or stalled
+  if (f->state == 0 || ts <= f->ats || ts - f->wstart > 4*period) {
+    f->state  = 1;
+    f->atsc   = f->wtsc = tsc;
+    f->ats    = f->wts  = f->wstart = ts;
+    f->wmin   = f->wmax = f->wsum = 0;
+    f->wn     = 0;
+    return;
+  }
+
+  if (f->state == 1) {
+    //  No rate yet: take the slope to the latest event once a period is in
+    if (ts - f->ats < period || tsc <= f->atsc)
+      return;
+    f->mult   = tpr_clk_slope(ts - f->ats, tsc - f->atsc);
+    f->cpn    = div64_u64(~0ULL, f->mult);
+    f->atsc   = f->wtsc = tsc;
+    f->ats    = f->wts  = f->wstart = ts;
+    f->state  = 2;
+    return;
+  }
+
+  d = (s64)(tsc - f->atsc - mul_u64_u64_shr(ts - f->ats, f->cpn, 32));
+  if (!f->wn || d < f->wmin) {
+    f->wmin = d;
+    f->wtsc = tsc;
+    f->wts  = ts;
+  }
+  if (!f->wn || d > f->wmax)
+    f->wmax = d;
+  f->wsum += d;
+  f->wn++;
+
+  if (ts - f->wstart >= period && f->wtsc > f->atsc && f->wts > f->ats) {
+    u64 mult = tpr_clk_slope(f->wts - f->ats, f->wtsc - f->atsc);
+    u64 n    = f->wn;
+    f->mult  = f->mult + div_s64((s64)(mult - f->mult), 8);
+    f->cpn   = div64_u64(~0ULL, f->mult);
+    f->atsc  = f->wtsc;
+    f->ats   = f->wts;
+    tpr_clk_publish(dev, tprq,
+                    mul_u64_u64_shr(div64_u64(f->wsum - f->wmin*(s64)n, n), f->mult, 32),
+                    mul_u64_u64_shr(f->wmax - f->wmin, f->mult, 32), n);
+    f->wstart = ts;
+    f->wmin   = f->wmax = f->wsum = 0;
+    f->wn     = 0;
+  }
+}
+
+// Kernel side of the decode hooks, defined below
+struct tpr_decode;
+static inline void tpr_decode_msg   (struct tpr_decode* d, const __u32* msg, u64 tsc);
+static inline void tpr_decode_bsa   (struct tpr_decode* d, const __u32* msg, __u32 tag);
+static inline void tpr_decode_event (struct tpr_decode* d, const __u32* msg);
+static inline u32  tpr_decode_filter(struct tpr_decode* d, __u32* msg, u32 mch);
+static inline void tpr_decode_error (struct tpr_decode* d, const __u32* msg);
+static inline void tpr_decode_hold  (struct tpr_decode* d, long long gwp);
+
+#define TPR_DECODE_TSC()  __rdtsc()
+#define TPR_DECODE_MSG(d, msg, tsc)         tpr_decode_msg(d, msg, tsc)
+#define TPR_DECODE_BSA(d, msg, tag)         tpr_decode_bsa(d, msg, tag)
+#define TPR_DECODE_EVENT(d, msg)            tpr_decode_event(d, msg)
+#define TPR_DECODE_FILTER(d, msg, mch)      tpr_decode_filter(d, msg, mch)
+#define TPR_DECODE_EVENT_DONE(d, msg, tsc)  tpr_clk_sample(d->ctx, d->tprq, tsc, msg)
+#define TPR_DECODE_ERROR(d, msg)            tpr_decode_error(d, msg)
+#define TPR_DECODE_HOLD(d, gwp)             tpr_decode_hold(d, gwp)
+
+#include "tpr_decode.h"
+
+static inline void tpr_decode_msg(struct tpr_decode* d, const __u32* msg, u64 tsc)
+{
+  struct tpr_dev* dev = d->ctx;
+  this_cpu_inc(dev->stats->dmaCount);
+  trace_tpr_msg(TPR_CARD(dev), msg[0], tsc);
+}
+
+static inline void tpr_decode_bsa(struct tpr_decode* d, const __u32* msg, __u32 tag)
+{
+  struct tpr_dev* dev = d->ctx;
+  if (tag == BSACNTL_TAG) {
+#ifdef TPRDEBUG2
+    printk(KERN_WARNING "%s: BSA_CTRL %lld\n", MOD_NAME, d->tprq->bsawp);
+#endif
+    this_cpu_inc(dev->stats->dmaBsaCtrl);
+    //  pulseId, timeStamp, init, minor, major
+    tpr_edef_append(dev, d->tprq, tpr_msg64(msg,0), tpr_msg64(msg,1),
+                    tpr_msg64(msg,2), TPR_EDEF_INIT,
+                    tpr_msg64(msg,3), TPR_EDEF_MINOR,
+                    tpr_msg64(msg,4), TPR_EDEF_MAJOR);
+  }
+  else {
+#ifdef TPRDEBUG2
+    printk(KERN_WARNING "%s: BSA_EVNT %lld\n", MOD_NAME, d->tprq->bsawp);
+#endif
+    this_cpu_inc(dev->stats->dmaBsaChan);
+    //  pulseId, active, avgdone, timeStamp, update
+    tpr_edef_append(dev, d->tprq, tpr_msg64(msg,0), tpr_msg64(msg,3),
+                    tpr_msg64(msg,1), TPR_EDEF_ACTIVE,
+                    tpr_msg64(msg,2), TPR_EDEF_AVGDONE,
+                    tpr_msg64(msg,4), TPR_EDEF_UPDATE);
+  }
+}
+
+static inline void tpr_decode_event(struct tpr_decode* d, const __u32* msg)
+{
+  struct tpr_dev* dev = d->ctx;
+#ifdef TPRDEBUG2
+  printk(KERN_WARNING "%s: EVENT\n", MOD_NAME);
+#endif
+  this_cpu_inc(dev->stats->dmaEvent);
+}
+
+static inline u32 tpr_decode_filter(struct tpr_decode* d, __u32* msg, u32 mch)
+{
+  struct tpr_dev* dev = d->ctx;
+  u32 fmask = mch & READ_ONCE(dev->fmask);
+  return fmask ? tpr_filter(dev, fmask, msg, d->now) : 0;
+}
+
+static inline void tpr_decode_error(struct tpr_decode* d, const __u32* msg)
+{
+  struct tpr_dev* dev = d->ctx;
+
+  if (((msg[0]>>16)&0xf) != EVENT_TAG) {
+    printk(KERN_WARNING  "%s: handle unknown msg %08x:%08x\n", MOD_NAME, msg[0], msg[1]);
+    return;
+  }
+  if ((this_cpu_read(dev->stats->dmaErrors)%1024)<4) {
+    struct TprCounters c;
+    tpr_counters(dev, &c);
+    printk(KERN_WARNING  "%s: unexpected event dma size %08x(%08x)...truncating.\n", MOD_NAME, EVENT_MSGSZ,(msg[1]<<2)+8);
+    printk(KERN_WARNING  "  dptr %p  buffer %p  next %p\n", 
+           msg, d->base, dev->rxBuffer[(d->buffer+1) % dev->rxCount].buffer);
+    printk(KERN_WARNING  "  dmaCount %llu  dmaEvent %llu  dmaErrors %llu\n",
+           c.dmaCount, c.dmaEvent, c.dmaErrors);
+  }
+  this_cpu_inc(dev->stats->dmaErrors);
+}
+
+// Hold the buffer until the readers are done with it; tpr_zc_recycle
+// returns it to the card
+static inline void tpr_decode_hold(struct tpr_decode* d, long long gwp)
+{
+  struct tpr_dev* dev = d->ctx;
+  dev->rxBuffer[d->buffer].lastgwp = gwp;
+  dev->zcHeld++;
+}
+
 // Bottom half of IRQ Handler
+//
+//  Drains at most dma_budget buffers per pass.  If the budget is exhausted
+//  the tasklet is rescheduled to yield to other softirqs.  If anything was
+//  drained, poll_timer runs the next pass after poll_us with the IRQ still
+//  disabled.  Only a pass that finds nothing re-enables the IRQ.
+//
+//  Publication protocol.  The tasklet is the only writer of the queue
+//  window and readers map it read-only, so they never take a lock or make
+//  a syscall to read it.  For every message the writer
+//    1. issues smp_wmb(), ordering the previous publications before any
+//       slot is overwritten,
+//    2. fills the slots: the allq/chnq/bsaq entry or zero-copy descriptor,
+//       and the allrp index of each channel,
+//    3. publishes with smp_store_release(), allwp[] first, then gwp (or
+//       bsawp, then the edefwp[] of the EDEF records it adds).
+//  A reader
+//    1. load-acquires a write pointer wp and takes slots rp < wp,
+//    2. copies the slot out of the window,
+//    3. issues an acquire fence and reloads the write pointer(s),
+//    4. keeps the copy only if wp - rp < depth (and gwp - g < allqdepth
+//       for the entry an allrp index g points at).
+//  A reader that saw any store to the slot's next use also sees the write
+//  pointer published before it (writer step 1 pairs with reader step 3),
+//  so the check rejects torn copies.  Any number of readers may follow the
+//  same channel.  The zero-copy layout adds freewp, published before a
+//  buffer goes back to the card.  software/app/tprqueue.hh implements the
+//  reader side.
+//
 static void tpr_handle_dma(unsigned long arg)
 {
   struct tpr_dev* dev = &gDevices[arg];
   struct TprQueues* tprq = dev->amem;
 
   struct RxBuffer*  next;
-  __u32*            dptr;
-  __u32             mtyp, ich, mch, wmask=0;
-  __u64             tsc;
-  struct TprEntry  *pEntry;
-
-  next = dev->rxPend;
+  struct tpr_decode d;
+  unsigned          pend, owed=0, batch;
+  __u32             ich, wmask, fwmask;
+  int               budget, nbuf=0, polled;
+  u64               t0 = ktime_get_ns(), tw, irq_ns;
+
+  budget = dma_budget > 0 ? dma_budget : dev->rxCount;
+  batch  = clamp(rx_batch, 1, (int)dev->rxCount);
+  polled = dev->polling;
+  dev->polling = 0;
+
+  irq_ns = xchg(&dev->irq_ns, 0);
+  if (irq_ns)
+    tpr_lat(dev, TPR_LAT_IRQ2BH, t0 - irq_ns);
+
+  memset(&d, 0, sizeof(d));
+  d.ctx      = dev;
+  d.tprq     = tprq;
+  d.allq     = dev->allq;
+  d.bsaq     = dev->bsaq;
+  d.allrp    = dev->allrp;
+  d.chnq     = dev->chnq;
+  d.zcq      = dev->zcq;
+  d.allqmask = dev->allqmask;
+  d.bsaqmask = dev->bsaqmask;
+  d.chnqmask = dev->chnqmask;
+  d.now      = t0;
+
+  pend = dev->rxPend;
+  trace_tpr_dma_start(TPR_CARD(dev), polled, pend);
 
   //  Check the "dma done" bit.
-  while (test_and_clear_bit(31, (volatile unsigned long*)next->buffer)) {
+  while (nbuf < budget &&
+         test_and_clear_bit(31, (volatile unsigned long*)dev->rxBuffer[pend].buffer)) {
 
-    dptr = (__u32*)next->buffer;
+    next = &dev->rxBuffer[pend];
 
-    while( ((dptr[0]>>16)&0xf) != END_TAG ) {
+    nbuf++;
+    write_seqcount_begin(&dev->qseq);
 
-      dev->dmaCount++;
-      tsc = __rdtsc();
+    d.buffer = pend;
+    d.base   = next->buffer;
+    tpr_decode_buffer(&d, (__u32*)next->buffer);
+    write_seqcount_end(&dev->qseq);
 
-      //  Check if a drop preceded us
-      if ( dptr[0] & (0x808<<20)) {
-        //  How to propagate this?
-        //  Write a drop message to all channels?
-        tprq->fifofull = 1;  // ??
-      }
+    if (++pend == dev->rxCount)
+      pend = 0;
 
-      //  Check the message type
-      mtyp = (dptr[0]>>16)&0xf;
-      switch (mtyp) {
-      case BSACNTL_TAG:
-#ifdef TPRDEBUG2
-          printk(KERN_WARNING "%s: BSA_CTRL %lld\n", MOD_NAME, tprq->bsawp);
-#endif
-          dev->dmaBsaCtrl++;
-          wmask = wmask | (1 << (MOD_SHARED+1));
-          pEntry = &tprq->bsaq[tprq->bsawp & (MAX_TPR_BSAQ-1)];
-          memcpy(pEntry, dptr, BSACNTL_MSGSZ);
-          pEntry->fifo_tsc = tsc;
-          tprq->bsawp++;
-          dptr += BSACNTL_MSGSZ>>2;
-          break;
-      case BSAEVNT_TAG:
-#ifdef TPRDEBUG2
-          printk(KERN_WARNING "%s: BSA_EVNT %lld\n", MOD_NAME, tprq->bsawp);
-#endif
-          dev->dmaBsaChan++;
-          wmask = wmask | (1 << (MOD_SHARED+1));
-          pEntry = &tprq->bsaq[tprq->bsawp & (MAX_TPR_BSAQ-1)];
-          memcpy(pEntry, dptr, BSAEVNT_MSGSZ);
-          pEntry->fifo_tsc = tsc;
-          tprq->bsawp++;
-          dptr += BSAEVNT_MSGSZ>>2;
-          break;
-      case EVENT_TAG:
-#ifdef TPRDEBUG2
-          printk(KERN_WARNING "%s: EVENT\n", MOD_NAME);
-#endif
-          dev->dmaEvent++;
-          mch = (dptr[0]>>0)&((1<<MOD_SHARED)-1);
-          if (((dptr[1]<<2)+8)!=EVENT_MSGSZ) {
-            if ((dev->dmaErrors%1024)<4) {
-              printk(KERN_WARNING  "%s: unexpected event dma size %08x(%08x)...truncating.\n", MOD_NAME, EVENT_MSGSZ,(dptr[1]<<2)+8);
-              printk(KERN_WARNING  "  dptr %p  buffer %p  next %p\n", 
-                     dptr, next->buffer, ((struct RxBuffer*)next->lh.next)->buffer);
-              printk(KERN_WARNING  "  dmaCount %u  dmaEvent %u  dmaErrors %u\n",
-                     dev->dmaCount, dev->dmaEvent, dev->dmaErrors);
-            }
-            dev->dmaErrors++;
-
-            dptr[0] = END_TAG << 16;  // terminate
-            break;
-          }
-          pEntry = &tprq->allq[tprq->gwp & (MAX_TPR_ALLQ-1)];
-          memcpy(pEntry, dptr, EVENT_MSGSZ);
-          pEntry->fifo_tsc = tsc;
-          dptr += EVENT_MSGSZ>>2;
-          wmask = wmask | mch;
-          for( ich=0; mch; ich++) {
-              if (mch & (1<<ich)) {
-                  mch = mch & ~(1<<ich);
-                  tprq->allrp[ich].idx[tprq->allwp[ich] & (MAX_TPR_ALLQ-1)] = tprq->gwp;
-                  tprq->allwp[ich]++;
-              }
-          }
-          tprq->gwp++;
-          break;
-      default:
-          printk(KERN_WARNING  "%s: handle unknown msg %08x:%08x\n", MOD_NAME, dptr[0], dptr[1]);
-          dptr[0] = END_TAG << 16;  // terminate
-          break;
-      }
+    //  Queue the dma buffers back to the hardware, a batch at a time
+    if (!dev->zcq && ++owed == batch) {
+      tpr_rx_return(dev, owed);
+      owed = 0;
     }
-
-    //  Queue the dma buffer back to the hardware
-    ((struct TprReg*)dev->bar[0].reg)->rxFree[0] = next->dma;
-
-    next = (struct RxBuffer*)next->lh.next;
   }
 
-  dev->rxPend = next;
+  dev->rxPend = pend;
+  wmask  = d.wmask;
+  fwmask = d.fwmask;
+  if (owed)
+    tpr_rx_return(dev, owed);
+  if (dev->zcq)
+    tpr_zc_recycle(dev);
 
   //  Wake the apps
-  for( ich=0; ich<MOD_SHARED; ich++) {
-    if ((wmask&(1<<ich)) && dev->shared[ich]) {
-      struct shared_tpr *shared;
-      for (shared = dev->shared[ich]; shared; shared = shared->next) {
-        set_bit(0, (volatile unsigned long*)&shared->pendingirq);
-#ifdef TPRDEBUG2
-        printk(KERN_WARNING "%s: set pendingirq for %d == %ld\n", MOD_NAME, ich, shared->pendingirq);
-#endif
-        wake_up(&shared->waitq);
-      }
+  if (wmask) {
+    tw = ktime_get_ns();
+    tpr_lat(dev, TPR_LAT_BH2WAKE, tw - t0);
+
+    for( ich=0; ich<MOD_SHARED; ich++) {
+      if (wmask&(1<<ich))
+        tpr_wake(dev, ich, tw);
     }
+
+    if (wmask & (1 << (MOD_SHARED+1)))
+      tpr_wake(dev, MOD_SHARED+1, tw);
+
+    if (fwmask)
+      tpr_filter_wake(dev, tw);
   }
 
-  if (wmask & (1 << (MOD_SHARED+1))) {
-      struct shared_tpr *shared;
-      for (shared = dev->bsa; shared; shared = shared->next) {
-        set_bit(0, (volatile unsigned long*)&shared->pendingirq);
-#ifdef TPRDEBUG2
-        printk(KERN_WARNING "%s: set pendingirq for %d == %ld\n", MOD_NAME, ich, shared->pendingirq);
-#endif
-        wake_up(&shared->waitq);
-      }
+  trace_tpr_dma_end(TPR_CARD(dev), nbuf, d.nmsg, wmask, tprq->gwp);
+
+  this_cpu_inc(dev->stats->bhCount);
+  this_cpu_add(dev->stats->bhBuffers, nbuf);
+  if (polled) {
+    this_cpu_inc(dev->stats->pollCount);
+    this_cpu_add(dev->stats->pollBuffers, nbuf);
   }
 
-  //  Enable the interrupt
-  if (dev->minors) {
+  if (nbuf == budget) {
+    //  More is likely pending; yield and come back
+    this_cpu_inc(dev->stats->bhBudget);
+    tasklet_schedule(&dev->dma_task);
+  }
+  else if (nbuf && poll_us > 0 && READ_ONCE(dev->minors)) {
+    //  Traffic is sustained; poll again without taking an interrupt
+    dev->polling = 1;
+    hrtimer_start(&dev->poll_timer, ns_to_ktime((u64)poll_us*NSEC_PER_USEC), HRTIMER_MODE_REL);
+  }
+  else if (READ_ONCE(dev->minors)) {
+    //  Idle; enable the interrupt
+    if (polled && !nbuf)
+      this_cpu_inc(dev->stats->pollIdle);
     ((struct TprReg*)dev->bar[0].reg)->irqControl = 1;
-    dev->irqEnable++;
+    this_cpu_inc(dev->stats->irqEnable);
   }
+
+  this_cpu_add(dev->stats->bhTime, ktime_get_ns() - t0);
+}
+
+static enum hrtimer_restart tpr_poll_timer(struct hrtimer *timer)
+{
+  struct tpr_dev* dev = container_of(timer, struct tpr_dev, poll_timer);
+  tasklet_schedule(&dev->dma_task);
+  return HRTIMER_NORESTART;
 }
 
 
@@ -567,12 +1678,14 @@ irqreturn_t tpr_intr(int irq, void *dev_id) {
   //  wakeup the tasklet that copies the dma data into the sw queues
   //
   stat = ((struct TprReg*)dev->bar[0].reg)->irqStatus;
+  trace_tpr_irq(TPR_CARD(dev), stat, 0);
   if ( (stat & 1) != 0 ) {
+    WRITE_ONCE(dev->irq_ns, ktime_get_ns());
     // Disable interrupts
-    dev->irqCount++;
-    dev->irqDisable++;
+    this_cpu_inc(dev->stats->irqCount);
+    this_cpu_inc(dev->stats->irqDisable);
     if (((struct TprReg*)dev->bar[0].reg)->irqControl==0)
-      dev->irqNoReq++;
+      this_cpu_inc(dev->stats->irqNoReq);
     ((struct TprReg*)dev->bar[0].reg)->irqControl = 0;
     tasklet_schedule(&dev->dma_task);
     handled=1;
@@ -583,56 +1696,297 @@ irqreturn_t tpr_intr(int irq, void *dev_id) {
   return(IRQ_HANDLED);
 }
 
+// MSI/MSI-X handler.  The vector belongs to this card alone, so there is
+// no need to read irqStatus across the link to see whether it is ours.
+irqreturn_t tpr_msi_intr(int irq, void *dev_id) {
+  struct tpr_dev *dev = (struct tpr_dev *)dev_id;
+
+  trace_tpr_irq(TPR_CARD(dev), 0, 1);
+  WRITE_ONCE(dev->irq_ns, ktime_get_ns());
+  // Disable interrupts
+  this_cpu_inc(dev->stats->irqCount);
+  this_cpu_inc(dev->stats->irqDisable);
+  ((struct TprReg*)dev->bar[0].reg)->irqControl = 0;
+  tasklet_schedule(&dev->dma_task);
+
+  return(IRQ_HANDLED);
+}
+
+// debugfs statistics
+static int tpr_stats_show(struct seq_file *s, void *unused)
+{
+  struct tpr_dev* dev = s->private;
+
+  struct TprStats st;
+  int i;
+
+  tpr_snapshot(dev, &st);
+  seq_printf(s, "irqEnable   %llu\n", st.counters.irqEnable);
+  seq_printf(s, "irqDisable  %llu\n", st.counters.irqDisable);
+  seq_printf(s, "irqCount    %llu\n", st.counters.irqCount);
+  seq_printf(s, "irqNoReq    %llu\n", st.counters.irqNoReq);
+  seq_printf(s, "dmaCount    %llu\n", st.counters.dmaCount);
+  seq_printf(s, "dmaEvent    %llu\n", st.counters.dmaEvent);
+  seq_printf(s, "dmaErrors   %llu\n", st.counters.dmaErrors);
+  seq_printf(s, "dmaBsaChan  %llu\n", st.counters.dmaBsaChan);
+  seq_printf(s, "dmaBsaCtrl  %llu\n", st.counters.dmaBsaCtrl);
+  seq_printf(s, "bhCount     %llu\n", st.counters.bhCount);
+  seq_printf(s, "bhBuffers   %llu\n", st.counters.bhBuffers);
+  seq_printf(s, "bhBudget    %llu\n", st.counters.bhBudget);
+  seq_printf(s, "bhTime      %llu ns\n", st.counters.bhTime);
+  seq_printf(s, "pollCount   %llu\n", st.counters.pollCount);
+  seq_printf(s, "pollBuffers %llu\n", st.counters.pollBuffers);
+  seq_printf(s, "pollIdle    %llu\n", st.counters.pollIdle);
+  seq_printf(s, "gwp         %lld\n", st.gwp);
+  seq_printf(s, "bsawp       %lld\n", st.bsawp);
+  seq_printf(s, "zcHeld      %llu\n", st.zcHeld);
+  seq_printf(s, "zcForced    %llu\n", st.zcForced);
+  if (dev->virt)
+    seq_printf(s, "vskipped    %llu\n", dev->vskipped);
+  for( i=0; i<MOD_SHARED; i++)
+    seq_printf(s, "allwp[%2d]   %lld\n", i, st.allwp[i]);
+  return 0;
+}
+
+static int tpr_stats_open(struct inode *inode, struct file *file)
+{
+  return single_open(file, tpr_stats_show, inode->i_private);
+}
+
+static const struct file_operations tpr_stats_fops = {
+  .owner   = THIS_MODULE,
+  .open    = tpr_stats_open,
+  .read    = seq_read,
+  .llseek  = seq_lseek,
+  .release = single_release,
+};
+
+// debugfs clients: read pointer and lag of each open channel or BSA file
+static int tpr_clients_show(struct seq_file *s, void *unused)
+{
+  struct tpr_dev* dev = s->private;
+  struct shared_tpr *shared;
+  unsigned depth;
+  long long wp;
+  int i;
+
+  seq_printf(s, "%5s %6s %8s %14s %10s %10s %10s\n",
+             "idx", "minor", "depth", "rp", "lag", "maxlag", "lost");
+  spin_lock_bh(&dev->lock);
+  for( i=0; i<OPEN_SHARES; i++) {
+    shared = &dev->all_shares[i];
+    if (!shared->parent)
+      continue;
+    wp = READ_ONCE(*tpr_client_wp(dev, shared, &depth));
+    if (shared->rpset)
+      seq_printf(s, "%5d %6d %8u %14lld %10lld %10lld %10lld\n", shared->idx, shared->minor,
+                 depth, shared->rp, wp - shared->rp, shared->maxlag, shared->lost);
+    else
+      seq_printf(s, "%5d %6d %8u %14s\n", shared->idx, shared->minor, depth, "-");
+  }
+  spin_unlock_bh(&dev->lock);
+  return 0;
+}
+
+static int tpr_clients_open(struct inode *inode, struct file *file)
+{
+  return single_open(file, tpr_clients_show, inode->i_private);
+}
+
+static const struct file_operations tpr_clients_fops = {
+  .owner   = THIS_MODULE,
+  .open    = tpr_clients_open,
+  .read    = seq_read,
+  .llseek  = seq_lseek,
+  .release = single_release,
+};
+
+// debugfs latency histograms.  Writing anything resets them.
+static const char* tpr_lat_names[TPR_LAT_STAGES] = { "irq2bh", "bh2wake", "wake2rd" };
+
+static int tpr_latency_show(struct seq_file *s, void *unused)
+{
+  struct tpr_dev* dev = s->private;
+  struct TprLatency lat;
+  int i, j;
+
+  tpr_latency(dev, &lat);
+  seq_printf(s, "%10s", "ns >=");
+  for( i=0; i<TPR_LAT_STAGES; i++)
+    seq_printf(s, " %12s", tpr_lat_names[i]);
+  seq_putc(s, '\n');
+  for( j=0; j<TPR_LAT_BINS; j++) {
+    seq_printf(s, "%10llu", 1ULL<<j);
+    for( i=0; i<TPR_LAT_STAGES; i++)
+      seq_printf(s, " %12llu", lat.bin[i][j]);
+    seq_putc(s, '\n');
+  }
+  return 0;
+}
+
+static int tpr_latency_open(struct inode *inode, struct file *file)
+{
+  return single_open(file, tpr_latency_show, inode->i_private);
+}
+
+static ssize_t tpr_latency_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
+{
+  struct tpr_dev* dev = ((struct seq_file*)file->private_data)->private;
+  tpr_latency_reset(dev);
+  return count;
+}
+
+static const struct file_operations tpr_latency_fops = {
+  .owner   = THIS_MODULE,
+  .open    = tpr_latency_open,
+  .read    = seq_read,
+  .write   = tpr_latency_write,
+  .llseek  = seq_lseek,
+  .release = single_release,
+};
+
 uint tpr_poll(struct file *filp, poll_table *wait ) {
-  struct shared_tpr *dev = (struct shared_tpr *)filp->private_data;
+  struct shared_tpr *shared = (struct shared_tpr *)filp->private_data;
+  struct tpr_dev *dev = shared->parent;
+  uint mask = 0;
+  unsigned depth;
+  long long *wp;
+
+  //  Filtered clients are not disturbed by every event on the minor
+  poll_wait(filp, tpr_client_wq(dev, shared), wait);
+
+  if (READ_ONCE(*tpr_client_gen(dev, shared)) != tpr_client_seen(shared))
+    mask = POLLIN | POLLRDNORM; // Readable
+
+  //  Falling behind: the client should catch up before it is lapped
+  if (shared->idx >= 0 && lag_warn > 0 && smp_load_acquire(&shared->rpset)) {
+    wp = tpr_client_wp(dev, shared, &depth);
+    if ((READ_ONCE(*wp) - READ_ONCE(shared->rp))*100 >= (long long)depth*lag_warn)
+      mask |= POLLPRI;
+  }
 
-  poll_wait(filp, &(dev->waitq), wait);
+  return(mask);
+}
 
-  if (dev->pendingirq & 1)
-    return(POLLIN | POLLRDNORM); // Readable
 
-  return(0);
+
+// Ring depth from a module parameter
+static unsigned tpr_depth(int depth)
+{
+  return roundup_pow_of_two(clamp(depth, 16, 1<<22));
 }
 
+// Lay out the queue window for the configured depths
+static void tpr_qgeometry(struct TprQueues* hdr, int layout, unsigned nbuffers, unsigned bufsize)
+{
+  unsigned long off = PAGE_ALIGN(sizeof(*hdr));
+
+  memset(hdr, 0, sizeof(*hdr));
+  hdr->magic     = TPR_QMAGIC;
+  hdr->version   = TPR_QVERSION;
+  hdr->hdrsize   = sizeof(*hdr);
+  hdr->layout    = layout;
+  hdr->nchan     = MOD_SHARED;
+  hdr->entrysize = sizeof(struct TprEntry);
+  hdr->allqdepth = tpr_depth(allq_depth);
+  hdr->bsaqdepth = tpr_depth(bsaq_depth);
+  hdr->chnqdepth = tpr_depth(chnq_depth);
+  hdr->edefqdepth = tpr_depth(edefq_depth);
+  hdr->nbuffers  = nbuffers;
+  hdr->bufsize   = bufsize;
+
+  hdr->bsaqoff = off;
+  off += PAGE_ALIGN(hdr->bsaqdepth * sizeof(struct TprEntry));
+  if (layout == TPR_QLAYOUT_INDEX) {
+    hdr->allqoff = off;
+    off += PAGE_ALIGN(hdr->allqdepth * sizeof(struct TprEntry));
+  }
+  if (layout != TPR_QLAYOUT_CHANNEL) {
+    hdr->allrpoff = off;
+    off += PAGE_ALIGN((unsigned long)MOD_SHARED * hdr->allqdepth * sizeof(long long));
+  }
+  if (layout == TPR_QLAYOUT_CHANNEL) {
+    hdr->chnqoff = off;
+    off += PAGE_ALIGN((unsigned long)MOD_SHARED * hdr->chnqdepth * sizeof(struct TprEntry));
+  }
+  if (layout == TPR_QLAYOUT_ZCOPY) {
+    hdr->zcqoff = off;
+    off += PAGE_ALIGN(sizeof(struct TprZcQueues) + hdr->allqdepth * sizeof(struct TprDesc));
+  }
+  hdr->edefqoff = off;
+  off += PAGE_ALIGN((unsigned long)TPR_EDEFS * hdr->edefqdepth * sizeof(struct TprEdefRec));
+  hdr->size = off;
+}
 
+// Apply and export an affinity hint for the card's IRQ; NULL clears it
+static void tpr_irq_affinity(struct tpr_dev* dev, const struct cpumask* mask)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 17, 0)
+  if (mask)
+    irq_set_affinity_and_hint(dev->irq, mask);
+  else
+    irq_update_affinity_hint(dev->irq, NULL);
+#else
+  irq_set_affinity_hint(dev->irq, mask);
+#endif
+}
 
-// Probe device
-int tpr_probe(struct pci_dev *pcidev, const struct pci_device_id *dev_id) {
-   int i, idx, res;
-   dev_t chrdev = 0;
-   struct tpr_dev* dev;
-   struct TprReg*  tprreg;
-   struct pci_device_id *id = (struct pci_device_id *) dev_id;
+// Release what tpr_dev_init allocated
+static void tpr_dev_free(struct tpr_dev* dev)
+{
+   free_percpu(dev->stats);
+   free_percpu(dev->lat);
+   dev->stats = NULL;
+   dev->lat   = NULL;
+   unregister_chrdev_region(MKDEV(dev->major,0), MOD_MINORS);
+   tpr_qfree(dev);
+}
 
-   printk(KERN_WARNING  MOD_NAME GITV);
+// Set up what a card and a virtual card share: the queue window, the
+// character device, the counters, the timers and the client tables.
+static int tpr_dev_init(struct tpr_dev* dev, int i)
+{
+   dev_t chrdev = 0;
+   struct TprQueues qhdr;
+   int res;
 
-   // We keep device instance number in id->driver_data
-   id->driver_data = -1;
+   dev->rxSize  = roundup_pow_of_two(clamp(rx_bufsize, 512, 65536));
+   dev->rxCount = clamp(rx_count, 16, NUMBER_OF_RX_BUFFERS);
 
-   // Find empty structure
-   for (i = 0; i < MAX_PCI_DEVICES; i++) {
-     if (gDevices[i].bar[0].baseHdwr == 0) {
-       id->driver_data = i;
-       break;
-     }
+   // Zero-copy maps whole buffers as pages
+   if (zcopy && (dev->rxSize % PAGE_SIZE)) {
+     printk(KERN_WARNING  MOD_NAME ": zcopy needs rx_bufsize a multiple of PAGE_SIZE.  Copying events.\n");
+     zcopy = 0;
    }
 
-   // Overflow
-   if (id->driver_data < 0) {
-     printk(KERN_WARNING  "%s: Probe: Too Many Devices.\n", MOD_NAME);
-     return -EMFILE;
-   }
-   dev = &gDevices[id->driver_data];
+   // Size the window for the configured depths; the header goes first
+   tpr_qgeometry(&qhdr, zcopy ? TPR_QLAYOUT_ZCOPY :
+                 qlayout == TPR_QLAYOUT_CHANNEL ? TPR_QLAYOUT_CHANNEL : TPR_QLAYOUT_INDEX,
+                 dev->rxCount, dev->rxSize);
+   dev->qsize = qhdr.size;
 
-   dev->qmem = (void *)vmalloc(sizeof(struct TprQueues) + PAGE_SIZE); // , GFP_KERNEL);
-   if (!dev->qmem) {
-     printk(KERN_WARNING  MOD_NAME ": could not allocate %lu.\n", sizeof(struct TprQueues) + PAGE_SIZE);
+   if (tpr_qalloc(dev)) {
+     printk(KERN_WARNING  MOD_NAME ": could not allocate %lu.\n", dev->qsize);
      return -ENOMEM;
    }
 
-   printk(KERN_WARNING  MOD_NAME ": Allocated %lu at %p.\n", sizeof(struct TprQueues) + PAGE_SIZE, dev->qmem);
-   memset(dev->qmem, 0, sizeof(struct TprQueues) + PAGE_SIZE);
-   dev->amem = (void *)((long)(dev->qmem + PAGE_SIZE - 1) & PAGE_MASK);
+   printk(KERN_WARNING  MOD_NAME ": Allocated %lu at %p.  Depths allq %u bsaq %u chnq %u.\n",
+          dev->qsize, dev->amem, qhdr.allqdepth, qhdr.bsaqdepth, qhdr.chnqdepth);
+   memcpy(dev->amem, &qhdr, sizeof(qhdr));
+   dev->bsaq  = qhdr.bsaqoff  ? dev->amem + qhdr.bsaqoff  : NULL;
+   dev->allq  = qhdr.allqoff  ? dev->amem + qhdr.allqoff  : NULL;
+   dev->allrp = qhdr.allrpoff ? dev->amem + qhdr.allrpoff : NULL;
+   dev->chnq  = qhdr.chnqoff  ? dev->amem + qhdr.chnqoff  : NULL;
+   dev->zcq   = qhdr.zcqoff   ? dev->amem + qhdr.zcqoff   : NULL;
+   dev->edefq = qhdr.edefqoff ? dev->amem + qhdr.edefqoff : NULL;
+   dev->allqmask = qhdr.allqdepth-1;
+   dev->bsaqmask = qhdr.bsaqdepth-1;
+   dev->chnqmask = qhdr.chnqdepth-1;
+   dev->edefqmask = qhdr.edefqdepth-1;
+   dev->zcmin    = LLONG_MAX;
+   dev->clk.state = 0;
+   dev->zcHeld   = 0;
+   dev->zcForced = 0;
    ((struct TprQueues*) dev->amem)->fifofull = 0xabadcafe;
 
    printk(KERN_WARNING  MOD_NAME ": amem = %p.\n", dev->amem);
@@ -641,6 +1995,7 @@ int tpr_probe(struct pci_dev *pcidev, const struct pci_device_id *dev_id) {
    res = alloc_chrdev_region(&chrdev, 0, MOD_MINORS, MOD_NAME);
    if (res < 0) {
      printk(KERN_WARNING  "%s: Probe: Cannot register char device\n", MOD_NAME);
+     tpr_qfree(dev);
      return res;
    }
 
@@ -654,32 +2009,22 @@ int tpr_probe(struct pci_dev *pcidev, const struct pci_device_id *dev_id) {
    dev->dma_task.func   = tpr_handle_dma;
    dev->dma_task.data   = i;
    dev->minors          = 0;
-   dev->irqEnable       = 0;
-   dev->irqDisable      = 0;
-   dev->irqCount        = 0;
-   dev->irqNoReq        = 0;
-   dev->dmaCount        = 0;
-   dev->dmaEvent        = 0;
-   dev->dmaErrors       = 0;
-   dev->dmaBsaChan      = 0;
-   dev->dmaBsaCtrl      = 0;
-
-   // Add device
-   if ( cdev_add(&dev->cdev, chrdev, MOD_MINORS) )
-     printk(KERN_WARNING  "%s: Probe: Error adding device Maj=%i\n", MOD_NAME, dev->major);
-
-   // Enable devices
-   if (pci_enable_device(pcidev)) {
-     printk(KERN_WARNING  "%s: Could not enable device \n", MOD_NAME);
-     return (ERROR);
+   dev->stats           = alloc_percpu(struct TprCounters);
+   dev->lat             = alloc_percpu(struct TprLatency);
+   if (!dev->stats || !dev->lat) {
+     printk(KERN_WARNING  MOD_NAME ": could not allocate counters.\n");
+     tpr_dev_free(dev);
+     return -ENOMEM;
    }
-
-   if (allocBar(&dev->bar[0], dev->major, pcidev, 0) == ERROR)
-     return (ERROR);
-
-   // Get IRQ from pci_dev structure.
-   dev->irq = pcidev->irq;
-   printk(KERN_WARNING  "%s: Init: IRQ %d Maj=%i\n", MOD_NAME, dev->irq, dev->major);
+   seqcount_init(&dev->qseq);
+   dev->irq_ns          = 0;
+   dev->polling         = 0;
+   hrtimer_init(&dev->poll_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+   dev->poll_timer.function = tpr_poll_timer;
+   hrtimer_init(&dev->batch_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+   dev->batch_timer.function = tpr_batch_timer;
+   dev->batch_task.func = tpr_batch_expire;
+   dev->batch_task.data = i;
 
    for( i = 0; i < OPEN_SHARES; i++) {
      if (i)
@@ -689,21 +2034,139 @@ int tpr_probe(struct pci_dev *pcidev, const struct pci_device_id *dev_id) {
      dev->all_shares[i].prev = NULL;   // The freelist is singly linked!
      dev->all_shares[i].parent = NULL;
      dev->all_shares[i].idx = i;
-     init_waitqueue_head(&dev->all_shares[i].waitq);
      spin_lock_init(&dev->all_shares[i].lock);
+     init_waitqueue_head(&dev->all_shares[i].fwaitq);
    }
    for( i = 0; i < MOD_SHARED; i++) {
      dev->shared[i] = NULL;
    }
+   for( i = 0; i < MOD_MINORS; i++) {
+     init_waitqueue_head(&dev->waitq[i]);
+     dev->gen[i] = 0;
+   }
    dev->bsa = NULL;
    spin_lock_init(&dev->lock);
    dev->freelist = &dev->all_shares[OPEN_SHARES-1];
 
    dev->master.parent = NULL;
    dev->master.idx    = -1;
-   init_waitqueue_head(&dev->master.waitq);
+   dev->master.minor  = MOD_SHARED;
    spin_lock_init     (&dev->master.lock);
 
+   return SUCCESS;
+}
+
+// Make the minors visible; last, once open and mmap have all they use
+static void tpr_dev_add(struct tpr_dev* dev)
+{
+   if ( cdev_add(&dev->cdev, MKDEV(dev->major, 0), MOD_MINORS) )
+     printk(KERN_WARNING  "%s: Probe: Error adding device Maj=%i\n", MOD_NAME, dev->major);
+}
+
+// Allocate the RX ring and hand all of it to the card
+static int tpr_rxstart(struct tpr_dev* dev)
+{
+   int idx;
+
+   // Init RX Buffers
+   if (tpr_rxalloc(dev)) {
+     printk(KERN_WARNING "%s: Init: unable to allocate %u rx buffers of %u. Maj=%i\n",
+            MOD_NAME, dev->rxCount, dev->rxSize, dev->major);
+     return -ENOMEM;
+   }
+   printk(KERN_WARNING  MOD_NAME ": %u rx buffers of %u in %u chunks.\n",
+          dev->rxCount, dev->rxSize, dev->rxNChunk);
+
+   for ( idx=0; idx < dev->rxCount; idx++ )
+     clear_bit(31,(volatile unsigned long*)dev->rxBuffer[idx].buffer);
+
+   // Hand the whole ring to the card
+   dev->rxPend = 0;
+   dev->rxHeld = 0;
+   tpr_rx_return(dev, dev->rxCount);
+   return SUCCESS;
+}
+
+static void tpr_dev_debugfs(struct tpr_dev* dev, int i)
+{
+   if (tpr_debugfs) {
+     char name[8];
+     sprintf(name, MOD_NAME "%c", 'a' + i);
+     dev->debugfs = debugfs_create_dir(name, tpr_debugfs);
+     debugfs_create_file("stats", 0444, dev->debugfs, dev, &tpr_stats_fops);
+     debugfs_create_file("latency", 0644, dev->debugfs, dev, &tpr_latency_fops);
+     debugfs_create_file("clients", 0444, dev->debugfs, dev, &tpr_clients_fops);
+   }
+}
+
+// Probe device
+int tpr_probe(struct pci_dev *pcidev, const struct pci_device_id *dev_id) {
+   int i, res;
+   struct tpr_dev* dev;
+   struct TprReg*  tprreg;
+   struct pci_device_id *id = (struct pci_device_id *) dev_id;
+
+   printk(KERN_WARNING  MOD_NAME GITV);
+
+   // We keep device instance number in id->driver_data
+   id->driver_data = -1;
+
+   // Find empty structure
+   for (i = 0; i < MAX_PCI_DEVICES; i++) {
+     if (gDevices[i].bar[0].baseHdwr == 0 && !gDevices[i].virt) {
+       id->driver_data = i;
+       break;
+     }
+   }
+
+   // Overflow
+   if (id->driver_data < 0) {
+     printk(KERN_WARNING  "%s: Probe: Too Many Devices.\n", MOD_NAME);
+     return -EMFILE;
+   }
+   dev = &gDevices[id->driver_data];
+   dev->pcidev = pcidev;
+   dev->node   = dev_to_node(&pcidev->dev);
+   printk(KERN_WARNING  MOD_NAME ": NUMA node %d.\n", dev->node);
+
+   res = tpr_dev_init(dev, i);
+   if (res)
+     return res;
+
+   // Enable devices
+   if (pci_enable_device(pcidev)) {
+     printk(KERN_WARNING  "%s: Could not enable device \n", MOD_NAME);
+     return (ERROR);
+   }
+
+   if (allocBar(&dev->bar[0], dev->major, pcidev, 0) == ERROR)
+     return (ERROR);
+
+   // MSI writes and RX DMA both need bus mastering
+   pci_set_master(pcidev);
+
+   // Prefer a message-signaled vector of our own; fall back to the shared line.
+   // The card raises a single interrupt for the RX DMA queue, which carries
+   // events and BSA alike, so one vector is all there is to steer.
+   dev->irqmode = TPR_IRQ_INTX;
+   dev->irq     = pcidev->irq;
+   if (msi) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 8, 0)
+     if (pci_alloc_irq_vectors(pcidev, 1, 1, PCI_IRQ_MSIX | PCI_IRQ_MSI) > 0) {
+       dev->irq     = pci_irq_vector(pcidev, 0);
+       dev->irqmode = pcidev->msix_enabled ? TPR_IRQ_MSIX : TPR_IRQ_MSI;
+     }
+#else
+     if (!pci_enable_msi(pcidev)) {
+       dev->irq     = pcidev->irq;
+       dev->irqmode = TPR_IRQ_MSI;
+     }
+#endif
+   }
+   printk(KERN_WARNING  "%s: Init: IRQ %d (%s) Maj=%i\n", MOD_NAME, dev->irq,
+          dev->irqmode == TPR_IRQ_MSIX ? "MSI-X" : dev->irqmode == TPR_IRQ_MSI ? "MSI" : "INTx",
+          dev->major);
+
    // Device initialization
    tprreg = (struct TprReg* )(dev->bar[0].reg);
 
@@ -719,52 +2182,41 @@ int tpr_probe(struct pci_dev *pcidev, const struct pci_device_id *dev_id) {
    }
 
    // FIFO size for detecting DMA complete
-   tprreg->rxFifoSize = NUMBER_OF_RX_BUFFERS-1;
-   tprreg->rxMaxFrame = BUF_SIZE | (1<<31);
-
-   // Init RX Buffers
-   dev->rxBuffer   = (struct RxBuffer **) vmalloc(NUMBER_OF_RX_BUFFERS * sizeof(struct RxBuffer *));
-
-   for ( idx=0; idx < NUMBER_OF_RX_BUFFERS; idx++ ) {
-     dev->rxBuffer[idx] = (struct RxBuffer *) vmalloc(sizeof(struct RxBuffer ));
-     if ((dev->rxBuffer[idx]->buffer = dma_alloc_coherent(&pcidev->dev, BUF_SIZE, &(dev->rxBuffer[idx]->dma),GFP_DMA32|GFP_KERNEL)) == NULL ) {
-       printk(KERN_WARNING "%s: Init: unable to allocate rx buffer [%d/%d]. Maj=%i\n",
-              MOD_NAME, idx, NUMBER_OF_RX_BUFFERS, dev->major);
-       break;
-     }
+   tprreg->rxFifoSize = dev->rxCount-1;
+   tprreg->rxMaxFrame = dev->rxSize | (1<<31);
 
-     clear_bit(31,(volatile unsigned long*)dev->rxBuffer[idx]->buffer);
-
-     // Add to RX queue
-     if (idx == 0) {
-       dev->rxFree = dev->rxBuffer[idx];
-       INIT_LIST_HEAD(&dev->rxFree->lh);
-     }
-     else
-       list_add_tail( &dev->rxBuffer[idx]->lh,
-                      &dev->rxFree->lh );
-     tprreg->rxFree[0] = dev->rxBuffer[idx]->dma;
-   }
-
-   dev->rxPend = dev->rxFree;
+   res = tpr_rxstart(dev);
+   if (res)
+     return res;
 
    // Request IRQ from OS.
+   if (dev->irqmode != TPR_IRQ_INTX)
+     res = request_irq(dev->irq, tpr_msi_intr, 0, MOD_NAME, dev);
+   else
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 24)
-   if (request_irq(dev->irq, (irq_handler_t)tpr_intr, SA_SHIRQ, MOD_NAME, dev) < 0) {
+     res = request_irq(dev->irq, (irq_handler_t)tpr_intr, SA_SHIRQ, MOD_NAME, dev);
 #else
-   if (request_irq(dev->irq, tpr_intr, SA_SHIRQ, MOD_NAME, dev) < 0) {
+     res = request_irq(dev->irq, tpr_intr, SA_SHIRQ, MOD_NAME, dev);
 #endif
+   if (res < 0) {
      printk(KERN_WARNING  "%s: Open: Unable to allocate IRQ. Maj=%i", MOD_NAME, dev->major);
      return (ERROR);
    }
 
+   // Keep the IRQ, and so the bottom half and poll timer, next to the queues
+   if (dev->node != NUMA_NO_NODE)
+     tpr_irq_affinity(dev, cpumask_of_node(dev->node));
+
+   tpr_dev_debugfs(dev, (int)id->driver_data);
+   tpr_dev_add(dev);
+
    printk(KERN_ALERT "%s: Init: Driver is loaded. Maj=%i. Bus=%x\n", MOD_NAME,dev->major,pcidev->bus->number);
    return SUCCESS;
 }
 
 
 void tpr_remove(struct pci_dev *pcidev) {
-   int  i, idx;
+   int  i;
    struct tpr_dev *dev = NULL;
    struct TprReg*  tprreg;
 
@@ -783,26 +2235,39 @@ void tpr_remove(struct pci_dev *pcidev) {
    else {
      unsigned long flags;
 
+     // At this point, there might be an IRQ/tasklet running.  The tasklets
+     // take dev->lock themselves, so only flag the teardown under it: stop
+     // the tasklet from re-arming the poll timer or the interrupt.
+     tprreg = (struct TprReg*)dev->bar[0].reg;
      spin_lock_irqsave(&dev->lock, flags);
-     // At this point, there might be an IRQ/tasklet running.  We're blocking
-     // another IRQ from coming though.
+     WRITE_ONCE(dev->minors, 0);
+     tprreg->irqControl = 0;
+     spin_unlock_irqrestore(&dev->lock, flags);
 
-     // Release IRQ first, so we don't call tpr_intr any more!
+     // Release IRQ, so we don't call tpr_intr any more!
+     tpr_irq_affinity(dev, NULL);
      free_irq(dev->irq, dev);
 
      // At this point, we might have had an IRQ, so the tasklet might be scheduled.
      // We won't get another one past this though.
+     // A pass already running may re-arm the poll timer before it sees
+     // minors clear; one scheduled by that timer will not.
+     tasklet_kill(&dev->dma_task);
+     hrtimer_cancel(&dev->poll_timer);
      tasklet_kill(&dev->dma_task);
+     // batch_task no longer re-arms batch_timer, so once the timer is
+     // cancelled, nothing schedules batch_task again.
+     hrtimer_cancel(&dev->batch_timer);
+     tasklet_kill(&dev->batch_task);
 
-     // No more tasklet operations now.  And if we get an IRQ, it won't be routed
-     // correctly anyway.
+     // No more tasklet operations now.
 
-     // Turn off the interrupts!
-     tprreg = (struct TprReg*)dev->bar[0].reg;
-     tprreg->irqControl = 0;
-
-     // We should be finished now.
-     spin_unlock_irqrestore(&dev->lock, flags);
+     if (dev->irqmode != TPR_IRQ_INTX)
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 8, 0)
+       pci_free_irq_vectors(pcidev);
+#else
+       pci_disable_msi(pcidev);
+#endif
 
      //  Clear the registers
      for( i=0; i<RO_CHANNELS; i++)
@@ -813,17 +2278,13 @@ void tpr_remove(struct pci_dev *pcidev) {
      //  Free all rx buffers awaiting read.
      tprreg->rxMaxFrame = 0;
 
-     //  Free the rx buffer memory.
-     for ( idx=0; idx < NUMBER_OF_RX_BUFFERS; idx++ ) {
-       if (dev->rxBuffer[idx]->dma != 0) {
-         dma_free_coherent( &pcidev->dev, BUF_SIZE, dev->rxBuffer[idx]->buffer, dev->rxBuffer[idx]->dma);
-         if (dev->rxBuffer[idx]) {
-           vfree(dev->rxBuffer[idx]);
-         }
-       }
-     }
-     vfree(dev->rxBuffer);
-     vfree(dev->qmem);
+     //  Free the rx buffer memory, once no client maps it.
+     if (dev->zcq)
+       tpr_zcunmap(dev);
+     tpr_rxfree(dev);
+     tpr_qfree(dev);
+     free_percpu(dev->stats);
+     free_percpu(dev->lat);
 
      // Unmap
      iounmap(dev->bar[0].reg);
@@ -831,6 +2292,9 @@ void tpr_remove(struct pci_dev *pcidev) {
      // Release memory region
      release_mem_region(dev->bar[0].baseHdwr, dev->bar[0].baseLen);
 
+     debugfs_remove_recursive(dev->debugfs);
+     dev->debugfs = NULL;
+
      // Unregister Device Driver
      cdev_del(&dev->cdev);
      unregister_chrdev_region(MKDEV(dev->major,0), MOD_MINORS);
@@ -860,18 +2324,46 @@ int tpr_mmap(struct file *filp, struct vm_area_struct *vma)
               (unsigned int) vsize, (unsigned int) shared->parent->bar[0].baseLen, shared->parent->major);
        return -EINVAL;
      }
+     //  A virtual card's registers are plain memory
+     if (shared->parent->virt)
+       return remap_vmalloc_range(vma, shared->parent->bar[0].reg, vma->vm_pgoff);
      physical = ((unsigned long) shared->parent->bar[0].baseHdwr) + offset;
      result = io_remap_pfn_range(vma, vma->vm_start, physical >> PAGE_SHIFT,
                                  vsize, vma->vm_page_prot);
      if (result) return -EAGAIN;
    }
+   else if (offset >= TPR_ZC_MMAP_OFFSET) {
+     //  DMA buffers; the card owns them, so readers only look
+     if (!shared->parent->zcq ||
+         offset - TPR_ZC_MMAP_OFFSET + vsize > (unsigned long)shared->parent->rxCount*shared->parent->rxSize) {
+       printk(KERN_WARNING "%s: Mmap: mmap offset %08x vsize %08x, no zero-copy buffers there. Maj=%i\n", MOD_NAME,
+              (unsigned int) offset, (unsigned int) vsize, shared->parent->major);
+       return -EINVAL;
+     }
+     if (vma->vm_flags & VM_WRITE)
+       return -EPERM;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+     vm_flags_clear(vma, VM_MAYWRITE);
+#else
+     vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+     //  A virtual card's buffers are vmalloc pages, handled by tpr_vmfault
+     if (!shared->parent->virt) {
+       result = tpr_zcremap(shared->parent, vma, offset - TPR_ZC_MMAP_OFFSET, vsize);
+       if (result) return result;
+     }
+   }
    else {
-     if (vsize > TPR_SH_MEM_WINDOW) {
-       printk(KERN_WARNING "%s: Mmap: mmap vsize %08x, TPR_SH_MEM_WINDOW %08x. Maj=%i\n", MOD_NAME,
-              (unsigned int) vsize, (unsigned int)TPR_SH_MEM_WINDOW, shared->parent->major);
+     if (offset + vsize > shared->parent->qsize) {
+       printk(KERN_WARNING "%s: Mmap: mmap offset %08x vsize %08x, queue window %08x. Maj=%i\n", MOD_NAME,
+              (unsigned int) offset, (unsigned int) vsize, (unsigned int) shared->parent->qsize, shared->parent->major);
        return -EINVAL;
      }
-     /* Handled by tpr_vmfault */
+     if (qprefault) {
+       result = tpr_qremap(shared->parent, vma, offset, vsize);
+       if (result) return result;
+     }
+     /* Otherwise handled by tpr_vmfault */
    }
 
    vma->vm_ops = &tpr_vmops;
@@ -912,10 +2404,21 @@ int tpr_vmfault(struct vm_area_struct* vma,
   struct tpr_dev* dev = vma->vm_private_data;
 #endif
   void* pageptr;
+  unsigned long offset = vmf->pgoff << PAGE_SHIFT;
+
+  if (offset >= TPR_ZC_MMAP_OFFSET) {
+    //  Only a virtual card's buffers are faulted in, and only until they
+    //  are freed; tpr_zcremap maps the rest
+    if (!dev->virt || !dev->rxBuffer)
+      return VM_FAULT_SIGBUS;
+    offset -= TPR_ZC_MMAP_OFFSET;
+    pageptr = dev->rxBuffer[offset / dev->rxSize].buffer + (offset % dev->rxSize);
+    vmf->page = vmalloc_to_page(pageptr);
+    get_page(vmf->page);
+    return SUCCESS;
+  }
 
-  pageptr = dev->amem + (vmf->pgoff << PAGE_SHIFT);
-
-  vmf->page = vmalloc_to_page(pageptr);
+  vmf->page = dev->qpages[vmf->pgoff];
 
   get_page(vmf->page);
 
@@ -950,23 +2453,279 @@ int allocBar(struct bar_dev* minor, int major, struct pci_dev* pcidev, int bar)
    return SUCCESS;
 }
 
+//
+//  Virtual card.  vtimer fills the RX ring the way the card does: events
+//  at vrate carrying the pulse ID, the wall clock time and the channels
+//  enabled for DMA whose rate divides the pulse ID (929kHz, 71kHz, 10kHz,
+//  1kHz, 100Hz, 10Hz, 1Hz over the 14 channels), with a BSA control and
+//  event message for EDEFs 0-3 every vbsa pulses.  A buffer is closed every
+//  vtick_us and when full, and the bottom half is scheduled as by an MSI
+//  whenever the driver has the interrupt enabled.  With no buffer to fill
+//  a pulse is lost and the next message flags the drop, as on the card.
+//
+#define TPR_VEDEFS  0xfULL
+#define TPR_VBURST  4      // ticks of pulses a timer call may catch up
+
+static const unsigned tpr_vperiod[] = { 1, 13, 91, 910, 9100, 91000, 910000 };
+
+static inline void tpr_vput64(__u32* msg, int i, u64 v)
+{
+  msg[1+2*i] = (u32)v;
+  msg[2+2*i] = (u32)(v >> 32);
+}
+
+// Hand a filled buffer to the driver
+static void tpr_vclose(struct tpr_dev* dev, __u32* p)
+{
+  p[0] = END_TAG << 16;
+  smp_wmb();
+  set_bit(31, (volatile unsigned long*)dev->rxBuffer[dev->vwp].buffer);
+  atomic_dec(&dev->vposted);
+  if (++dev->vwp == dev->rxCount)
+    dev->vwp = 0;
+}
+
+static enum hrtimer_restart tpr_vtimer(struct hrtimer* timer)
+{
+  struct tpr_dev* dev = container_of(timer, struct tpr_dev, vtimer);
+  struct TprReg*  reg = (struct TprReg*)dev->bar[0].reg;
+  u64             now = ktime_get_ns(), real = ktime_get_real_ns() - now;
+  u64             period = div_u64(NSEC_PER_SEC, clamp(vrate, 1, 929000));
+  u64             burst = (u64)TPR_VBURST*clamp(vtick_us, 10, 100000)*NSEC_PER_USEC;
+  u64             t, nbsa, skip;
+  __u32          *p = NULL, *end = NULL, drop, mch, ch, rem, ns;
+  u32             enabled = 0;
+
+  for( ch=0; ch<MOD_SHARED; ch++)
+    if (reg->channel[ch].control & (1<<2))
+      enabled |= 1<<ch;
+
+  //  Far behind (a stall, or the rate changed): skip to the last
+  //  TPR_VBURST ticks, so hardirq time stays bounded, and flag the drop
+  if ((s64)(now - dev->vnext) > (s64)burst) {
+    skip = div64_u64(now - dev->vnext - burst, period);
+    dev->vnext   += skip*period;
+    dev->vpulse  += skip;
+    dev->vskipped += skip;
+    dev->vdrop    = 1;
+  }
+
+  for( ; (s64)(now - dev->vnext) >= 0; dev->vnext += period, dev->vpulse++) {
+    mch = 0;
+    for( ch=0; ch<MOD_SHARED; ch++) {
+      div_u64_rem(dev->vpulse, tpr_vperiod[ch%7], &rem);
+      if (!rem)
+        mch |= 1<<ch;
+    }
+    mch &= enabled;
+    if (vbsa > 0)
+      div_u64_rem(dev->vpulse, vbsa, &rem);
+    else
+      rem = 1;
+    if (!mch && rem)
+      continue;
+
+    if (!p) {
+      if (!atomic_read(&dev->vposted)) {
+        dev->vdrop = 1;
+        continue;
+      }
+      p   = (__u32*)dev->rxBuffer[dev->vwp].buffer;
+      end = p + dev->rxSize/4 - 1;
+    }
+
+    drop = dev->vdrop ? (0x8<<20) : 0;
+    dev->vdrop = 0;
+    t  = dev->vnext + real;
+    t  = (div_u64_rem(t, NSEC_PER_SEC, &ns) << 32) | ns;
+
+    if (!rem) {
+      nbsa = div_u64(dev->vpulse, vbsa);
+      //  pulseId, timeStamp, init, minor, major
+      p[0] = (BSACNTL_TAG << 16) | drop;
+      tpr_vput64(p, 0, dev->vpulse);
+      tpr_vput64(p, 1, t);
+      tpr_vput64(p, 2, nbsa == 0 ? TPR_VEDEFS : 0);
+      tpr_vput64(p, 3, 0);
+      tpr_vput64(p, 4, 0);
+      p += BSACNTL_MSGSZ>>2;
+      //  pulseId, active, avgdone, timeStamp, update
+      div_u64_rem(nbsa, 100, &rem);
+      p[0] = BSAEVNT_TAG << 16;
+      tpr_vput64(p, 0, dev->vpulse);
+      tpr_vput64(p, 1, TPR_VEDEFS);
+      tpr_vput64(p, 2, rem == 99 ? TPR_VEDEFS : 0);
+      tpr_vput64(p, 3, t);
+      tpr_vput64(p, 4, rem == 99 ? TPR_VEDEFS : 0);
+      p += BSAEVNT_MSGSZ>>2;
+      drop = 0;
+    }
+
+    if (mch) {
+      memset(p, 0, EVENT_MSGSZ);
+      p[0] = (EVENT_TAG << 16) | drop | mch;
+      p[1] = (EVENT_MSGSZ-8)>>2;
+      p[2] = (u32)dev->vpulse;
+      p[3] = (u32)(dev->vpulse >> 32);
+      p[4] = (u32)t;
+      p[5] = (u32)(t >> 32);
+      p += EVENT_MSGSZ>>2;
+    }
+
+    if (p + ((EVENT_MSGSZ+BSACNTL_MSGSZ+BSAEVNT_MSGSZ)>>2) > end) {
+      tpr_vclose(dev, p);
+      p = NULL;
+    }
+  }
+  if (p)
+    tpr_vclose(dev, p);
+
+  //  Interrupt if anything awaits the driver
+  if (reg->irqControl &&
+      test_bit(31, (volatile unsigned long*)dev->rxBuffer[READ_ONCE(dev->rxPend)].buffer))
+    tpr_msi_intr(0, dev);
+
+  hrtimer_forward_now(timer, ns_to_ktime((u64)clamp(vtick_us, 10, 100000)*NSEC_PER_USEC));
+  return HRTIMER_RESTART;
+}
+
+// Create a virtual card in the first free slot
+static int tpr_vprobe(void)
+{
+  struct tpr_dev* dev = NULL;
+  int i, res;
+
+  for (i = 0; i < MAX_PCI_DEVICES; i++) {
+    if (gDevices[i].bar[0].baseHdwr == 0 && !gDevices[i].virt) {
+      dev = &gDevices[i];
+      break;
+    }
+  }
+  if (!dev) {
+    printk(KERN_WARNING  "%s: Virtual: Too Many Devices.\n", MOD_NAME);
+    return -EMFILE;
+  }
+
+  dev->virt   = 1;
+  dev->pcidev = NULL;
+  dev->node   = NUMA_NO_NODE;
+
+  res = tpr_dev_init(dev, i);
+  if (res)
+    goto fail_init;
+
+  //  Registers the tools may map and the driver may write
+  dev->bar[0].baseLen = PAGE_ALIGN(sizeof(struct TprReg));
+  dev->bar[0].reg     = vmalloc_user(dev->bar[0].baseLen);
+  if (!dev->bar[0].reg) {
+    res = -ENOMEM;
+    goto fail_reg;
+  }
+  dev->irqmode = TPR_IRQ_NONE;
+  dev->irq     = -1;
+
+  atomic_set(&dev->vposted, 0);
+  dev->vwp    = 0;
+  dev->vpulse = 0;
+  dev->vdrop  = 0;
+  dev->vskipped = 0;
+  res = tpr_rxstart(dev);
+  if (res)
+    goto fail_rx;
+
+  dev->vnext = ktime_get_ns();
+  hrtimer_init(&dev->vtimer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+  dev->vtimer.function = tpr_vtimer;
+  hrtimer_start(&dev->vtimer, ns_to_ktime((u64)vtick_us*NSEC_PER_USEC), HRTIMER_MODE_REL);
+
+  tpr_dev_debugfs(dev, i);
+  tpr_dev_add(dev);
+
+  printk(KERN_ALERT "%s: Init: Virtual card %c at %d Hz. Maj=%i\n", MOD_NAME,
+         'a' + i, vrate, dev->major);
+  return SUCCESS;
+
+ fail_rx:
+  tpr_rxfree(dev);
+  vfree(dev->bar[0].reg);
+  dev->bar[0].reg = NULL;
+ fail_reg:
+  tpr_dev_free(dev);
+ fail_init:
+  dev->virt = 0;
+  return res;
+}
+
+static void tpr_vremove(struct tpr_dev* dev)
+{
+  unsigned long flags;
+
+  //  As tpr_remove: flag the teardown under the lock, wait outside it
+  spin_lock_irqsave(&dev->lock, flags);
+  WRITE_ONCE(dev->minors, 0);
+  ((struct TprReg*)dev->bar[0].reg)->irqControl = 0;
+  spin_unlock_irqrestore(&dev->lock, flags);
+
+  hrtimer_cancel(&dev->vtimer);
+  tasklet_kill(&dev->dma_task);
+  hrtimer_cancel(&dev->poll_timer);
+  tasklet_kill(&dev->dma_task);
+  hrtimer_cancel(&dev->batch_timer);
+  tasklet_kill(&dev->batch_task);
+
+  debugfs_remove_recursive(dev->debugfs);
+  dev->debugfs = NULL;
+  cdev_del(&dev->cdev);
+
+  if (dev->zcq)
+    tpr_zcunmap(dev);
+  tpr_rxfree(dev);
+  vfree(dev->bar[0].reg);
+  dev->bar[0].reg = NULL;
+  tpr_dev_free(dev);
+  dev->virt = 0;
+  printk(KERN_ALERT "%s: Remove: Virtual card is unloaded. Maj=%i\n", MOD_NAME, dev->major);
+}
+
  // Init Kernel Module
 int tpr_init(void) {
+   int i, res;
 
    /* Allocate and clear memory for all devices. */
    memset(gDevices, 0, sizeof(struct tpr_dev)*MAX_PCI_DEVICES);
 
    printk(KERN_WARNING "%s: Init: tpr init.\n", MOD_NAME);
 
+   tpr_debugfs = debugfs_create_dir(MOD_NAME, NULL);
+   if (IS_ERR_OR_NULL(tpr_debugfs))
+     tpr_debugfs = NULL;
+
    // Register driver
-   return(pci_register_driver(&tprDriver));
+   res = pci_register_driver(&tprDriver);
+   if (res)
+     return res;
+
+   for (i = 0; i < vdev; i++) {
+     res = tpr_vprobe();
+     if (res) {
+       printk(KERN_WARNING "%s: Init: virtual card %d of %d failed (%d).\n", MOD_NAME, i+1, vdev, res);
+       break;
+     }
+   }
+   return SUCCESS;
 }
 
 
  // Exit Kernel Module
 void tpr_exit(void) {
+   int i;
+
    printk(KERN_WARNING "%s: Exit: tpr exit.\n", MOD_NAME);
+   for (i = 0; i < MAX_PCI_DEVICES; i++)
+     if (gDevices[i].virt)
+       tpr_vremove(&gDevices[i]);
    pci_unregister_driver(&tprDriver);
+   debugfs_remove_recursive(tpr_debugfs);
 }
 
 
@@ -9,6 +9,12 @@
 #include<linux/spinlock.h>
 #include<linux/version.h>
 #include <linux/types.h>
+#include <linux/hrtimer.h>
+#include <linux/percpu.h>
+#include <linux/seqlock.h>
+#include <linux/ioctl.h>
+
+#include "tpr_queues.h"
 
 #define MOD_NAME "tpr"
 
@@ -16,15 +22,32 @@
 #define SUCCESS 0
 #define ERROR   -1
 
-// TPR message tags
-#define EVENT_TAG    0
-#define BSACNTL_TAG  1
-#define BSAEVNT_TAG  2
-#define END_TAG     15
+/*
+ * Which events wake a client (TPR_IOC_SETFILTER).  An event passes if its
+ * pulse ID is pidrem modulo pidmod and if all (TPR_FILTER_ANY: any) of
+ * match[] hold; the client is woken on every decimate-th event that
+ * passes.  Event codes and destinations are selected with match[] against
+ * the words of the event message that carry them.  All zero: no filter.
+ */
+#define TPR_FILTER_VERSION  1
+#define TPR_FILTER_MATCHES  4
+#define TPR_FILTER_ANY      1
+
+struct TprFilterMatch {
+  __u32             word;           /* Index of a 32-bit word of the event message */
+  __u32             mask;
+  __u32             value;          /* Holds if (word & mask) == value */
+};
 
-#define EVENT_MSGSZ    92
-#define BSACNTL_MSGSZ  44
-#define BSAEVNT_MSGSZ  44
+struct TprFilter {
+  __u32             version;        /* TPR_FILTER_VERSION */
+  __u32             flags;          /* TPR_FILTER_xxx */
+  __u32             decimate;       /* Wake on every Nth passing event, 0 or 1 for each */
+  __u32             pidmod;         /* 0 for any pulse ID */
+  __u32             pidrem;
+  __u32             nmatch;
+  struct TprFilterMatch match[TPR_FILTER_MATCHES];
+};
 
 /*
  * The data for a particular application on a shared device.
@@ -34,54 +57,147 @@ struct shared_tpr {
   int             idx;         /* The index of this structure in parent->all_shares. -1 for master. */
   int             minor;       /* The index of list containing this structure in parent->shared. -1 for bsa. */
   u32             irqmask;     /* The IRQs this client wants to see. */
-  unsigned long   pendingirq;  /* IRQs still to be delivered. */
-  wait_queue_head_t waitq;
+  unsigned long   gen;         /* Last parent->gen[] delivered to this client. */
+  struct address_space *mapping; /* Of the file, to zap its zero-copy mappings at removal. */
+  int             zc;          /* Set once the client reports its position with TPR_IOC_SETRP. */
+  long long       zcpos;       /* gwp below which the client no longer needs the DMA buffers. */
+  int             rpset;       /* Set once the client reports its read pointer with TPR_IOC_SETRP. */
+  long long       rp;          /* Last read pointer reported. */
+  long long       maxlag;      /* Largest write - read pointer seen at a report. */
+  long long       lost;        /* Entries overwritten before the client reached them. */
+  long long       lostto;      /*   counted up to here. */
+  int             filtered;    /* Woken through filter and fwaitq instead of parent->gen[]. */
+  struct TprFilter filter;
+  u32             fcount;      /* Passing events since the last wake-up, for decimation. */
+  int             fpending;    /* A wake-up is due at the end of the bottom half pass. */
+  unsigned long   fgen;        /* Bumped for each wake-up of a filtered client. */
+  unsigned long   fseen;       /* Last fgen delivered. */
+  u64             fwake_ns;    /* Time of the last fgen wake-up. */
+  long long       fwp;         /* Channel position of the entry that caused the wake-up. */
+  u32             bcount;      /* Wake once this many events have passed, */
+  u32             busec;       /*   or this long after the first of them. */
+  u32             npend;       /* Events passed since the last wake-up. */
+  u64             bdeadline;   /* ktime_get_ns() at which they must be delivered. */
+  wait_queue_head_t fwaitq;
   spinlock_t      lock;
   struct shared_tpr *next;
   struct shared_tpr *prev;
 };
 
+/*
+ * Interrupt handling and DMA counters.  Kept per-CPU in the driver so the
+ * bottom half never bounces a shared cache line.
+ */
+struct TprCounters {
+  __u64             irqEnable;      /* Interrupt handling counters */
+  __u64             irqDisable;
+  __u64             irqCount;
+  __u64             irqNoReq;
+  __u64             dmaCount;       /* Count DMA messages */
+  __u64             dmaEvent;
+  __u64             dmaErrors;
+  __u64             dmaBsaChan;
+  __u64             dmaBsaCtrl;
+  __u64             bhCount;        /* Bottom half passes */
+  __u64             bhBuffers;      /*   buffers drained */
+  __u64             bhBudget;       /*   passes that exhausted the budget */
+  __u64             bhTime;         /*   time spent, ns */
+  __u64             pollCount;      /* Passes run from poll_timer instead of an IRQ */
+  __u64             pollBuffers;    /*   buffers drained without an IRQ */
+  __u64             pollIdle;       /*   polls that found nothing and re-enabled the IRQ */
+};
+
 struct bar_dev {
   ulong             baseHdwr;
   ulong             baseLen;
   void*             reg;
 };
 
-#define MOD_SHARED 14
+// Fit of the host TSC against event timestamps, published as TprClock
+struct tpr_clkfit {
+  int               state;          /* 0 no anchor, 1 first period, 2 fitted */
+  u64               atsc, ats;      /* Anchor: least-delayed event of the last period */
+  u64               wtsc, wts;      /* Least-delayed event of this period so far */
+  s64               wmin, wmax;     /*   its delay and the largest, cycles past the model */
+  s64               wsum;
+  u64               wn;
+  u64               wstart;         /* ts of the first event of this period */
+  u64               mult;           /* ns per cycle, 32.32 */
+  u64               cpn;            /* cycles per ns, 32.32 */
+};
+
 #define OPEN_SHARES 256
+#define MOD_MINORS (MOD_SHARED+2)
 
 struct tpr_dev {
   int               major;
   struct cdev       cdev;
   struct fasync_struct* async_queue;
   int               irq;
+  int               irqmode;        /* TPR_IRQ_xxx */
+  struct pci_dev*   pcidev;
+  int               node;           /* NUMA node of the card; queues and buffers live there */
   int               vmas;
-  void*             qmem;
-  void*             amem;           /* Page-aligned memory for the queues. */
+  struct page**     qpages;         /* Pages of the queue window, physically contiguous in chunks */
+  unsigned long     qnpages;
+  void*             amem;           /* Kernel mapping of qpages. */
+  struct TprEntry*  allq;           /* Regions of the queue window, NULL if not in this layout. */
+  struct TprEntry*  bsaq;
+  long long*        allrp;          /*   MOD_SHARED rows of allqdepth */
+  struct TprEntry*  chnq;           /*   MOD_SHARED rows of chnqdepth */
+  struct TprZcQueues* zcq;
+  struct TprEdefRec* edefq;         /*   TPR_EDEFS rows of edefqdepth */
+  unsigned          allqmask;       /* depth-1 of each ring */
+  unsigned          bsaqmask;
+  unsigned          chnqmask;
+  unsigned          edefqmask;
+  long long         zcmin;          /* Lowest zcpos of the zero-copy clients */
+  u64               zcHeld;         /* Buffers held for zero-copy clients */
+  u64               zcForced;       /* Buffers recycled before every client was done with them */
+  unsigned long     qsize;          /* Size of the mmap-able queue window. */
   struct bar_dev    bar[1];
   struct shared_tpr master;
   struct shared_tpr all_shares[OPEN_SHARES];
-  struct shared_tpr *shared[MOD_SHARED];  /* DLL per minor.  Used to wake waitq's and track when opening the first or closing the last. */
-  struct shared_tpr *bsa;                 /* DLL. Used to wake waitq's. */
+  struct shared_tpr *shared[MOD_SHARED];  /* DLL per minor.  Used to track when opening the first or closing the last. */
+  struct shared_tpr *bsa;                 /* DLL. */
+  wait_queue_head_t waitq[MOD_MINORS];    /* One per minor, shared by all its clients. */
+  unsigned long     gen  [MOD_MINORS];    /* Bumped each time new data is published for the minor. */
+  int               nfilt[MOD_SHARED];    /* Filtered clients per minor */
+  u32               fmask;                /*   minors that have some */
   struct tasklet_struct dma_task;
+  struct hrtimer    poll_timer;     /* Re-runs dma_task while traffic is sustained */
+  struct hrtimer    batch_timer;    /* Next batch wake-up deadline of a client */
+  struct tasklet_struct batch_task; /*   delivered from here */
+  int               polling;        /* dma_task was scheduled by poll_timer */
+  struct dentry*    debugfs;
   spinlock_t        lock;
   struct shared_tpr *freelist;      /* SLL within all_shares. */
   uint              minors;
-  uint              irqEnable;      /* Interrupt handling counters */
-  uint              irqDisable;
-  uint              irqCount;
-  uint              irqNoReq;
-  uint              dmaCount;      /* Count DMA messages */
-  uint              dmaEvent;
-  uint              dmaErrors;
-  uint              dmaBsaChan;
-  uint              dmaBsaCtrl;
-
-  // One list, two pointers into the list
-  // The list needs only to be singly-linked
-  struct RxBuffer** rxBuffer;
-  struct RxBuffer*  rxFree;
-  struct RxBuffer*  rxPend;
+  struct TprCounters __percpu *stats; /* Interrupt and DMA counters, summed by tpr_snapshot */
+  seqcount_t        qseq;          /* Brackets queue pointer updates for a consistent snapshot */
+  struct TprLatency __percpu *lat;  /* Stage latency histograms */
+  u64               irq_ns;        /* Time of the IRQ that scheduled dma_task, 0 if polled */
+  u64               wake_ns[MOD_MINORS]; /* Time of the last wake-up per minor */
+  struct tpr_clkfit clk;
+
+  // One ring of buffers, in the order the card fills them
+  struct RxBuffer*  rxBuffer;       /* rxCount buffers of rxSize bytes */
+  unsigned          rxCount;
+  unsigned          rxSize;
+  unsigned          rxPend;         /* Next buffer the card completes */
+  unsigned          rxHeld;         /* Oldest buffer not yet returned to the hardware */
+  struct RxChunk*   rxChunk;        /* Coherent allocations behind rxBuffer */
+  unsigned          rxNChunk;
+
+  // Virtual card (vdev): no PCI device; vtimer fills the RX ring instead
+  int               virt;
+  struct hrtimer    vtimer;
+  atomic_t          vposted;        /* Buffers handed to it and not yet filled */
+  unsigned          vwp;            /* Next buffer it fills */
+  u64               vnext;          /* Time of its next pulse, ns */
+  u64               vpulse;         /*   and pulse ID */
+  int               vdrop;          /* It lost a pulse; flag the next message */
+  u64               vskipped;       /* Pulses skipped catching up after a stall */
 };
 
 // Max number of devices to support
@@ -90,45 +206,140 @@ struct tpr_dev {
 // Global Variable
 struct tpr_dev gDevices[MAX_PCI_DEVICES];
 
-#define MOD_MINORS (MOD_SHARED+2)
-
-/* These must be powers of two!!! */
+/* Default queue depths; the allq_depth, bsaq_depth and chnq_depth parameters
+   override them.  These must be powers of two!!! */
 #define MAX_TPR_ALLQ (32*1024)
 #define MAX_TPR_BSAQ  1024
-#define MSG_SIZE      32
+#define MAX_TPR_CHNQ  4096
 
-// DMA Buffer Size, Bytes (could be as small as 512B)
+// Default DMA buffer size, bytes, and count; the rx_bufsize and rx_count
+// parameters override them.  The card's free list counts 10 bits, so the
+// count is also the maximum.
 #define BUF_SIZE 4096
 #define NUMBER_OF_RX_BUFFERS 1023
 
 #define RO_CHANNELS 14
 #define TR_CHANNELS 12
 
-struct TprEntry {
-  u32 word[MSG_SIZE];
-  u64 fifo_tsc;
+//
+//  ioctl interface.  The size encoded in the command is the caller's idea of
+//  the structure; the driver copies out no more than that, so older clients
+//  keep working when fields are appended.  Check version before using
+//  fields added later.
+//
+#define TPR_IOC_MAGIC      'T'
+#define TPR_STATS_VERSION  2
+
+struct TprStats {
+  __u32              version;     // TPR_STATS_VERSION
+  __u32              size;        // sizeof(struct TprStats) in the driver
+  struct TprCounters counters;
+  long long          allwp [MOD_SHARED];
+  long long          bsawp;
+  long long          gwp;
+  // version 2
+  __u64              zcHeld;      // buffers held for zero-copy clients
+  __u64              zcForced;    // buffers recycled ahead of a zero-copy client
+};
+
+#define TPR_IOC_STATS   _IOR(TPR_IOC_MAGIC, 0x01, struct TprStats)
+
+//
+//  Stage latency histograms.  Bin i counts latencies in [2^i, 2^(i+1)) ns.
+//
+#define TPR_LAT_IRQ2BH   0   // tpr_intr to bottom half start
+#define TPR_LAT_BH2WAKE  1   // bottom half start to wake-up of the consumers
+#define TPR_LAT_WAKE2RD  2   // wake-up to tpr_read return, of readers that slept
+#define TPR_LAT_STAGES   3
+#define TPR_LAT_BINS     32
+
+struct TprLatency {
+  __u64              bin[TPR_LAT_STAGES][TPR_LAT_BINS];
+};
+
+#define TPR_IOC_LATENCY  _IOR(TPR_IOC_MAGIC, 0x02, struct TprLatency)
+#define TPR_IOC_LATRESET _IO (TPR_IOC_MAGIC, 0x03)
+
+// Report the client's read pointer into allwp (bsawp for BSA); entries below it are consumed
+#define TPR_IOC_SETRP    _IOW(TPR_IOC_MAGIC, 0x04, long long)
+
+//
+//  Where the card sits, so clients can run on the same NUMA node.
+//
+#define TPR_INFO_VERSION  2
+
+#define TPR_IRQ_INTX      0   // legacy shared line
+#define TPR_IRQ_MSI       1
+#define TPR_IRQ_MSIX      2
+#define TPR_IRQ_NONE      3   // virtual card (vdev)
+
+struct TprInfo {
+  __u32              version;     // TPR_INFO_VERSION
+  __u32              size;        // sizeof(struct TprInfo) in the driver
+  __s32              node;        // NUMA node of the card, -1 if unknown
+  __s32              irq;
+  __u32              domain;      // PCI address
+  __u32              bus;
+  __u32              devfn;
+  __u32              layout;      // TPR_QLAYOUT_xxx
+  __u64              qsize;       // bytes of mmap-able queue window
+  // version 2
+  __u32              irqmode;     // TPR_IRQ_xxx
+  __u32              nvec;        // interrupt vectors in use
 };
 
-struct TprQIndex {
-  long long idx[MAX_TPR_ALLQ];
+#define TPR_IOC_INFO     _IOR(TPR_IOC_MAGIC, 0x05, struct TprInfo)
+
+//
+//  How far the calling client trails the driver, as of its last
+//  TPR_IOC_SETRP.  poll() adds POLLPRI once lag reaches lag_warn percent of
+//  depth.
+//
+#define TPR_CLIENT_VERSION  1
+
+struct TprClient {
+  __u32              version;     // TPR_CLIENT_VERSION
+  __u32              size;        // sizeof(struct TprClient) in the driver
+  __s32              minor;       // channel, -1 for BSA
+  __u32              depth;       // entries the client's ring holds
+  long long          wp;          // write pointer now
+  long long          rp;          // last reported read pointer, -1 if none
+  long long          lag;         // wp - rp
+  long long          maxlag;      // largest lag at a report
+  long long          lost;        // entries overwritten before rp reached them
+  long long          drops;       // hardware drops flagged on the channel
 };
 
+#define TPR_IOC_CLIENT   _IOR(TPR_IOC_MAGIC, 0x06, struct TprClient)
+
+//
+//  Wake only for some events (struct TprFilter above).  A filtered client
+//  that reads at least sizeof(struct TprWake) also learns which entry woke
+//  it; others read the usual 4-byte pending mask.
+//
+#define TPR_IOC_SETFILTER _IOW(TPR_IOC_MAGIC, 0x07, struct TprFilter)
+
 //
-//  Maintain an indexed list into the tprq for each channel
-//  That way, applications of varied rates can jump to the next relevant entry
-//  Consider copying master queue to individual channel queues to reduce RT reqt
+//  Batch a client's wake-ups: wake it once count events have passed its
+//  filter, or usec after the first of them, whichever comes first.  Both
+//  zero wakes it after every bottom half pass that has one.
 //
-struct TprQueues {
-  struct TprEntry  allq  [MAX_TPR_ALLQ]; // master queue of shared messages
-  struct TprEntry  bsaq  [MAX_TPR_BSAQ]; // queue of BSA messages
-  struct TprQIndex allrp [MOD_SHARED];   // indices into allq
-  long long        allwp [MOD_SHARED];   // write pointer into allrp
-  long long        bsawp;                // write pointer into bsaq
-  long long        gwp;
-  int              fifofull;
+#define TPR_BATCH_VERSION  1
+
+struct TprBatch {
+  __u32              version;     // TPR_BATCH_VERSION
+  __u32              count;
+  __u32              usec;
+  __u32              reserved;
 };
 
-#define TPR_SH_MEM_WINDOW   ((sizeof(struct TprQueues) + PAGE_SIZE) & PAGE_MASK)
+#define TPR_IOC_SETBATCH  _IOW(TPR_IOC_MAGIC, 0x08, struct TprBatch)
+
+struct TprWake {
+  __u32              pending;
+  __u32              reserved;
+  long long          rp;          // allwp position of the newest entry that passed
+};
 
 struct TprReg {
   volatile  __u32 reserved_0[0x10000>>2];
@@ -161,7 +372,14 @@ struct TprReg {
 
 // Structure for RX buffers
 struct RxBuffer {
-  struct list_head lh;
   dma_addr_t  dma;
   unchar*     buffer;
+  long long   lastgwp;    /* gwp after the last event in this buffer (zcopy) */
+};
+
+// A physically contiguous run of RX buffers
+struct RxChunk {
+  void*       buffer;
+  dma_addr_t  dma;
+  size_t      size;
 };
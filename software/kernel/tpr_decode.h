@@ -0,0 +1,174 @@
+//
+//  Demultiplexing of one DMA buffer into the queue window: tag parsing,
+//  the event size check, the bsaq/allq/chnq copies or zero-copy
+//  descriptors, the per-channel index fan-out and publication of the write
+//  pointers, as described above tpr_handle_dma.
+//
+//  Shared by tpr.c and the user-space benchmark software/app/tprdecbench.cc,
+//  so it uses nothing but what the includer provides:
+//    memcpy(), smp_wmb(), WRITE_ONCE(), tpr_publish(p,v), TPR_DECODE_TSC(),
+//    TPR_DECODE_HOLD(d, gwp)
+//  and the hooks below, which default to nothing.
+//
+#ifndef _TPR_DECODE_H
+#define _TPR_DECODE_H
+
+#include "tpr_queues.h"
+
+// A message begins (after the tsc is taken)
+#ifndef TPR_DECODE_MSG
+#define TPR_DECODE_MSG(d, msg, tsc)
+#endif
+// A BSA message was published to bsaq
+#ifndef TPR_DECODE_BSA
+#define TPR_DECODE_BSA(d, msg, tag)
+#endif
+// An event message begins, before its size is checked
+#ifndef TPR_DECODE_EVENT
+#define TPR_DECODE_EVENT(d, msg)
+#endif
+// Minors of an event's channels with filtered clients to wake, 0 for none
+#ifndef TPR_DECODE_FILTER
+#define TPR_DECODE_FILTER(d, msg, mch) 0
+#endif
+// An event was copied, just before gwp is published
+#ifndef TPR_DECODE_EVENT_DONE
+#define TPR_DECODE_EVENT_DONE(d, msg, tsc)
+#endif
+// A malformed message ends the buffer
+#ifndef TPR_DECODE_ERROR
+#define TPR_DECODE_ERROR(d, msg)
+#endif
+// Zero-copy: hold buffer d->buffer off the card until the readers are
+// past gwp, the gwp after its last event.  Required: without it the
+// buffers are never recycled and DMA stalls.
+#ifndef TPR_DECODE_HOLD
+#error "TPR_DECODE_HOLD(d, gwp) must be defined before including tpr_decode.h"
+#endif
+
+struct tpr_decode {
+  void*               ctx;            /* For the hooks */
+  struct TprQueues*   tprq;
+  struct TprEntry*    allq;           /* Regions of the window, NULL if not in this layout */
+  struct TprEntry*    bsaq;
+  long long*          allrp;
+  struct TprEntry*    chnq;
+  struct TprZcQueues* zcq;
+  unsigned            allqmask;
+  unsigned            bsaqmask;
+  unsigned            chnqmask;
+  __u64               now;            /* Time of the pass, ns, for the hooks */
+  // Per buffer
+  unsigned            buffer;         /* Index of the buffer (zero-copy descriptors) */
+  const unsigned char* base;          /*   its start */
+  // Accumulated over buffers
+  __u32               wmask;          /* Minors with new entries */
+  __u32               fwmask;         /* Minors with filtered clients to consider */
+  unsigned            nmsg;
+};
+
+// Decode the messages of one buffer, up to its END_TAG.  A malformed
+// message is overwritten with END_TAG and ends the buffer.
+static inline void tpr_decode_buffer(struct tpr_decode* d, __u32* dptr)
+{
+  struct TprQueues* tprq = d->tprq;
+  struct TprEntry*  pEntry;
+  __u32             mtyp, ich, mch, drop;
+  __u64             tsc;
+
+  while( ((dptr[0]>>16)&0xf) != END_TAG ) {
+
+    tsc = TPR_DECODE_TSC();
+    d->nmsg++;
+    TPR_DECODE_MSG(d, dptr, tsc);
+
+    //  Check if a drop preceded us.  Counted against the channels of
+    //  this message, or BSA, in the case below.
+    drop = dptr[0] & (0x808<<20);
+    if (drop)
+      tprq->fifofull = 1;
+
+    //  Check the message type
+    mtyp = (dptr[0]>>16)&0xf;
+    switch (mtyp) {
+    case BSACNTL_TAG:
+    case BSAEVNT_TAG:
+        d->wmask = d->wmask | (1 << (MOD_SHARED+1));
+        smp_wmb();
+        pEntry = &d->bsaq[tprq->bsawp & d->bsaqmask];
+        memcpy(pEntry, dptr, mtyp == BSACNTL_TAG ? BSACNTL_MSGSZ : BSAEVNT_MSGSZ);
+        pEntry->seq      = tprq->bsawp;
+        pEntry->fifo_tsc = tsc;
+        if (drop)
+          WRITE_ONCE(tprq->bsadrops, tprq->bsadrops+1);
+        tpr_publish(&tprq->bsawp, tprq->bsawp+1);
+        TPR_DECODE_BSA(d, dptr, mtyp);
+        dptr += (mtyp == BSACNTL_TAG ? BSACNTL_MSGSZ : BSAEVNT_MSGSZ)>>2;
+        break;
+    case EVENT_TAG:
+        TPR_DECODE_EVENT(d, dptr);
+        mch = (dptr[0]>>0)&((1<<MOD_SHARED)-1);
+        if (((dptr[1]<<2)+8)!=EVENT_MSGSZ) {
+          TPR_DECODE_ERROR(d, dptr);
+          dptr[0] = END_TAG << 16;  // terminate
+          break;
+        }
+        d->wmask = d->wmask | mch;
+        if (drop)
+          for( ich=0; ich<MOD_SHARED; ich++)
+            if (mch & (1<<ich))
+              WRITE_ONCE(tprq->drops[ich], tprq->drops[ich]+1);
+        d->fwmask = d->fwmask | TPR_DECODE_FILTER(d, dptr, mch);
+        smp_wmb();
+        if (d->chnq) {
+          //  Copy the message into each channel's own ring
+          for( ich=0; mch; ich++) {
+              if (mch & (1<<ich)) {
+                  mch = mch & ~(1<<ich);
+                  pEntry = &d->chnq[ich*(d->chnqmask+1) + (tprq->allwp[ich] & d->chnqmask)];
+                  memcpy(pEntry, dptr, EVENT_MSGSZ);
+                  pEntry->seq      = tprq->allwp[ich];
+                  pEntry->fifo_tsc = tsc;
+                  tpr_publish(&tprq->allwp[ich], tprq->allwp[ich]+1);
+              }
+          }
+        }
+        else {
+          if (d->zcq) {
+            //  Point at the message where the card left it
+            struct TprDesc* pDesc = &d->zcq->desc[tprq->gwp & d->allqmask];
+            pDesc->buffer   = d->buffer;
+            pDesc->offset   = (const unsigned char*)dptr - d->base;
+            pDesc->fifo_tsc = tsc;
+          }
+          else {
+            pEntry = &d->allq[tprq->gwp & d->allqmask];
+            memcpy(pEntry, dptr, EVENT_MSGSZ);
+            pEntry->seq      = tprq->gwp;
+            pEntry->fifo_tsc = tsc;
+          }
+          for( ich=0; mch; ich++) {
+              if (mch & (1<<ich)) {
+                  mch = mch & ~(1<<ich);
+                  d->allrp[(unsigned long)ich*(d->allqmask+1) + (tprq->allwp[ich] & d->allqmask)] = tprq->gwp;
+                  tpr_publish(&tprq->allwp[ich], tprq->allwp[ich]+1);
+              }
+          }
+        }
+        TPR_DECODE_EVENT_DONE(d, dptr, tsc);
+        dptr += EVENT_MSGSZ>>2;
+        tpr_publish(&tprq->gwp, tprq->gwp+1);
+        break;
+    default:
+        TPR_DECODE_ERROR(d, dptr);
+        dptr[0] = END_TAG << 16;  // terminate
+        break;
+    }
+  }
+
+  //  The descriptors point into the buffer
+  if (d->zcq)
+    TPR_DECODE_HOLD(d, tprq->gwp);
+}
+
+#endif
@@ -0,0 +1,166 @@
+//
+//  The queue window shared with user space: message tags, ring entries and
+//  the header that locates the rings.  Free of kernel-only types so that
+//  user-space tools (see tpr_decode.h) can include it too.
+//
+#ifndef _TPR_QUEUES_H
+#define _TPR_QUEUES_H
+
+#include <linux/types.h>
+
+// TPR message tags
+#define EVENT_TAG    0
+#define BSACNTL_TAG  1
+#define BSAEVNT_TAG  2
+#define END_TAG     15
+
+#define EVENT_MSGSZ    92
+#define BSACNTL_MSGSZ  44
+#define BSAEVNT_MSGSZ  44
+
+#define MOD_SHARED 14
+#define MSG_SIZE      32
+
+//  seq is the write pointer the entry was published at (gwp in allq,
+//  allwp[] in chnq, bsawp in bsaq).  A reader at rp that finds seq != rp
+//  has been lapped.
+struct TprEntry {
+  __u32     word[MSG_SIZE-2];
+  long long seq;
+  __u64     fifo_tsc;
+};
+
+//
+//  BSA messages are also folded, in the driver, into one ring of records
+//  per EDEF (event definition), so a consumer of one acquisition follows
+//  only the pulses that concern it.  Each BSA message carries 64-bit EDEF
+//  masks; a record is appended to the ring of every EDEF with a bit set in
+//  any of them, and status says which.
+//
+#define TPR_EDEFS  64
+
+#define TPR_EDEF_INIT     (1<<0)    // control: acquisition (re)started
+#define TPR_EDEF_MINOR    (1<<1)    //   minor severity
+#define TPR_EDEF_MAJOR    (1<<2)    //   major severity
+#define TPR_EDEF_ACTIVE   (1<<3)    // event: pulse is acquired
+#define TPR_EDEF_AVGDONE  (1<<4)    //   average complete
+#define TPR_EDEF_UPDATE   (1<<5)    //   update the result
+
+struct TprEdefRec {
+  __u64     pulseId;
+  __u64     timeStamp;
+  __u32     status;     // TPR_EDEF_xxx
+  __u32     reserved;
+  long long seq;        // edefwp[] it was published at
+};
+
+//
+//  Maintain an indexed list into the tprq for each channel
+//  That way, applications of varied rates can jump to the next relevant entry
+//  Alternatively (qlayout=1), each channel gets its own ring of entries in
+//  chnq so that readers walk memory linearly.  allwp[] then indexes
+//  chnq and allq/allrp are not present.
+//  With zcopy=1, events are not copied at all: allrp indexes a ring of
+//  TprDesc in TprZcQueues pointing into the DMA buffers, which are mapped
+//  read-only at TPR_ZC_MMAP_OFFSET.  allq is not present.
+//
+#define TPR_QLAYOUT_INDEX   0
+#define TPR_QLAYOUT_CHANNEL 1
+#define TPR_QLAYOUT_ZCOPY   2
+
+//
+//  The queue window starts with this header.  It describes where each ring
+//  lives and how deep it is, so clients need not be rebuilt when the depths
+//  change.  Offsets are bytes from the start of the window, page aligned,
+//  and 0 for rings the layout does not use.
+//
+//    bsaq   [bsaqdepth]                 struct TprEntry
+//    allq   [allqdepth]                 struct TprEntry
+//    allrp  [MOD_SHARED][allqdepth]     long long, gwp of each channel entry
+//    chnq   [MOD_SHARED][chnqdepth]     struct TprEntry
+//    zcq                                struct TprZcQueues, desc[allqdepth]
+//    edefq  [TPR_EDEFS][edefqdepth]     struct TprEdefRec
+//
+#define TPR_QMAGIC    0x51525054   // "TPRQ"
+#define TPR_QVERSION  4
+
+//
+//  Host TSC to timing-system time, refitted every clk_ms.  The timing
+//  time, in ns, of cycle count c is
+//    ts0 + ((c - tsc0) * mult >> 32)
+//  The line runs through the least-delayed event of each period, so it
+//  gives the timestamp of an event handled as early as the driver ever
+//  handles one; latmean and latmax say how much later events are handled
+//  on top of that.  Like a seqcount, seq is odd while the fields change.
+//
+struct TprClock {
+  __u32            seq;
+  __u32            valid;                // a rate has been fitted
+  __u64            tsc0;
+  __u64            ts0;                  // ns, timing epoch
+  __u64            mult;                 // ns per cycle, 32.32
+  __u64            latmean;              // ns past the fastest, last period
+  __u64            latmax;
+  __u64            nsamples;             // events in the last period
+  __u64            updates;
+};
+
+struct TprQueues {
+  __u32            magic;                // TPR_QMAGIC
+  __u32            version;              // TPR_QVERSION
+  __u32            hdrsize;              // sizeof(struct TprQueues)
+  int              layout;               // TPR_QLAYOUT_xxx
+  __u32            nchan;                // MOD_SHARED
+  __u32            entrysize;            // sizeof(struct TprEntry)
+  __u32            allqdepth;            // allq, each allrp row, zero-copy desc
+  __u32            bsaqdepth;
+  __u32            chnqdepth;            // each chnq row
+  __u32            nbuffers;             // DMA buffers
+  __u32            bufsize;              //   bytes each
+  __u32            reserved0;
+  __u64            bsaqoff;
+  __u64            allqoff;
+  __u64            allrpoff;
+  __u64            chnqoff;
+  __u64            zcqoff;
+  __u64            size;                 // bytes in the window
+  long long        allwp [MOD_SHARED];   // write pointer into allrp (or chnq)
+  long long        bsawp;                // write pointer into bsaq
+  long long        gwp;
+  int              fifofull;             // a hardware drop was flagged
+  int              reserved1;
+  long long        drops [MOD_SHARED];   // messages flagged with a hardware drop, per channel
+  long long        bsadrops;
+  // version 3
+  __u32            edefqdepth;           // each edefq row
+  __u32            reserved2;
+  __u64            edefqoff;
+  long long        edefwp [TPR_EDEFS];   // write pointer into each edefq row
+  // version 4
+  struct TprClock  clock;
+};
+
+//
+//  Zero-copy descriptors.  Message gwp lives in DMA buffer desc[gwp].buffer
+//  at byte desc[gwp].offset.  A buffer is handed back to the hardware only
+//  after every client that reports its position (TPR_IOC_SETRP) has moved
+//  past it, or when more than zc_hold buffers are held.  freewp is raised
+//  before a buffer is handed back: a reader whose gwp is below freewp after
+//  copying a message must discard the copy.
+//
+struct TprDesc {
+  __u32            buffer;
+  __u32            offset;
+  __u64            fifo_tsc;
+};
+
+struct TprZcQueues {
+  long long        freewp;               // descriptors below this may be stale
+  long long        reserved[7];
+  struct TprDesc   desc  [];             // allqdepth
+};
+
+// mmap offset of the DMA buffers (zcopy), buffer i at + i*bufsize
+#define TPR_ZC_MMAP_OFFSET  0x40000000UL
+
+#endif
@@ -0,0 +1,161 @@
+//
+//  Tracepoints on the interrupt and DMA path.  They cost a patched-out
+//  branch each while disabled.  Enable them with ftrace or perf:
+//
+//    echo 1 > /sys/kernel/tracing/events/tpr/enable
+//    perf record -e 'tpr:*' -e 'sched:sched_switch' -a
+//
+//  card is the index of the card in gDevices, minor as in /dev/tpr<card><minor>.
+//
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM tpr
+
+#if !defined(_TPR_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TPR_TRACE_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(tpr_irq,
+  TP_PROTO(int card, u32 stat, int msi),
+  TP_ARGS(card, stat, msi),
+  TP_STRUCT__entry(
+    __field(int, card)
+    __field(u32, stat)
+    __field(int, msi)
+  ),
+  TP_fast_assign(
+    __entry->card = card;
+    __entry->stat = stat;
+    __entry->msi  = msi;
+  ),
+  TP_printk("card=%d stat=%#x msi=%d", __entry->card, __entry->stat, __entry->msi)
+);
+
+TRACE_EVENT(tpr_dma_start,
+  TP_PROTO(int card, int polled, unsigned pend),
+  TP_ARGS(card, polled, pend),
+  TP_STRUCT__entry(
+    __field(int,      card)
+    __field(int,      polled)
+    __field(unsigned, pend)
+  ),
+  TP_fast_assign(
+    __entry->card   = card;
+    __entry->polled = polled;
+    __entry->pend   = pend;
+  ),
+  TP_printk("card=%d polled=%d pend=%u", __entry->card, __entry->polled, __entry->pend)
+);
+
+TRACE_EVENT(tpr_dma_end,
+  TP_PROTO(int card, unsigned nbuf, unsigned nmsg, u32 wmask, long long gwp),
+  TP_ARGS(card, nbuf, nmsg, wmask, gwp),
+  TP_STRUCT__entry(
+    __field(int,       card)
+    __field(unsigned,  nbuf)
+    __field(unsigned,  nmsg)
+    __field(u32,       wmask)
+    __field(long long, gwp)
+  ),
+  TP_fast_assign(
+    __entry->card  = card;
+    __entry->nbuf  = nbuf;
+    __entry->nmsg  = nmsg;
+    __entry->wmask = wmask;
+    __entry->gwp   = gwp;
+  ),
+  TP_printk("card=%d buffers=%u messages=%u wmask=%#x gwp=%lld",
+            __entry->card, __entry->nbuf, __entry->nmsg, __entry->wmask, __entry->gwp)
+);
+
+TRACE_EVENT(tpr_msg,
+  TP_PROTO(int card, u32 word0, u64 tsc),
+  TP_ARGS(card, word0, tsc),
+  TP_STRUCT__entry(
+    __field(int, card)
+    __field(u32, word0)
+    __field(u64, tsc)
+  ),
+  TP_fast_assign(
+    __entry->card  = card;
+    __entry->word0 = word0;
+    __entry->tsc   = tsc;
+  ),
+  TP_printk("card=%d tag=%u chmask=%#x drop=%d tsc=%llu",
+            __entry->card, (__entry->word0>>16)&0xf, __entry->word0&0xffff,
+            (__entry->word0 & (0x808<<20)) != 0, __entry->tsc)
+);
+
+TRACE_EVENT(tpr_wake,
+  TP_PROTO(int card, int minor, unsigned long gen, int sleepers),
+  TP_ARGS(card, minor, gen, sleepers),
+  TP_STRUCT__entry(
+    __field(int,           card)
+    __field(int,           minor)
+    __field(unsigned long, gen)
+    __field(int,           sleepers)
+  ),
+  TP_fast_assign(
+    __entry->card     = card;
+    __entry->minor    = minor;
+    __entry->gen      = gen;
+    __entry->sleepers = sleepers;
+  ),
+  TP_printk("card=%d minor=%d gen=%lu sleepers=%d",
+            __entry->card, __entry->minor, __entry->gen, __entry->sleepers)
+);
+
+// A filtered or batched client woken by tpr_filter_wake; events is how
+// many passed its filter since the last wake-up
+TRACE_EVENT(tpr_fwake,
+  TP_PROTO(int card, int minor, int client, unsigned long gen, u32 events, int sleepers),
+  TP_ARGS(card, minor, client, gen, events, sleepers),
+  TP_STRUCT__entry(
+    __field(int,           card)
+    __field(int,           minor)
+    __field(int,           client)
+    __field(unsigned long, gen)
+    __field(u32,           events)
+    __field(int,           sleepers)
+  ),
+  TP_fast_assign(
+    __entry->card     = card;
+    __entry->minor    = minor;
+    __entry->client   = client;
+    __entry->gen      = gen;
+    __entry->events   = events;
+    __entry->sleepers = sleepers;
+  ),
+  TP_printk("card=%d minor=%d client=%d gen=%lu events=%u sleepers=%d",
+            __entry->card, __entry->minor, __entry->client, __entry->gen,
+            __entry->events, __entry->sleepers)
+);
+
+TRACE_EVENT(tpr_read,
+  TP_PROTO(int card, int minor, int client, unsigned long gen, long ret),
+  TP_ARGS(card, minor, client, gen, ret),
+  TP_STRUCT__entry(
+    __field(int,           card)
+    __field(int,           minor)
+    __field(int,           client)
+    __field(unsigned long, gen)
+    __field(long,          ret)
+  ),
+  TP_fast_assign(
+    __entry->card   = card;
+    __entry->minor  = minor;
+    __entry->client = client;
+    __entry->gen    = gen;
+    __entry->ret    = ret;
+  ),
+  TP_printk("card=%d minor=%d client=%d gen=%lu ret=%ld",
+            __entry->card, __entry->minor, __entry->client, __entry->gen, __entry->ret)
+);
+
+#endif
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE tpr_trace
+#include <trace/define_trace.h>